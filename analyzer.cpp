@@ -0,0 +1,373 @@
+#include "analyzer.h"
+#include "machine.h"
+#include "hash.h"
+#include <string.h> //memset()
+#include <stdlib.h> //abs()
+#include <pthread.h>
+#include <unistd.h> //sysconf()
+#include <dirent.h> //opendir()
+#include <fcntl.h> //open()
+#include <sys/mman.h> //mmap()
+#include <sys/stat.h> //fstat(), lstat()
+#include <algorithm> //std::sort()
+
+static const char* variantNames[] = { "chip8", "schip", "xochip" };
+
+// super-chip extensions, none of them are in the opcode table
+static bool isSchip(uint16_t op)
+{
+   return ((op&0xFFF0) == 0x00C0) ||                   // 00CN scroll down
+          ((op >= 0x00FB) && (op <= 0x00FF)) ||         // scroll, exit, lores/hires
+          ((op&0xF00F) == 0xD000) ||                   // DXY0 16x16 sprite
+          ((op&0xF0FF) == 0xF030) ||                   // FX30 big font
+          ((op&0xF0FF) == 0xF075) || ((op&0xF0FF) == 0xF085); // FX75/FX85 flags
+}
+
+static bool isXochip(uint16_t op)
+{
+   return ((op&0xFFF0) == 0x00D0) ||                   // 00DN scroll up
+          ((op&0xF00F) == 0x5002) || ((op&0xF00F) == 0x5003) || // 5XY2/5XY3 ranges
+          (op == 0xF000) ||                            // F000 NNNN long I
+          ((op&0xF0FF) == 0xF001) ||                   // FN01 planes
+          (op == 0xF002) ||                            // F002 audio pattern
+          ((op&0xF0FF) == 0xF03A);                     // FX3A pitch
+}
+
+// opcode at an address of the loaded image, -1 outside it
+static int fetch(const uint8_t* rom, size_t size, uint32_t addr)
+{
+   if((addr < START_ADDRESS) || ((size_t)(addr-START_ADDRESS)+1 >= size))
+      return -1;
+   return (rom[addr-START_ADDRESS]<<8) | rom[addr-START_ADDRESS+1];
+}
+
+// a store through I, [first, first+length) in memory
+struct Store
+{
+   uint32_t first;
+   uint32_t length;
+};
+
+// descent work item, I is the value set by the last ANNN on the path or -1
+struct Path
+{
+   uint16_t pc;
+   int32_t I;
+};
+
+void RomAnalyzer::analyze(const uint8_t* rom, size_t size, RomStats* stats)
+{
+   stats->bytes = size;
+   stats->hash = hashBytes(rom, size);
+   stats->words = 0;
+   stats->unknown = 0;
+   stats->reachable = 0;
+   stats->indirect = false;
+   stats->selfModifying = false;
+   stats->schipOps = 0;
+   stats->xochipOps = 0;
+   memset(stats->histogram, 0, sizeof(stats->histogram));
+
+   // linear sweep, data and code alike
+   for(size_t i=0; i<size; i+=2)
+   {
+      uint16_t op = (rom[i]<<8) | ((i+1 < size) ? rom[i+1] : 0);
+      ++stats->words;
+      if(decodeOpcode(op).kind == OP_UNKNOWN)
+         ++stats->unknown;
+   }
+
+   // recursive descent, only instructions some path reaches count
+   uint8_t visited[MEMORY_SIZE];
+   uint8_t code[MEMORY_SIZE];
+   memset(visited, 0, sizeof(visited));
+   memset(code, 0, sizeof(code));
+   std::vector<Path> work;
+   std::vector<Store> stores;
+   Path start = { START_ADDRESS, -1 };
+   work.push_back(start);
+
+   while(!work.empty())
+   {
+      Path p = work.back();
+      work.pop_back();
+
+      for(;;)
+      {
+         int fetched = ((p.pc+1) < MEMORY_SIZE) ? fetch(rom, size, p.pc) : -1;
+         if((fetched < 0) || visited[p.pc])
+            break;
+         visited[p.pc] = 1;
+
+         uint16_t op = fetched;
+         const OpInfo& info = decodeOpcode(op);
+         int length = (op == 0xF000) ? 4 : 2;
+         for(int k=0; (k<length) && (p.pc+k < MEMORY_SIZE); k++)
+            code[p.pc+k] = 1;
+
+         // xo-chip 5XY2/5XY3 decode as 5XY0 but store / load the registers
+         // VX..VY and fall through, they are counted as FX55/FX65
+         bool range = ((op&0xF00F) == 0x5002) || ((op&0xF00F) == 0x5003);
+         int kind = info.kind;
+         if(range)
+            kind = ((op&0xF) == 0x2) ? OP_STORE : OP_LOAD;
+
+         ++stats->reachable;
+         ++stats->histogram[kind];
+         bool schip = isSchip(op);
+         bool xochip = isXochip(op);
+         stats->schipOps += schip;
+         stats->xochipOps += xochip;
+
+         // unknown to every variant, the path ran into data
+         if((kind == OP_UNKNOWN) && !schip && !xochip)
+            break;
+
+         uint16_t next = p.pc + length;
+         bool fallThrough = true;
+         switch(kind)
+         {
+            case OP_RTN:
+               fallThrough = false;
+               break;
+            case OP_JMP:
+               next = info.nnn;
+               break;
+            case OP_JSR:
+            {
+               Path callee = { info.nnn, p.I };
+               work.push_back(callee);
+               break;
+            }
+            case OP_JMP_V0:
+               stats->indirect = true;
+               fallThrough = false;
+               break;
+            case OP_SKIP_EQ_IMM:
+            case OP_SKIP_NE_IMM:
+            case OP_SKIP_EQ:
+            case OP_SKIP_NE:
+            case OP_SKIP_PRESS:
+            case OP_SKIP_NPRESS:
+            {
+               // xo-chip skips jump over the whole 4 byte F000 NNNN
+               Path skipped = { (uint16_t)(next + ((fetch(rom, size, next) == 0xF000) ? 4 : 2)), p.I };
+               work.push_back(skipped);
+               break;
+            }
+            case OP_MOV_I:
+               p.I = info.nnn;
+               break;
+            case OP_ADD_I:
+            case OP_FONT:
+               p.I = -1;
+               break;
+            case OP_BCD:
+               if(p.I >= 0)
+               {
+                  Store s = { (uint32_t)p.I, 3 };
+                  stores.push_back(s);
+               }
+               break;
+            case OP_STORE:
+               if(p.I >= 0)
+               {
+                  uint32_t count = range ? abs(info.x-info.y)+1 : info.x+1;
+                  Store s = { (uint32_t)p.I, count };
+                  stores.push_back(s);
+               }
+               break;
+            default:
+               break;
+         }
+
+         if(op == 0x00FD) // super-chip exit
+            fallThrough = false;
+         else if(op == 0xF000)
+            p.I = fetch(rom, size, p.pc+2);
+
+         if(!fallThrough)
+            break;
+         p.pc = next;
+      }
+   }
+
+   for(size_t i=0; (i<stores.size()) && !stats->selfModifying; i++)
+   {
+      for(uint32_t a=stores[i].first; a<stores[i].first+stores[i].length; a++)
+      {
+         if((a < MEMORY_SIZE) && code[a])
+         {
+            stats->selfModifying = true;
+            break;
+         }
+      }
+   }
+
+   if(stats->xochipOps > 0)
+      stats->variant = ROM_XOCHIP;
+   else if(stats->schipOps > 0)
+      stats->variant = ROM_SCHIP;
+   else
+      stats->variant = ROM_CHIP8;
+}
+
+RomAnalyzer::RomAnalyzer() :
+   next(0)
+{
+}
+
+bool RomAnalyzer::scan(const char* dir)
+{
+   DIR* d = opendir(dir);
+   if(d == NULL)
+   {
+      fprintf(stderr, "Cannot read directory %s\n", dir);
+      return false;
+   }
+   closedir(d);
+
+   results.clear();
+   scanDir(dir);
+   std::sort(results.begin(), results.end(),
+             [](const RomStats& a, const RomStats& b) { return a.path < b.path; });
+   return true;
+}
+
+void RomAnalyzer::scanDir(const std::string& dir)
+{
+   DIR* d = opendir(dir.c_str());
+   if(d == NULL)
+      return;
+
+   struct dirent* entry;
+   while((entry = readdir(d)) != NULL)
+   {
+      if(entry->d_name[0] == '.')
+         continue;
+      std::string path = dir + "/" + entry->d_name;
+      // symlinked directories are not followed, they can loop back up the
+      // tree, a symlink to a file counts as the file
+      struct stat st;
+      if(lstat(path.c_str(), &st) != 0)
+         continue;
+      bool link = S_ISLNK(st.st_mode);
+      if(link && (stat(path.c_str(), &st) != 0))
+         continue;
+      if(S_ISDIR(st.st_mode))
+      {
+         if(!link)
+            scanDir(path);
+      }
+      else if(S_ISREG(st.st_mode))
+      {
+         RomStats stats;
+         stats.path = path;
+         stats.ok = false;
+         results.push_back(stats);
+      }
+   }
+   closedir(d);
+}
+
+void RomAnalyzer::run(int threads)
+{
+   if(threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if(threads > (int)results.size())
+      threads = results.size();
+   if(threads < 1)
+      threads = 1;
+
+   next = 0;
+   std::vector<pthread_t> workers(threads);
+   for(int i=0; i<threads; i++)
+      pthread_create(&workers[i], NULL, workerMain, this);
+   for(int i=0; i<threads; i++)
+      pthread_join(workers[i], NULL);
+}
+
+void* RomAnalyzer::workerMain(void* arg)
+{
+   RomAnalyzer* analyzer = (RomAnalyzer*) arg;
+   for(;;)
+   {
+      size_t n = analyzer->next.fetch_add(1, std::memory_order_relaxed);
+      if(n >= analyzer->results.size())
+         break;
+      analyzer->analyzeFile(&analyzer->results[n]);
+   }
+   return NULL;
+}
+
+void RomAnalyzer::analyzeFile(RomStats* stats)
+{
+   int fd = open(stats->path.c_str(), O_RDONLY);
+   struct stat st;
+   if((fd < 0) || (fstat(fd, &st) < 0))
+   {
+      if(fd >= 0)
+         close(fd);
+      return;
+   }
+
+   // empty files cannot be mapped but are still reported
+   const uint8_t* rom = NULL;
+   if(st.st_size > 0)
+   {
+      rom = (const uint8_t*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(rom == MAP_FAILED)
+      {
+         close(fd);
+         return;
+      }
+      madvise((void*)rom, st.st_size, MADV_SEQUENTIAL);
+   }
+   close(fd);
+
+   analyze(rom, st.st_size, stats);
+   stats->ok = true;
+   if(rom != NULL)
+      munmap((void*)rom, st.st_size);
+}
+
+void RomAnalyzer::writeCsv(FILE* out) const
+{
+   fprintf(out, "path,bytes,hash,words,unknown,reachable,indirect,self_modifying,schip_ops,xochip_ops,variant");
+   for(int k=0; k<OP_KINDS; k++)
+      fprintf(out, ",%s", opcodePattern(k));
+   fprintf(out, "\n");
+
+   for(size_t i=0; i<results.size(); i++)
+   {
+      const RomStats& s = results[i];
+      if(!s.ok)
+      {
+         fprintf(stderr, "Cannot read %s\n", s.path.c_str());
+         continue;
+      }
+
+      // quote paths with separators, doubling embedded quotes
+      bool quote = s.path.find_first_of(",\"\n") != std::string::npos;
+      if(quote)
+      {
+         fputc('"', out);
+         for(size_t c=0; c<s.path.size(); c++)
+         {
+            if(s.path[c] == '"')
+               fputc('"', out);
+            fputc(s.path[c], out);
+         }
+         fputc('"', out);
+      }
+      else
+         fputs(s.path.c_str(), out);
+
+      fprintf(out, ",%zu,%016llx,%i,%i,%i,%i,%i,%i,%i,%s",
+              s.bytes, (unsigned long long)s.hash, s.words, s.unknown, s.reachable,
+              s.indirect, s.selfModifying, s.schipOps, s.xochipOps, variantNames[s.variant]);
+      for(int k=0; k<OP_KINDS; k++)
+         fprintf(out, ",%u", s.histogram[k]);
+      fprintf(out, "\n");
+   }
+}
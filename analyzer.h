@@ -0,0 +1,92 @@
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "opcodes.h"
+
+enum RomVariant
+{
+   ROM_CHIP8,
+   ROM_SCHIP,   // uses 00CN/00FB-00FF, DXY0, FX30/75/85
+   ROM_XOCHIP   // uses 00DN, 5XY2/5XY3, F000 NNNN, FN01, F002, FX3A
+};
+
+struct RomStats
+{
+   std::string path;
+   bool ok;                      // mapped and analyzed
+   size_t bytes;
+   uint64_t hash;                // FNV-1a of the file, spots duplicates
+
+   // linear sweep, the same listing disassemble() prints
+   int words;
+   int unknown;
+
+   // recursive descent from the start address
+   int reachable;                // instructions on some control flow path
+   bool indirect;                // BNNN seen, reachable is a lower bound
+   bool selfModifying;           // FX33/FX55/5XY2 with a known I hit code
+   int schipOps;
+   int xochipOps;
+   RomVariant variant;
+   uint32_t histogram[OP_KINDS]; // per kind over the reachable code
+};
+
+/**
+ * Static analysis of a ROM corpus.
+ *
+ * Every file below a directory is memory mapped and analyzed on its own
+ * by a pool of worker threads, one per core. Workers take the next file
+ * from a shared counter and write to their own result slot, so nothing
+ * is locked and the run scales with the cores until the disk is the
+ * limit. Results are reported sorted by path whatever the thread count.
+ */
+class RomAnalyzer
+{
+public:
+   RomAnalyzer();
+
+   /**
+    * Collects the regular files below a directory, recursively without
+    * following symlinked directories.
+    *
+    * @return false when the directory cannot be read
+    */
+   bool scan(const char* dir);
+
+   /**
+    * Analyzes every collected file.
+    *
+    * @param[in] threads: Worker count, 0 for one per online cpu
+    */
+   void run(int threads);
+
+   /**
+    * One CSV row per ROM after a header, the histogram columns are named
+    * by opcode pattern.
+    */
+   void writeCsv(FILE* out) const;
+
+   size_t count() const { return results.size(); }
+
+   /**
+    * Analyzes one ROM image loaded at START_ADDRESS.
+    */
+   static void analyze(const uint8_t* rom, size_t size, RomStats* stats);
+
+private:
+   static void* workerMain(void* arg);
+   void scanDir(const std::string& dir);
+   void analyzeFile(RomStats* stats);
+
+   std::vector<RomStats> results;
+   std::atomic<size_t> next;
+};
+
+#endif //ANALYZER_H
@@ -0,0 +1,211 @@
+#include "audio.h"
+#include <string.h> //memset()
+#include <math.h> //pow()
+#ifdef BUILD_SDL
+#include "SDL/SDL.h"
+#endif
+
+// square wave amplitude
+#define AUDIO_VOLUME 6000
+
+// largest block frame() will render
+#define AUDIO_MAX_BLOCK (2*AUDIO_RATE/AUDIO_FRAME_RATE)
+
+static void put16(uint8_t* p, uint16_t value)
+{
+   p[0] = value&0xFF;
+   p[1] = value>>8;
+}
+
+static void put32(uint8_t* p, uint32_t value)
+{
+   put16(p, value&0xFFFF);
+   put16(p+2, value>>16);
+}
+
+static void writeWavHeader(FILE* f, uint32_t samples)
+{
+   uint8_t h[44];
+   memcpy(h, "RIFF", 4);
+   put32(h+4, 36 + samples*2);
+   memcpy(h+8, "WAVEfmt ", 8);
+   put32(h+16, 16);            // fmt chunk size
+   put16(h+20, 1);             // pcm
+   put16(h+22, 1);             // mono
+   put32(h+24, AUDIO_RATE);
+   put32(h+28, AUDIO_RATE*2);  // byte rate
+   put16(h+32, 2);             // block align
+   put16(h+34, 16);            // bits per sample
+   memcpy(h+36, "data", 4);
+   put32(h+40, samples*2);
+   fwrite(h, 1, sizeof(h), f);
+}
+
+AudioOutput::AudioOutput() :
+   position(0),
+   remainder(0),
+   wav(NULL),
+   wavSamples(0),
+   device(false),
+   underrunCount(0),
+   lastSample(0)
+{
+}
+
+AudioOutput::~AudioOutput()
+{
+   close();
+}
+
+bool AudioOutput::openWav(const char* path)
+{
+   wav = fopen(path, "wb");
+   if(wav == NULL)
+   {
+      fprintf(stderr, "Cannot open audio output %s\n", path);
+      return false;
+   }
+
+   // sizes are patched in close()
+   wavSamples = 0;
+   writeWavHeader(wav, 0);
+   return true;
+}
+
+bool AudioOutput::openDevice()
+{
+#ifdef BUILD_SDL
+   SDL_AudioSpec want;
+   memset(&want, 0, sizeof(want));
+   want.freq = AUDIO_RATE;
+   want.format = AUDIO_S16SYS;
+   want.channels = 1;
+   want.samples = 512;
+   want.callback = callback;
+   want.userdata = this;
+
+   if(SDL_OpenAudio(&want, NULL) < 0)
+   {
+      fprintf(stderr, "Cannot open audio device\n");
+      return false;
+   }
+   device = true;
+   SDL_PauseAudio(0);
+   return true;
+#else
+   return false;
+#endif
+}
+
+void AudioOutput::close()
+{
+   if(wav != NULL)
+   {
+      fseek(wav, 0, SEEK_SET);
+      writeWavHeader(wav, wavSamples);
+      fclose(wav);
+      wav = NULL;
+   }
+
+#ifdef BUILD_SDL
+   if(device)
+   {
+      SDL_CloseAudio();
+      device = false;
+   }
+#endif
+}
+
+void AudioOutput::frame(bool           active,
+                        const uint8_t* pattern,
+                        uint8_t        pitch)
+{
+   if((wav == NULL) && !device)
+      return;
+
+   int count = AUDIO_RATE/AUDIO_FRAME_RATE;
+   remainder += AUDIO_RATE%AUDIO_FRAME_RATE;
+   if(remainder >= AUDIO_FRAME_RATE)
+   {
+      remainder -= AUDIO_FRAME_RATE;
+      ++count;
+   }
+
+   if(device)
+   {
+      // dynamic rate control: render more when the ring drains and less
+      // when it fills, so the frame rate of the cpu loop never matters
+      double error = (double)((int)AUDIO_TARGET_FILL - (int)ring.size()) / AUDIO_TARGET_FILL;
+      double ratio = 1.0 + 0.5*error;
+      if(ratio < 0.25)
+         ratio = 0.25;
+      if(ratio > 1.75)
+         ratio = 1.75;
+      count = (int)(count*ratio + 0.5);
+   }
+
+   int16_t block[AUDIO_MAX_BLOCK];
+   if(count > AUDIO_MAX_BLOCK)
+      count = AUDIO_MAX_BLOCK;
+   render(block, count, active, pattern, pitch);
+
+   if(wav != NULL)
+   {
+      uint8_t bytes[AUDIO_MAX_BLOCK*2];
+      for(int i=0; i<count; i++)
+         put16(&bytes[i*2], (uint16_t)block[i]);
+      fwrite(bytes, 2, count, wav);
+      wavSamples += count;
+   }
+
+   if(device)
+      ring.push(block, count);
+}
+
+void AudioOutput::render(int16_t*       out,
+                         int            count,
+                         bool           active,
+                         const uint8_t* pattern,
+                         uint8_t        pitch)
+{
+   if(!active)
+   {
+      memset(out, 0, count*sizeof(int16_t));
+      return;
+   }
+
+   // xo-chip playback rate: 4000*2^((pitch-64)/48) pattern bits per second
+   double step = 4000.0*pow(2.0, (pitch-64)/48.0) / AUDIO_RATE;
+   for(int i=0; i<count; i++)
+   {
+      int bit = (int)position;
+      out[i] = ((pattern[bit>>3] >> (7-(bit&7))) & 1) ? AUDIO_VOLUME : -AUDIO_VOLUME;
+      position += step;
+      if(position >= AUDIO_PATTERN_BYTES*8)
+         position -= AUDIO_PATTERN_BYTES*8;
+   }
+}
+
+void AudioOutput::callback(void* userdata, uint8_t* stream, int len)
+{
+   AudioOutput* audio = (AudioOutput*) userdata;
+   int16_t* out = (int16_t*) stream;
+   uint32_t want = len/sizeof(int16_t);
+
+   uint32_t got = audio->ring.pop(out, want);
+   if(got > 0)
+      audio->lastSample = out[got-1];
+
+   if(got < want)
+   {
+      // ran dry, ramp to silence rather than click
+      int16_t s = audio->lastSample;
+      for(uint32_t i=got; i<want; i++)
+      {
+         s = s/2;
+         out[i] = s;
+      }
+      audio->lastSample = 0;
+      audio->underrunCount++;
+   }
+}
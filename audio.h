@@ -0,0 +1,97 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "ringbuffer.h"
+
+// output format, mono signed 16 bit
+#define AUDIO_RATE 44100
+
+// the emulator produces one block of samples per frame
+#define AUDIO_FRAME_RATE 60
+
+// xo-chip audio pattern, 128 one bit samples
+#define AUDIO_PATTERN_BYTES 16
+
+// samples queued between the emulator and the audio callback
+#define AUDIO_RING_SIZE 8192
+
+// how much audio we try to keep queued, in samples (~67ms)
+#define AUDIO_TARGET_FILL (4*AUDIO_RATE/AUDIO_FRAME_RATE)
+
+/**
+ * Beeper / xo-chip pattern sound generator.
+ *
+ * The emulator calls frame() once per timer tick. Live output renders the
+ * samples into a lock free ring that the SDL audio callback drains; the
+ * number of samples rendered per frame follows the ring fill level so
+ * the stream neither underruns nor drifts when the cpu loop runs ahead or
+ * behind. WAV output renders exactly AUDIO_RATE/AUDIO_FRAME_RATE samples
+ * per frame, so headless runs are deterministic.
+ */
+class AudioOutput
+{
+public:
+   AudioOutput();
+   ~AudioOutput();
+
+   /**
+    * Writes the stream to a wav file instead of a device.
+    *
+    * @param[in] path: Output file
+    */
+   bool openWav(const char* path);
+
+   /**
+    * Opens the live audio device (SDL builds only).
+    */
+   bool openDevice();
+
+   /**
+    * Finishes the wav file or stops the device.
+    */
+   void close();
+
+   /**
+    * Renders one frame of audio.
+    *
+    * @param[in] active:  Sound timer is running
+    * @param[in] pattern: AUDIO_PATTERN_BYTES of 1 bit samples, msb first
+    * @param[in] pitch:   xo-chip pitch register, 64 is 4000 bits/s
+    */
+   void frame(bool           active,
+              const uint8_t* pattern,
+              uint8_t        pitch);
+
+   uint32_t underruns() const { return underrunCount.load(); }
+
+private:
+   void render(int16_t*       out,
+               int            count,
+               bool           active,
+               const uint8_t* pattern,
+               uint8_t        pitch);
+
+   static void callback(void* userdata, uint8_t* stream, int len);
+
+   // position inside the 128 bit pattern
+   double position;
+
+   // rounding carry so frames average AUDIO_RATE/AUDIO_FRAME_RATE samples
+   uint32_t remainder;
+
+   // wav output
+   FILE* wav;
+   uint32_t wavSamples;
+
+   // live output
+   bool device;
+   SpscRing<int16_t, AUDIO_RING_SIZE> ring;
+   std::atomic<uint32_t> underrunCount;
+   int16_t lastSample;
+};
+
+#endif //AUDIO_H
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h> //strtoul()
+#include <string.h>
+#include <inttypes.h> //PRIu64
+#include <ctype.h> //isxdigit()
+#include "trace.h"
+
+// offline queries over a trace recorded with c8emul -t
+
+void printHelp(char* app)
+{
+   printf("Usage: %s TRACE COMMAND [ARGS]\n", app);
+   printf(" info                 chunks, instructions, frames and size\n");
+   printf(" list FROM [COUNT]    instructions starting at instruction FROM\n");
+   printf(" writes ADDR [COUNT]  the last COUNT writes to ADDR, newest first\n");
+   printf(" op PATTERN [PC]      every opcode matching PATTERN, e.g. DXYN or 8XY4,\n");
+   printf("                      hex digits must match, X Y N K are wildcards\n");
+   printf(" regs INSTR           registers after instruction INSTR\n");
+}
+
+static void printStep(const TraceStep& s)
+{
+   printf("%10" PRIu64 " frame %-7u %03x %04x", s.instruction, s.frame, s.pc, s.opcode);
+   for(int i=0; i<TRACE_REGS; i++)
+   {
+      if(!(s.changed & (1<<i)))
+         continue;
+      if(i < GENERAL_REGS)
+         printf(" V%X=%02x", i, s.regs.r[i]);
+      else if(i == TRACE_I)
+         printf(" I=%03x", s.regs.r[i]);
+      else if(i == TRACE_SP)
+         printf(" SP=%x", s.regs.r[i]);
+      else if(i == TRACE_DT)
+         printf(" DT=%02x", s.regs.r[i]);
+      else if(i == TRACE_ST)
+         printf(" ST=%02x", s.regs.r[i]);
+      else
+         printf(" keys=%04x", s.regs.r[i]);
+   }
+   for(int w=0; w<s.writes; w++)
+      printf(" [%03x]=%02x", s.writeAddr[w], s.writeValue[w]);
+   printf("\n");
+}
+
+static bool pageSet(const uint8_t* pages, uint16_t addr)
+{
+   int page = (addr & (MEMORY_SIZE-1)) >> TRACE_PAGE_SHIFT;
+   return pages[page>>3] & (1 << (page&7));
+}
+
+static void info(const TraceReader& trace)
+{
+   uint64_t instructions = trace.instructionCount();
+   uint32_t frames = 0;
+   if(trace.chunkCount() > 0)
+   {
+      // frames ended in the last chunk are not in the index
+      std::vector<TraceStep> steps;
+      if(trace.decodeChunk(trace.chunkCount()-1, steps) && !steps.empty())
+         frames = steps.back().frame + (steps.back().frameEnd ? 1 : 0);
+   }
+   printf("chunks:       %zu\n", trace.chunkCount());
+   printf("instructions: %" PRIu64 "\n", instructions);
+   printf("frames:       %u\n", frames);
+   printf("bytes:        %" PRIu64 " (%.2f per instruction)\n", trace.fileSize(),
+          instructions ? (double)trace.fileSize()/instructions : 0.0);
+}
+
+static void list(const TraceReader& trace, uint64_t from, uint64_t count)
+{
+   std::vector<TraceStep> steps;
+   for(long c=trace.findChunk(from); (c >= 0) && ((size_t)c < trace.chunkCount()) && (count > 0); c++)
+   {
+      if(!trace.decodeChunk(c, steps))
+      {
+         fprintf(stderr, "chunk %ld is damaged\n", c);
+         return;
+      }
+      for(size_t i=0; (i<steps.size()) && (count > 0); i++)
+      {
+         if(steps[i].instruction < from)
+            continue;
+         printStep(steps[i]);
+         --count;
+      }
+   }
+}
+
+static void writes(const TraceReader& trace, uint16_t addr, uint64_t count)
+{
+   // walk back through the chunks whose summary says the page was written
+   std::vector<TraceStep> steps;
+   for(long c=trace.chunkCount()-1; (c >= 0) && (count > 0); c--)
+   {
+      if(!pageSet(trace.chunk(c).writePages, addr))
+         continue;
+      if(!trace.decodeChunk(c, steps))
+      {
+         fprintf(stderr, "chunk %ld is damaged\n", c);
+         return;
+      }
+      for(long i=steps.size()-1; (i >= 0) && (count > 0); i--)
+      {
+         for(int w=0; w<steps[i].writes; w++)
+         {
+            if(steps[i].writeAddr[w] == addr)
+            {
+               printStep(steps[i]);
+               --count;
+               break;
+            }
+         }
+      }
+   }
+}
+
+static bool parsePattern(const char* text, uint16_t* mask, uint16_t* value)
+{
+   if(strlen(text) != 4)
+      return false;
+   *mask = 0;
+   *value = 0;
+   for(int i=0; i<4; i++)
+   {
+      *mask <<= 4;
+      *value <<= 4;
+      if(isxdigit(text[i]))
+      {
+         char digit[2] = { text[i], 0 };
+         *mask |= 0xF;
+         *value |= strtoul(digit, NULL, 16);
+      }
+   }
+   return true;
+}
+
+static void ops(const TraceReader& trace, uint16_t mask, uint16_t value, int pc)
+{
+   std::vector<TraceStep> steps;
+   for(size_t c=0; c<trace.chunkCount(); c++)
+   {
+      const TraceChunkInfo& info = trace.chunk(c);
+      if((mask & 0xF000) && !(info.opcodeNibbles & (1 << (value>>12))))
+         continue;
+      if((pc >= 0) && !pageSet(info.pcPages, pc))
+         continue;
+      if(!trace.decodeChunk(c, steps))
+      {
+         fprintf(stderr, "chunk %zu is damaged\n", c);
+         return;
+      }
+      for(size_t i=0; i<steps.size(); i++)
+      {
+         if(((steps[i].opcode & mask) == value) && ((pc < 0) || (steps[i].pc == pc)))
+            printStep(steps[i]);
+      }
+   }
+}
+
+static void regs(const TraceReader& trace, uint64_t instruction)
+{
+   long c = trace.findChunk(instruction);
+   std::vector<TraceStep> steps;
+   if((c < 0) || !trace.decodeChunk(c, steps))
+   {
+      fprintf(stderr, "no instruction %" PRIu64 "\n", instruction);
+      return;
+   }
+
+   const TraceStep& s = steps[instruction - trace.chunk(c).firstInstruction];
+   printStep(s);
+   for(int i=0; i<GENERAL_REGS; i++)
+      printf("V%X=%02x%s", i, s.regs.r[i], ((i%8)==7) ? "\n" : " ");
+   printf("I=%03x SP=%x DT=%02x ST=%02x keys=%04x\n", s.regs.r[TRACE_I], s.regs.r[TRACE_SP],
+          s.regs.r[TRACE_DT], s.regs.r[TRACE_ST], s.regs.r[TRACE_KEYS]);
+}
+
+int main(int argc, char* argv[])
+{
+   if(argc < 3)
+   {
+      printHelp(argv[0]);
+      return -1;
+   }
+
+   TraceReader trace;
+   if(!trace.open(argv[1]))
+      return 1;
+
+   const char* cmd = argv[2];
+   const char* arg1 = (argc > 3) ? argv[3] : NULL;
+   const char* arg2 = (argc > 4) ? argv[4] : NULL;
+
+   if(strcmp(cmd, "info") == 0)
+      info(trace);
+   else if((strcmp(cmd, "list") == 0) && (arg1 != NULL))
+      list(trace, strtoull(arg1, NULL, 0), arg2 ? strtoull(arg2, NULL, 0) : 32);
+   else if((strcmp(cmd, "writes") == 0) && (arg1 != NULL))
+      writes(trace, strtoul(arg1, NULL, 16), arg2 ? strtoull(arg2, NULL, 0) : 1);
+   else if((strcmp(cmd, "op") == 0) && (arg1 != NULL))
+   {
+      uint16_t mask, value;
+      if(!parsePattern(arg1, &mask, &value))
+      {
+         fprintf(stderr, "bad pattern %s, use 4 characters like DXYN\n", arg1);
+         return -1;
+      }
+      ops(trace, mask, value, arg2 ? (int)strtoul(arg2, NULL, 16) : -1);
+   }
+   else if((strcmp(cmd, "regs") == 0) && (arg1 != NULL))
+      regs(trace, strtoull(arg1, NULL, 0));
+   else
+   {
+      printHelp(argv[0]);
+      return -1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,422 @@
+#include "capture.h"
+#include <string.h> //memset() memcpy()
+#include <stdlib.h> //malloc()
+#include <vector>
+
+// packs a 0/1 byte per pixel screen into 1 bit per pixel, msb is leftmost
+static void packScreen(const uint8_t* screen, uint8_t* packed)
+{
+   for(int i=0; i<PACKED_FRAME_BYTES; i++)
+   {
+      uint8_t b = 0;
+      for(int bit=0; bit<8; bit++)
+         b = (b<<1) | (screen[i*8+bit]&1);
+      packed[i] = b;
+   }
+}
+
+static void writeVarint(std::vector<uint8_t>& buf, uint32_t value)
+{
+   while(value >= 0x80)
+   {
+      buf.push_back((value&0x7F) | 0x80);
+      value >>= 7;
+   }
+   buf.push_back(value);
+}
+
+FrameCapture::FrameCapture() :
+   out(NULL),
+   format(CAPTURE_Y4M),
+   scale(1),
+   width(SCREEN_WIDTH),
+   height(SCREEN_HEIGHT),
+   lossless(false),
+   running(false),
+   head(0),
+   count(0),
+   closing(false),
+   pixels(NULL),
+   havePending(false),
+   pendingFrames(0),
+   pendingStart(0),
+   written(0),
+   dropped(0)
+{
+   pthread_mutex_init(&lock, NULL);
+   pthread_cond_init(&notEmpty, NULL);
+   pthread_cond_init(&notFull, NULL);
+   memset(previous, 0, sizeof(previous));
+}
+
+FrameCapture::~FrameCapture()
+{
+   close();
+   pthread_cond_destroy(&notFull);
+   pthread_cond_destroy(&notEmpty);
+   pthread_mutex_destroy(&lock);
+}
+
+bool FrameCapture::parseFormat(const char* name, CaptureFormat* format)
+{
+   if(strcmp(name, "y4m") == 0)
+      *format = CAPTURE_Y4M;
+   else if(strcmp(name, "gif") == 0)
+      *format = CAPTURE_GIF;
+   else if(strcmp(name, "delta") == 0)
+      *format = CAPTURE_DELTA;
+   else
+      return false;
+   return true;
+}
+
+bool FrameCapture::open(const char*   path,
+                        CaptureFormat format,
+                        int           scale,
+                        bool          lossless)
+{
+   if(running)
+      return false;
+
+   if(strcmp(path, "-") == 0)
+      out = stdout;
+   else
+      out = fopen(path, "wb");
+
+   if(out == NULL)
+   {
+      fprintf(stderr, "Cannot open capture output %s\n", path);
+      return false;
+   }
+
+   this->format = format;
+   this->scale = (scale < 1) ? 1 : scale;
+   this->lossless = lossless;
+   width = SCREEN_WIDTH*this->scale;
+   height = SCREEN_HEIGHT*this->scale;
+   pixels = (uint8_t*) malloc(width*height);
+
+   head = 0;
+   count = 0;
+   closing = false;
+   written = 0;
+   dropped = 0;
+
+   writeHeader();
+
+   running = true;
+   pthread_create(&thread, NULL, encoderMain, this);
+   return true;
+}
+
+void FrameCapture::submit(const uint8_t* screen)
+{
+   if(!running)
+      return;
+
+   pthread_mutex_lock(&lock);
+   if(count == CAPTURE_QUEUE_DEPTH)
+   {
+      if(!lossless)
+      {
+         // never hold up the emulator, the frame is simply lost
+         ++dropped;
+         pthread_mutex_unlock(&lock);
+         return;
+      }
+      while(count == CAPTURE_QUEUE_DEPTH)
+         pthread_cond_wait(&notFull, &lock);
+   }
+   packScreen(screen, queue[(head+count)%CAPTURE_QUEUE_DEPTH]);
+   ++count;
+   pthread_cond_signal(&notEmpty);
+   pthread_mutex_unlock(&lock);
+}
+
+void FrameCapture::close()
+{
+   if(!running)
+      return;
+
+   pthread_mutex_lock(&lock);
+   closing = true;
+   pthread_cond_signal(&notEmpty);
+   pthread_mutex_unlock(&lock);
+   pthread_join(thread, NULL);
+   running = false;
+
+   writeTrailer();
+   fflush(out);
+   if(out != stdout)
+      fclose(out);
+   out = NULL;
+
+   free(pixels);
+   pixels = NULL;
+}
+
+void* FrameCapture::encoderMain(void* arg)
+{
+   FrameCapture* cap = (FrameCapture*) arg;
+   uint8_t frame[PACKED_FRAME_BYTES];
+
+   pthread_mutex_lock(&cap->lock);
+   for(;;)
+   {
+      while((cap->count == 0) && !cap->closing)
+         pthread_cond_wait(&cap->notEmpty, &cap->lock);
+      if(cap->count == 0)
+         break; // closing and drained
+
+      memcpy(frame, cap->queue[cap->head], PACKED_FRAME_BYTES);
+      cap->head = (cap->head+1)%CAPTURE_QUEUE_DEPTH;
+      --cap->count;
+      pthread_cond_signal(&cap->notFull);
+
+      // encode without holding the lock
+      pthread_mutex_unlock(&cap->lock);
+      cap->encodeFrame(frame);
+      pthread_mutex_lock(&cap->lock);
+   }
+   pthread_mutex_unlock(&cap->lock);
+   return NULL;
+}
+
+void FrameCapture::encodeFrame(const uint8_t* packed)
+{
+   switch(format)
+   {
+      case CAPTURE_Y4M:
+         writeY4m(packed);
+         break;
+
+      case CAPTURE_GIF:
+      {
+         // identical frames are folded into the delay of the pending one,
+         // so a frame is only written once the next different frame shows up
+         if(havePending && (memcmp(pending, packed, PACKED_FRAME_BYTES) == 0))
+         {
+            ++pendingFrames;
+            break;
+         }
+         if(havePending)
+         {
+            int delay = ((pendingStart+pendingFrames)*100)/60 - (pendingStart*100)/60;
+            writeGif(pending, delay);
+            pendingStart += pendingFrames;
+         }
+         memcpy(pending, packed, PACKED_FRAME_BYTES);
+         havePending = true;
+         pendingFrames = 1;
+      }
+      break;
+
+      case CAPTURE_DELTA:
+         writeDelta(packed);
+         break;
+   }
+}
+
+void FrameCapture::upscale(const uint8_t* packed)
+{
+   for(int y=0; y<SCREEN_HEIGHT; y++)
+   {
+      uint8_t* row = &pixels[y*scale*width];
+      for(int x=0; x<SCREEN_WIDTH; x++)
+      {
+         uint8_t p = (packed[y*PACKED_ROW_BYTES + x/8] >> (7-(x%8))) & 1;
+         memset(&row[x*scale], p, scale);
+      }
+      // replicate the row for the remaining scanlines
+      for(int s=1; s<scale; s++)
+         memcpy(&row[s*width], row, width);
+   }
+}
+
+void FrameCapture::writeHeader()
+{
+   switch(format)
+   {
+      case CAPTURE_Y4M:
+         fprintf(out, "YUV4MPEG2 W%i H%i F60:1 Ip A1:1 Cmono\n", width, height);
+         break;
+
+      case CAPTURE_GIF:
+      {
+         uint8_t header[] =
+         {
+            'G', 'I', 'F', '8', '9', 'a',
+            (uint8_t)(width&0xFF), (uint8_t)(width>>8),
+            (uint8_t)(height&0xFF), (uint8_t)(height>>8),
+            0x80,             // global colour table, 2 entries
+            0, 0,             // background, aspect
+            0x00, 0x00, 0x00, // black
+            0xFF, 0xFF, 0xFF, // white
+            // NETSCAPE2.0 loop forever
+            0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+            0x03, 0x01, 0x00, 0x00, 0x00
+         };
+         fwrite(header, 1, sizeof(header), out);
+         havePending = false;
+         pendingFrames = 0;
+         pendingStart = 0;
+      }
+      break;
+
+      case CAPTURE_DELTA:
+      {
+         uint8_t header[] = { 'C', '8', 'D', 'L', SCREEN_WIDTH, SCREEN_HEIGHT };
+         fwrite(header, 1, sizeof(header), out);
+         memset(previous, 0, sizeof(previous));
+      }
+      break;
+   }
+}
+
+void FrameCapture::writeTrailer()
+{
+   if(format == CAPTURE_GIF)
+   {
+      if(havePending)
+      {
+         int delay = ((pendingStart+pendingFrames)*100)/60 - (pendingStart*100)/60;
+         writeGif(pending, delay);
+      }
+      fputc(0x3B, out);
+   }
+}
+
+void FrameCapture::writeY4m(const uint8_t* packed)
+{
+   upscale(packed);
+   for(int i=0; i<width*height; i++)
+      pixels[i] = pixels[i] ? 0xFF : 0x00;
+
+   fputs("FRAME\n", out);
+   fwrite(pixels, 1, width*height, out);
+   ++written;
+}
+
+void FrameCapture::writeGif(const uint8_t* packed, int delay)
+{
+   upscale(packed);
+
+   uint8_t block[] =
+   {
+      // graphic control extension
+      0x21, 0xF9, 0x04, 0x00,
+      (uint8_t)(delay&0xFF), (uint8_t)(delay>>8),
+      0x00, 0x00,
+      // image descriptor, full frame, no local colour table
+      0x2C, 0x00, 0x00, 0x00, 0x00,
+      (uint8_t)(width&0xFF), (uint8_t)(width>>8),
+      (uint8_t)(height&0xFF), (uint8_t)(height>>8),
+      0x00,
+      // lzw minimum code size
+      0x02
+   };
+   fwrite(block, 1, sizeof(block), out);
+
+   // *** lzw compress, the alphabet only ever holds 0 and 1 ***
+   const int minCodeSize = 2;
+   const int clearCode = 1<<minCodeSize;
+   std::vector<uint8_t> data;
+   uint32_t bitBuffer = 0;
+   int bitCount = 0;
+   int codeSize = minCodeSize+1;
+   int maxCode = clearCode+1;
+
+   #define PUT_CODE(code, size)                  \
+      do {                                       \
+         bitBuffer |= (uint32_t)(code) << bitCount; \
+         bitCount += (size);                     \
+         while(bitCount >= 8)                    \
+         {                                       \
+            data.push_back(bitBuffer&0xFF);      \
+            bitBuffer >>= 8;                     \
+            bitCount -= 8;                       \
+         }                                       \
+      } while(0)
+
+   memset(lzwDict, 0, sizeof(lzwDict));
+   PUT_CODE(clearCode, codeSize);
+
+   int cur = pixels[0];
+   for(int i=1; i<width*height; i++)
+   {
+      int p = pixels[i];
+      if(lzwDict[cur][p] != 0)
+      {
+         cur = lzwDict[cur][p];
+         continue;
+      }
+
+      PUT_CODE(cur, codeSize);
+      lzwDict[cur][p] = ++maxCode;
+      if(maxCode >= (1<<codeSize))
+         ++codeSize;
+      if(maxCode == 4095)
+      {
+         PUT_CODE(clearCode, codeSize);
+         memset(lzwDict, 0, sizeof(lzwDict));
+         codeSize = minCodeSize+1;
+         maxCode = clearCode+1;
+      }
+      cur = p;
+   }
+   PUT_CODE(cur, codeSize);
+   PUT_CODE(clearCode, codeSize);
+   PUT_CODE(clearCode+1, minCodeSize+1);
+   if(bitCount > 0)
+      data.push_back(bitBuffer&0xFF);
+
+   #undef PUT_CODE
+
+   // data sub blocks of at most 255 bytes
+   for(size_t pos=0; pos<data.size(); pos+=255)
+   {
+      size_t len = data.size()-pos;
+      if(len > 255)
+         len = 255;
+      fputc((int)len, out);
+      fwrite(&data[pos], 1, len, out);
+   }
+   fputc(0x00, out); // block terminator
+   written += pendingFrames;
+}
+
+void FrameCapture::writeDelta(const uint8_t* packed)
+{
+   // each record is the xor against the previous frame, coded as
+   // alternating (zero run, literal count, literal bytes) varints
+   std::vector<uint8_t> payload;
+   int i = 0;
+   while(i < PACKED_FRAME_BYTES)
+   {
+      int zeros = 0;
+      while((i < PACKED_FRAME_BYTES) && ((packed[i]^previous[i]) == 0))
+      {
+         ++zeros;
+         ++i;
+      }
+      if(i == PACKED_FRAME_BYTES)
+         break; // trailing zeros are implied
+
+      int start = i;
+      while((i < PACKED_FRAME_BYTES) && ((packed[i]^previous[i]) != 0))
+         ++i;
+      writeVarint(payload, zeros);
+      writeVarint(payload, i-start);
+      for(int j=start; j<i; j++)
+         payload.push_back(packed[j]^previous[j]);
+   }
+
+   std::vector<uint8_t> record;
+   writeVarint(record, payload.size());
+   fwrite(&record[0], 1, record.size(), out);
+   if(!payload.empty())
+      fwrite(&payload[0], 1, payload.size(), out);
+
+   memcpy(previous, packed, PACKED_FRAME_BYTES);
+   ++written;
+}
@@ -0,0 +1,113 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "machine.h"
+
+// one 1-bit frame, 8 bytes (64 pixels) per row
+#define PACKED_ROW_BYTES   (SCREEN_WIDTH/8)
+#define PACKED_FRAME_BYTES (PACKED_ROW_BYTES*SCREEN_HEIGHT)
+
+// frames buffered between the emulator and the encoder thread
+#define CAPTURE_QUEUE_DEPTH 64
+
+enum CaptureFormat
+{
+   CAPTURE_Y4M,   // raw monochrome YUV4MPEG2, upscaled
+   CAPTURE_GIF,   // animated 2 colour GIF, upscaled
+   CAPTURE_DELTA  // 1-bit xor deltas, run length compressed, native size
+};
+
+/**
+ * Streams captured frames to a file (or stdout) on a background thread.
+ *
+ * The emulator hands over each frame with submit(), which only packs the
+ * screen into a queue slot. All upscaling and encoding happens on the
+ * encoder thread.
+ */
+class FrameCapture
+{
+public:
+   FrameCapture();
+   ~FrameCapture();
+
+   /**
+    * Opens the output and starts the encoder thread.
+    *
+    * @param[in] path:     Output file, "-" writes to stdout
+    * @param[in] format:   Output format
+    * @param[in] scale:    Integer upscale factor (ignored for deltas)
+    * @param[in] lossless: When the queue is full wait for the encoder
+    *                      instead of dropping the frame
+    */
+   bool open(const char*   path,
+             CaptureFormat format,
+             int           scale,
+             bool          lossless);
+
+   /**
+    * Queues a frame for encoding.
+    *
+    * @param[in] screen: SCREEN_WIDTH*SCREEN_HEIGHT buffer of 0/1 pixels
+    */
+   void submit(const uint8_t* screen);
+
+   /**
+    * Drains the queue, finishes the stream and stops the encoder thread.
+    */
+   void close();
+
+   uint32_t framesWritten() const { return written; }
+   uint32_t framesDropped() const { return dropped; }
+
+   static bool parseFormat(const char* name, CaptureFormat* format);
+
+private:
+   static void* encoderMain(void* arg);
+   void encodeFrame(const uint8_t* packed);
+   void writeHeader();
+   void writeTrailer();
+
+   // format writers
+   void writeY4m(const uint8_t* packed);
+   void writeGif(const uint8_t* packed, int delay);
+   void writeDelta(const uint8_t* packed);
+
+   // expands a packed frame into one byte per output pixel
+   void upscale(const uint8_t* packed);
+
+   FILE* out;
+   CaptureFormat format;
+   int scale;
+   int width;
+   int height;
+   bool lossless;
+   bool running;
+
+   // bounded frame queue
+   uint8_t queue[CAPTURE_QUEUE_DEPTH][PACKED_FRAME_BYTES];
+   int head;
+   int count;
+   bool closing;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t notEmpty;
+   pthread_cond_t notFull;
+
+   // encoder state, only touched by the encoder thread
+   uint8_t* pixels;
+   uint8_t previous[PACKED_FRAME_BYTES];
+   uint8_t pending[PACKED_FRAME_BYTES];
+   bool havePending;
+   int pendingFrames;
+   int pendingStart;
+   uint16_t lzwDict[4096][2];
+
+   uint32_t written;
+   uint32_t dropped;
+};
+
+#endif //CAPTURE_H
@@ -0,0 +1,386 @@
+#include "debugger.h"
+#include "gdbstub.h"
+#include "history.h"
+#include <stdio.h>
+#include <stdlib.h> //strtoul()
+#include <inttypes.h> //PRIu64
+#include <string.h> //memset()
+#include <strings.h> //strcasecmp()
+
+Debugger::Debugger(Machine& machine) :
+   mach(machine),
+   stepping(false),
+   remote(NULL),
+   history(NULL),
+   hit(false),
+   hitAddr(0),
+   tempAddr(-1),
+   tempSp(0)
+{
+   memset(breakMap, 0, sizeof(breakMap));
+}
+
+uint16_t Debugger::readRegister(int reg) const
+{
+   if(reg < REG_I)
+      return mach.v[reg];
+
+   switch(reg)
+   {
+      case REG_I:  return mach.I;
+      case REG_PC: return mach.pc;
+      case REG_SP: return mach.sp;
+      case REG_DT: return mach.delayTimer;
+      case REG_ST: return mach.soundTimer;
+   }
+   return 0;
+}
+
+bool Debugger::conditionHit()
+{
+   bool stop = false;
+   for(size_t i=0; i<conditions.size(); i++)
+   {
+      Condition& c = conditions[i];
+      uint16_t value = readRegister(c.reg);
+      bool now = false;
+      switch(c.cmp)
+      {
+         case CMP_EQ: now = (value == c.value); break;
+         case CMP_NE: now = (value != c.value); break;
+         case CMP_LT: now = (value <  c.value); break;
+         case CMP_GT: now = (value >  c.value); break;
+      }
+      if(now && !c.last)
+         stop = true;
+      c.last = now;
+   }
+   return stop;
+}
+
+bool Debugger::parseCondition(const char* text, Condition* cond)
+{
+   char reg[8];
+   char op[3];
+   char value[16];
+   if(sscanf(text, "%7[A-Za-z0-9]%2[=!<>]%15s", reg, op, value) != 3)
+      return false;
+
+   if(((reg[0] == 'v') || (reg[0] == 'V')) && (reg[1] != 0) && (reg[2] == 0))
+   {
+      char* end;
+      cond->reg = strtoul(&reg[1], &end, 16);
+      if(*end != 0)
+         return false;
+   }
+   else if(strcasecmp(reg, "i") == 0)
+      cond->reg = REG_I;
+   else if(strcasecmp(reg, "pc") == 0)
+      cond->reg = REG_PC;
+   else if(strcasecmp(reg, "sp") == 0)
+      cond->reg = REG_SP;
+   else if(strcasecmp(reg, "dt") == 0)
+      cond->reg = REG_DT;
+   else if(strcasecmp(reg, "st") == 0)
+      cond->reg = REG_ST;
+   else
+      return false;
+
+   if(strcmp(op, "==") == 0)
+      cond->cmp = CMP_EQ;
+   else if(strcmp(op, "!=") == 0)
+      cond->cmp = CMP_NE;
+   else if(strcmp(op, "<") == 0)
+      cond->cmp = CMP_LT;
+   else if(strcmp(op, ">") == 0)
+      cond->cmp = CMP_GT;
+   else
+      return false;
+
+   cond->value = strtoul(value, NULL, 0);
+   cond->last = false;
+   return true;
+}
+
+void Debugger::showRegisters()
+{
+   for(int i=0; i<GENERAL_REGS; i++)
+      printf("V%X=%02x%s", i, mach.v[i], ((i%8)==7) ? "\n" : " ");
+   printf("I=%03x PC=%03x SP=%x DT=%02x ST=%02x keys=%04x frame=%u instr=%" PRIu64 "\n",
+          mach.I, mach.pc, mach.sp, mach.delayTimer, mach.soundTimer,
+          mach.getKeys(), mach.frames, mach.instructions);
+}
+
+void Debugger::showStack()
+{
+   printf("stack:");
+   for(int i=0; (i<mach.sp) && (i<STACK_SIZE); i++)
+      printf(" %03x", mach.stack[i]);
+   printf("\n");
+}
+
+void Debugger::showScreen()
+{
+   for(int y=0; y<SCREEN_HEIGHT; y++)
+   {
+      char row[SCREEN_WIDTH+1];
+      for(int x=0; x<SCREEN_WIDTH; x++)
+         row[x] = mach.screen[y*SCREEN_WIDTH+x] ? '#' : '.';
+      row[SCREEN_WIDTH] = 0;
+      printf("%s\n", row);
+   }
+}
+
+void Debugger::showMemory(uint16_t addr, int length)
+{
+   for(int i=0; i<length; i++)
+   {
+      uint16_t a = (addr+i)&(MEMORY_SIZE-1);
+      if((i%16) == 0)
+         printf("%03x:", a);
+      printf(" %02x", mach.memory[a]);
+      if(((i%16) == 15) || (i == length-1))
+         printf("\n");
+   }
+}
+
+void Debugger::showInstruction(uint16_t addr)
+{
+   uint16_t opcode = (mach.memory[addr&(MEMORY_SIZE-1)]<<8) | mach.memory[(addr+1)&(MEMORY_SIZE-1)];
+   printf("%c%03x %04x ", hasBreakpoint(addr, BREAK_EXEC) ? '*' : ' ', addr, opcode);
+
+   char text[OP_TEXT_SIZE];
+   formatOpcode(opcode, text);
+   printf("%s\n", text);
+}
+
+void Debugger::showBreakpoints()
+{
+   for(int a=0; a<MEMORY_SIZE; a++)
+   {
+      if(breakMap[a] & BREAK_EXEC)
+         printf("break %03x\n", a);
+      if(breakMap[a] & BREAK_WRITE)
+         printf("watch %03x\n", a);
+   }
+   static const char* regs[] = { "I", "PC", "SP", "DT", "ST" };
+   static const char* ops[] = { "==", "!=", "<", ">" };
+   for(size_t i=0; i<conditions.size(); i++)
+   {
+      if(conditions[i].reg < REG_I)
+         printf("cond V%X", conditions[i].reg);
+      else
+         printf("cond %s", regs[conditions[i].reg-REG_I]);
+      printf("%s0x%x\n", ops[conditions[i].cmp], conditions[i].value);
+   }
+}
+
+void Debugger::help()
+{
+   printf("c            continue\n");
+   printf("s            step one instruction\n");
+   printf("n            step, over subroutine calls\n");
+   printf("rs           step back one instruction\n");
+   printf("rc           run backwards to the previous break or watchpoint\n");
+   printf("b ADDR       break when ADDR executes\n");
+   printf("w ADDR       break when ADDR is written\n");
+   printf("d ADDR       delete break/watch at ADDR\n");
+   printf("cond EXPR    break when EXPR becomes true, e.g. V3==5, I>0x300, DT==0\n");
+   printf("cond clear   delete all conditions\n");
+   printf("l            list breakpoints, watchpoints and conditions\n");
+   printf("r            registers and stack\n");
+   printf("x ADDR [N]   dump N bytes of memory\n");
+   printf("u [ADDR] [N] disassemble N instructions\n");
+   printf("scr          show the screen\n");
+   printf("q            quit\n");
+}
+
+void Debugger::reverseStep()
+{
+   uint64_t now = mach.instructions;
+   if((now == 0) || !history->seek(now-1))
+   {
+      printf("no history before instruction %" PRIu64 "\n", now);
+      return;
+   }
+   hit = false;
+}
+
+void Debugger::reverseContinue()
+{
+   // re-execute the keyframe intervals newest first, up to where the last
+   // one started, and stop at the latest break or watch hit found
+   uint64_t now = mach.instructions;
+   uint64_t segmentEnd = now;
+   for(int k=history->findKeyframe(now-1); (now > 0) && (k >= 0); k--)
+   {
+      history->restore(k);
+      hit = false;
+
+      int64_t found = -1;
+      int watchAddr = -1;
+      while((mach.instructions < segmentEnd) && mach.running())
+      {
+         if(breakMap[mach.pc] & BREAK_EXEC)
+         {
+            found = mach.instructions;
+            watchAddr = -1;
+         }
+         history->replayStep();
+         if(hit)
+         {
+            hit = false;
+            if(mach.instructions < now)
+            {
+               found = mach.instructions;
+               watchAddr = hitAddr;
+            }
+         }
+      }
+
+      if(found >= 0)
+      {
+         history->seek(found);
+         hit = false;
+         if(watchAddr >= 0)
+            printf("watchpoint: %03x written, now %02x\n", watchAddr, mach.memory[watchAddr]);
+         return;
+      }
+      segmentEnd = history->keyframePosition(k);
+   }
+
+   // nothing hit, stop at the oldest state still kept
+   if(history->keyframeCount() > 0)
+   {
+      history->restore(0);
+      hit = false;
+   }
+   printf("reached the start of the history\n");
+}
+
+void Debugger::enter()
+{
+   stepping = false;
+
+   // a step over break is done whatever stopped us, back or not
+   if(tempAddr >= 0)
+      breakMap[tempAddr] &= ~BREAK_TEMP;
+   tempAddr = -1;
+
+   if(remote != NULL)
+   {
+      int watch = hit ? hitAddr : -1;
+      hit = false;
+      remote->stopped(watch);
+      return;
+   }
+
+   if(hit)
+   {
+      printf("watchpoint: %03x written, now %02x\n", hitAddr, mach.memory[hitAddr]);
+      hit = false;
+   }
+
+   showRegisters();
+   showStack();
+   showInstruction(mach.pc);
+
+   char line[128];
+   for(;;)
+   {
+      printf("(c8db) ");
+      fflush(stdout);
+      if(fgets(line, sizeof(line), stdin) == NULL)
+      {
+         mach.kill = true;
+         return;
+      }
+
+      char cmd[16] = "";
+      char arg1[64] = "";
+      char arg2[16] = "";
+      int args = sscanf(line, "%15s %63s %15s", cmd, arg1, arg2);
+      if(args < 1)
+         continue;
+
+      uint16_t addr = strtoul(arg1, NULL, 16);
+
+      if(strcmp(cmd, "c") == 0)
+         return;
+      else if(strcmp(cmd, "s") == 0)
+      {
+         stepping = true;
+         return;
+      }
+      else if(((strcmp(cmd, "rs") == 0) || (strcmp(cmd, "rc") == 0)) && (history == NULL))
+         printf("no history recorded\n");
+      else if((strcmp(cmd, "rs") == 0) || (strcmp(cmd, "rc") == 0))
+      {
+         if(strcmp(cmd, "rs") == 0)
+            reverseStep();
+         else
+            reverseContinue();
+         showRegisters();
+         showStack();
+         showInstruction(mach.pc);
+      }
+      else if(strcmp(cmd, "n") == 0)
+      {
+         uint16_t opcode = (mach.memory[mach.pc]<<8) | mach.memory[mach.pc+1];
+         if((opcode&0xF000) == 0x2000)
+         {
+            tempAddr = (mach.pc+2)&(MEMORY_SIZE-1);
+            tempSp = mach.sp;
+            breakMap[tempAddr] |= BREAK_TEMP;
+         }
+         else
+            stepping = true;
+         return;
+      }
+      else if((strcmp(cmd, "b") == 0) && (args > 1))
+         setBreakpoint(addr, BREAK_EXEC);
+      else if((strcmp(cmd, "w") == 0) && (args > 1))
+         setBreakpoint(addr, BREAK_WRITE);
+      else if((strcmp(cmd, "d") == 0) && (args > 1))
+         clearBreakpoint(addr, BREAK_EXEC|BREAK_WRITE);
+      else if((strcmp(cmd, "cond") == 0) && (args > 1))
+      {
+         Condition c;
+         if(strcmp(arg1, "clear") == 0)
+            conditions.clear();
+         else if(parseCondition(arg1, &c))
+         {
+            // armed as already true so it fires on the next change
+            c.last = true;
+            conditions.push_back(c);
+         }
+         else
+            printf("bad condition %s\n", arg1);
+      }
+      else if(strcmp(cmd, "l") == 0)
+         showBreakpoints();
+      else if(strcmp(cmd, "r") == 0)
+      {
+         showRegisters();
+         showStack();
+      }
+      else if((strcmp(cmd, "x") == 0) && (args > 1))
+         showMemory(addr, (args > 2) ? strtoul(arg2, NULL, 0) : 16);
+      else if(strcmp(cmd, "u") == 0)
+      {
+         uint16_t a = (args > 1) ? addr : mach.pc;
+         int count = (args > 2) ? strtoul(arg2, NULL, 0) : 8;
+         for(int i=0; i<count; i++)
+            showInstruction(a + i*2);
+      }
+      else if(strcmp(cmd, "scr") == 0)
+         showScreen();
+      else if(strcmp(cmd, "q") == 0)
+      {
+         mach.kill = true;
+         return;
+      }
+      else
+         help();
+   }
+}
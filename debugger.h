@@ -0,0 +1,116 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#include "machine.h"
+
+// breakMap flags
+#define BREAK_EXEC  0x01 // stop before executing the address
+#define BREAK_WRITE 0x02 // stop after the address is written
+#define BREAK_TEMP  0x04 // one shot exec break used by step over
+
+class GdbStub;
+class History;
+
+/**
+ * Interactive command line debugger.
+ *
+ * Breakpoints and watchpoints live in a per address flag map, so an armed
+ * session costs one table lookup per instruction and runs at full speed
+ * until something hits. Register conditions are only evaluated while at
+ * least one is set.
+ */
+class Debugger
+{
+public:
+   Debugger(Machine& machine);
+
+   /**
+    * Called before every instruction while attached.
+    */
+   bool shouldStop(uint16_t pc)
+   {
+      // conditions see every instruction, or their edge state goes stale
+      bool stop = !conditions.empty() && conditionHit();
+      return stop || stepping.load(std::memory_order_relaxed) || hit || (breakMap[pc] & BREAK_EXEC) ||
+             ((breakMap[pc] & BREAK_TEMP) && (mach.sp == tempSp));
+   }
+
+   /**
+    * Called for every emulated memory write while attached.
+    */
+   void onWrite(uint16_t addr)
+   {
+      if(breakMap[addr] & BREAK_WRITE)
+      {
+         hit = true;
+         hitAddr = addr;
+      }
+   }
+
+   /**
+    * Stops the machine: prints the live view and reads commands until the
+    * user continues, steps or quits.
+    */
+   void enter();
+
+   // stop before the next instruction, may be called from any thread
+   void interrupt() { stepping.store(true, std::memory_order_relaxed); }
+   
+   // hand stops to a remote gdb instead of the command line
+   void setRemote(GdbStub* remote) { this->remote = remote; }
+   
+   // enables the reverse step/continue commands
+   void setHistory(History* history) { this->history = history; }
+
+   void setBreakpoint(uint16_t addr, uint8_t flag) { breakMap[addr&(MEMORY_SIZE-1)] |= flag; }
+   void clearBreakpoint(uint16_t addr, uint8_t flag) { breakMap[addr&(MEMORY_SIZE-1)] &= ~flag; }
+   bool hasBreakpoint(uint16_t addr, uint8_t flag) const { return breakMap[addr&(MEMORY_SIZE-1)] & flag; }
+
+private:
+   enum Register { REG_V0, REG_I=16, REG_PC, REG_SP, REG_DT, REG_ST };
+   enum Compare { CMP_EQ, CMP_NE, CMP_LT, CMP_GT };
+
+   struct Condition
+   {
+      int reg;
+      Compare cmp;
+      uint16_t value;
+      bool last; // conditions break on becoming true, not while true
+   };
+
+   bool conditionHit();
+   bool parseCondition(const char* text, Condition* cond);
+   uint16_t readRegister(int reg) const;
+
+   void showRegisters();
+   void showStack();
+   void showScreen();
+   void showMemory(uint16_t addr, int length);
+   void showInstruction(uint16_t addr);
+   void showBreakpoints();
+   void help();
+   
+   void reverseStep();
+   void reverseContinue();
+
+   Machine& mach;
+
+   uint8_t breakMap[MEMORY_SIZE];
+   std::vector<Condition> conditions;
+   std::atomic<bool> stepping;
+   GdbStub* remote;
+   History* history;
+   bool hit;
+   uint16_t hitAddr;
+
+   // step over break, the return address and the call's stack depth so a
+   // recursive call passing the same address does not stop, -1 when unset
+   int tempAddr;
+   uint8_t tempSp;
+};
+
+#endif //DEBUGGER_H
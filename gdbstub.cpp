@@ -0,0 +1,640 @@
+#include "gdbstub.h"
+#include <stdio.h>
+#include <stdlib.h> //strtoul()
+#include <string.h> //memset() strncmp()
+#include <unistd.h> //read() write() close() unlink()
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// register numbering exposed to gdb
+#define GDB_REG_I   16
+#define GDB_REG_SP  17
+#define GDB_REG_PC  18
+#define GDB_REG_DT  19
+#define GDB_REG_ST  20
+#define GDB_REGS    21
+
+static const char targetXml[] =
+   "<?xml version=\"1.0\"?>\n"
+   "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+   "<target version=\"1.0\">\n"
+   "<feature name=\"org.chip8.core\">\n"
+   "<reg name=\"v0\" bitsize=\"8\" type=\"uint8\" regnum=\"0\"/>\n"
+   "<reg name=\"v1\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v2\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v3\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v4\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v5\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v6\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v7\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v8\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"v9\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"va\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"vb\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"vc\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"vd\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"ve\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"vf\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+   "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+   "<reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "<reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>\n"
+   "</feature>\n"
+   "</target>\n";
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static void appendHex(std::string& out, uint32_t value, int bytes)
+{
+   // registers and memory go out little endian
+   for(int i=0; i<bytes; i++)
+   {
+      uint8_t b = (value >> (i*8)) & 0xFF;
+      out += hexDigits[b>>4];
+      out += hexDigits[b&0xF];
+   }
+}
+
+static int hexValue(char c)
+{
+   if((c >= '0') && (c <= '9')) return c-'0';
+   if((c >= 'a') && (c <= 'f')) return c-'a'+10;
+   if((c >= 'A') && (c <= 'F')) return c-'A'+10;
+   return -1;
+}
+
+static uint32_t parseHexLE(const char* hex, int bytes)
+{
+   uint32_t value = 0;
+   for(int i=0; i<bytes; i++)
+      value |= ((hexValue(hex[i*2])<<4) | hexValue(hex[i*2+1])) << (i*8);
+   return value;
+}
+
+static int registerBytes(int reg)
+{
+   return ((reg == GDB_REG_I) || (reg == GDB_REG_PC)) ? 2 : 1;
+}
+
+GdbStub::GdbStub(Machine& machine, Debugger& debugger) :
+   mach(machine),
+   dbg(debugger),
+   listenFd(-1),
+   started(false),
+   noAck(false),
+   hungUp(false),
+   halted(false),
+   stopPending(false),
+   exited(false),
+   connected(false),
+   stopWatch(-1)
+{
+   wakePipe[0] = -1;
+   wakePipe[1] = -1;
+   pthread_mutex_init(&lock, NULL);
+   pthread_cond_init(&changed, NULL);
+}
+
+GdbStub::~GdbStub()
+{
+   close();
+   pthread_cond_destroy(&changed);
+   pthread_mutex_destroy(&lock);
+}
+
+bool GdbStub::listen(const char* address)
+{
+   if(strncmp(address, "unix:", 5) == 0)
+   {
+      struct sockaddr_un sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sun_family = AF_UNIX;
+      strncpy(sa.sun_path, address+5, sizeof(sa.sun_path)-1);
+      unixPath = sa.sun_path;
+      unlink(sa.sun_path);
+
+      listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if((listenFd < 0) || (bind(listenFd, (struct sockaddr*)&sa, sizeof(sa)) < 0))
+      {
+         perror("gdb stub");
+         return false;
+      }
+   }
+   else
+   {
+      struct sockaddr_in sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sin_family = AF_INET;
+      sa.sin_port = htons(atoi(address));
+      sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      int one = 1;
+      listenFd = socket(AF_INET, SOCK_STREAM, 0);
+      if(listenFd >= 0)
+         setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if((listenFd < 0) || (bind(listenFd, (struct sockaddr*)&sa, sizeof(sa)) < 0))
+      {
+         perror("gdb stub");
+         return false;
+      }
+   }
+
+   if((::listen(listenFd, 1) < 0) || (pipe(wakePipe) < 0))
+   {
+      perror("gdb stub");
+      return false;
+   }
+
+   fprintf(stderr, "gdb stub listening on %s\n", address);
+   started = true;
+   pthread_create(&thread, NULL, serverMain, this);
+   return true;
+}
+
+void GdbStub::close()
+{
+   if(!started)
+      return;
+
+   pthread_mutex_lock(&lock);
+   exited = true;
+   pthread_cond_broadcast(&changed);
+   pthread_mutex_unlock(&lock);
+   if(write(wakePipe[1], "x", 1) < 0)
+      perror("gdb stub");
+
+   pthread_join(thread, NULL);
+   started = false;
+
+   ::close(listenFd);
+   ::close(wakePipe[0]);
+   ::close(wakePipe[1]);
+   if(!unixPath.empty())
+      unlink(unixPath.c_str());
+}
+
+void GdbStub::stopped(int watchAddr)
+{
+   pthread_mutex_lock(&lock);
+   if(!connected || exited)
+   {
+      // nobody to report to, keep running
+      pthread_mutex_unlock(&lock);
+      return;
+   }
+
+   halted = true;
+   stopPending = true;
+   stopWatch = watchAddr;
+   pthread_cond_broadcast(&changed);
+   if(write(wakePipe[1], "s", 1) < 0)
+      perror("gdb stub");
+
+   while(halted && !exited)
+      pthread_cond_wait(&changed, &lock);
+   pthread_mutex_unlock(&lock);
+}
+
+bool GdbStub::haltAndWait()
+{
+   pthread_mutex_lock(&lock);
+   if(!halted)
+   {
+      dbg.interrupt();
+      while(!halted && !exited)
+         pthread_cond_wait(&changed, &lock);
+   }
+   bool ok = halted;
+   pthread_mutex_unlock(&lock);
+   return ok;
+}
+
+void GdbStub::resume(bool step)
+{
+   if(step)
+      dbg.interrupt();
+
+   pthread_mutex_lock(&lock);
+   halted = false;
+   pthread_cond_broadcast(&changed);
+   pthread_mutex_unlock(&lock);
+}
+
+void* GdbStub::serverMain(void* arg)
+{
+   GdbStub* stub = (GdbStub*) arg;
+
+   for(;;)
+   {
+      struct pollfd fds[2];
+      fds[0].fd = stub->listenFd;
+      fds[0].events = POLLIN;
+      fds[1].fd = stub->wakePipe[0];
+      fds[1].events = POLLIN;
+      if(poll(fds, 2, -1) < 0)
+         continue;
+
+      pthread_mutex_lock(&stub->lock);
+      bool exited = stub->exited;
+      pthread_mutex_unlock(&stub->lock);
+      if(exited)
+         break;
+
+      if(fds[1].revents & POLLIN)
+      {
+         char c;
+         if(read(stub->wakePipe[0], &c, 1) < 0)
+            perror("gdb stub");
+      }
+
+      if(fds[0].revents & POLLIN)
+      {
+         int client = accept(stub->listenFd, NULL, NULL);
+         if(client < 0)
+            continue;
+         int one = 1;
+         setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+         stub->serve(client);
+         ::close(client);
+      }
+   }
+   return NULL;
+}
+
+void GdbStub::serve(int client)
+{
+   pthread_mutex_lock(&lock);
+   connected = true;
+   pthread_mutex_unlock(&lock);
+   noAck = false;
+   hungUp = false;
+
+   // gdb expects a stopped target when it attaches
+   if(haltAndWait())
+   {
+      pthread_mutex_lock(&lock);
+      stopPending = false;
+      pthread_mutex_unlock(&lock);
+   }
+
+   std::string packet;
+   enum { IDLE, BODY, SUM1, SUM2 } state = IDLE;
+   bool open = true;
+   while(open && !hungUp)
+   {
+      struct pollfd fds[2];
+      fds[0].fd = client;
+      fds[0].events = POLLIN;
+      fds[1].fd = wakePipe[0];
+      fds[1].events = POLLIN;
+      if(poll(fds, 2, -1) < 0)
+         continue;
+
+      if(fds[1].revents & POLLIN)
+      {
+         char c;
+         if(read(wakePipe[0], &c, 1) < 0)
+            perror("gdb stub");
+
+         pthread_mutex_lock(&lock);
+         bool report = stopPending;
+         bool gone = exited;
+         stopPending = false;
+         pthread_mutex_unlock(&lock);
+
+         if(gone)
+         {
+            sendPacket(client, "W00");
+            break;
+         }
+         if(report)
+            sendStopReply(client);
+      }
+
+      if(!(fds[0].revents & (POLLIN|POLLHUP|POLLERR)))
+         continue;
+
+      char buf[1024];
+      int n = recv(client, buf, sizeof(buf), 0);
+      if(n <= 0)
+         break;
+
+      for(int i=0; (i<n) && open && !hungUp; i++)
+      {
+         char c = buf[i];
+         switch(state)
+         {
+            case IDLE:
+               if(c == '$')
+               {
+                  packet.clear();
+                  state = BODY;
+               }
+               else if(c == 0x03)
+                  dbg.interrupt(); // ctrl-c, the stop is reported via the pipe
+               break;
+
+            case BODY:
+               if(c == '#')
+                  state = SUM1;
+               else
+                  packet += c;
+               break;
+
+            case SUM1:
+               state = SUM2;
+               break;
+
+            case SUM2:
+               state = IDLE;
+               if(!noAck && !sendAll(client, "+", 1))
+                  open = false;
+               else if(packet[0] == 'k')
+                  open = false;
+               else
+                  handlePacket(client, packet);
+               if(packet[0] == 'D')
+                  open = false;
+               break;
+         }
+      }
+   }
+
+   // kill, detach or hang up: let the program run on without us
+   if(packet[0] == 'k')
+      mach.kill = true;
+   pthread_mutex_lock(&lock);
+   connected = false;
+   pthread_mutex_unlock(&lock);
+   resume(false);
+}
+
+bool GdbStub::sendPacket(int client, const std::string& data)
+{
+   uint8_t sum = 0;
+   for(size_t i=0; i<data.size(); i++)
+      sum += (uint8_t)data[i];
+
+   std::string out = "$" + data + "#";
+   out += hexDigits[sum>>4];
+   out += hexDigits[sum&0xF];
+   return sendAll(client, out.data(), out.size());
+}
+
+bool GdbStub::sendAll(int client, const char* data, size_t size)
+{
+   // no SIGPIPE when gdb went away mid exchange, that is a hang up
+   ssize_t sent = send(client, data, size, MSG_NOSIGNAL);
+   if((sent < 0) && ((errno == EPIPE) || (errno == ECONNRESET)))
+      hungUp = true;
+   return sent == (ssize_t)size;
+}
+
+void GdbStub::sendStopReply(int client)
+{
+   std::string reply = "T05";
+   if(stopWatch >= 0)
+   {
+      reply += "watch:";
+      char addr[8];
+      snprintf(addr, sizeof(addr), "%x", stopWatch);
+      reply += addr;
+      reply += ";";
+   }
+   sendPacket(client, reply);
+}
+
+std::string GdbStub::readRegisters()
+{
+   std::string out;
+   for(int i=0; i<GENERAL_REGS; i++)
+      appendHex(out, mach.v[i], 1);
+   appendHex(out, mach.I, 2);
+   appendHex(out, mach.sp, 1);
+   appendHex(out, mach.pc, 2);
+   appendHex(out, mach.delayTimer, 1);
+   appendHex(out, mach.soundTimer, 1);
+   return out;
+}
+
+bool GdbStub::writeRegister(int reg, const char* hex)
+{
+   if((reg < 0) || (reg >= GDB_REGS) || (strlen(hex) < (size_t)registerBytes(reg)*2))
+      return false;
+
+   uint32_t value = parseHexLE(hex, registerBytes(reg));
+   if(reg < GENERAL_REGS)
+      mach.v[reg] = value;
+   else if(reg == GDB_REG_I)
+      mach.I = value;
+   else if(reg == GDB_REG_SP)
+      mach.sp = value;
+   else if(reg == GDB_REG_PC)
+      mach.pc = value & (MEMORY_SIZE-1);
+   else if(reg == GDB_REG_DT)
+      mach.delayTimer = value;
+   else
+      mach.soundTimer = value;
+   return true;
+}
+
+void GdbStub::handlePacket(int client, const std::string& packet)
+{
+   const char* p = packet.c_str();
+   std::string reply;
+
+   // everything below touches machine state, so the cpu must be parked
+   // (it already is, unless gdb misbehaves)
+   if(!haltAndWait())
+   {
+      sendPacket(client, "W00");
+      return;
+   }
+
+   switch(p[0])
+   {
+      case '?':
+         sendStopReply(client);
+         return;
+
+      case 'g':
+         reply = readRegisters();
+         break;
+
+      case 'G':
+      {
+         const char* hex = p+1;
+         for(int reg=0; reg<GDB_REGS; reg++)
+         {
+            if(!writeRegister(reg, hex))
+               break;
+            hex += registerBytes(reg)*2;
+         }
+         reply = "OK";
+      }
+      break;
+
+      case 'p':
+      {
+         int reg = strtoul(p+1, NULL, 16);
+         if((reg >= 0) && (reg < GDB_REGS))
+         {
+            std::string all = readRegisters();
+            int offset = 0;
+            for(int i=0; i<reg; i++)
+               offset += registerBytes(i)*2;
+            reply = all.substr(offset, registerBytes(reg)*2);
+         }
+         else
+            reply = "E01";
+      }
+      break;
+
+      case 'P':
+      {
+         char* end;
+         int reg = strtoul(p+1, &end, 16);
+         reply = ((*end == '=') && writeRegister(reg, end+1)) ? "OK" : "E01";
+      }
+      break;
+
+      case 'm':
+      {
+         char* end;
+         uint32_t addr = strtoul(p+1, &end, 16);
+         uint32_t len = strtoul(end+1, NULL, 16);
+         if(addr >= MEMORY_SIZE)
+         {
+            reply = "E01";
+            break;
+         }
+         for(uint32_t i=0; (i<len) && ((addr+i)<MEMORY_SIZE); i++)
+            appendHex(reply, mach.memory[addr+i], 1);
+      }
+      break;
+
+      case 'M':
+      {
+         char* end;
+         uint32_t addr = strtoul(p+1, &end, 16);
+         uint32_t len = strtoul(end+1, &end, 16);
+         const char* hex = end+1;
+         if((*end != ':') || ((addr+len) > MEMORY_SIZE) || (strlen(hex) < len*2))
+         {
+            reply = "E01";
+            break;
+         }
+         for(uint32_t i=0; i<len; i++)
+         {
+            mach.memory[addr+i] = parseHexLE(hex+i*2, 1);
+            mach.dirtyPages |= 1u << ((addr+i) >> MEMORY_PAGE_SHIFT);
+         }
+         mach.rehash(); // keep stateHash() in step with the poked bytes
+         reply = "OK";
+      }
+      break;
+
+      case 'c':
+         resume(false);
+         return; // the reply is the next stop
+
+      case 's':
+         resume(true);
+         return;
+
+      case 'Z':
+      case 'z':
+      {
+         // Z0 software breakpoint, Z2 write watchpoint
+         char* end;
+         int type = strtoul(p+1, &end, 16);
+         uint32_t addr = strtoul(end+1, &end, 16);
+         uint32_t len = strtoul(end+1, NULL, 16);
+         uint8_t flag = (type == 0) ? BREAK_EXEC : BREAK_WRITE;
+         if(((type != 0) && (type != 2)) || (addr >= MEMORY_SIZE))
+            break; // unsupported, empty reply
+         if(type == 0)
+            len = 1;
+         for(uint32_t i=0; (i<len) && ((addr+i)<MEMORY_SIZE); i++)
+         {
+            if(p[0] == 'Z')
+               dbg.setBreakpoint(addr+i, flag);
+            else
+               dbg.clearBreakpoint(addr+i, flag);
+         }
+         reply = "OK";
+      }
+      break;
+
+      case 'D':
+         reply = "OK";
+         break;
+
+      case 'H':
+         reply = "OK";
+         break;
+
+      case 'v':
+         if(packet == "vCont?")
+            reply = "vCont;c;C;s;S";
+         else if(strncmp(p, "vCont;", 6) == 0)
+         {
+            resume((p[6] == 's') || (p[6] == 'S'));
+            return;
+         }
+         else if(packet == "vMustReplyEmpty")
+            reply = "";
+         break;
+
+      case 'q':
+         if(strncmp(p, "qSupported", 10) == 0)
+            reply = "PacketSize=1000;qXfer:features:read+;QStartNoAckMode+";
+         else if(packet == "qAttached")
+            reply = "1";
+         else if(packet == "qC")
+            reply = "QC1";
+         else if(packet == "qfThreadInfo")
+            reply = "m1";
+         else if(packet == "qsThreadInfo")
+            reply = "l";
+         else if(packet == "qOffsets")
+            reply = "Text=0;Data=0;Bss=0";
+         else if(strncmp(p, "qXfer:features:read:target.xml:", 31) == 0)
+         {
+            char* end;
+            size_t offset = strtoul(p+31, &end, 16);
+            size_t len = strtoul(end+1, NULL, 16);
+            size_t total = sizeof(targetXml)-1;
+            if(offset >= total)
+               reply = "l";
+            else
+            {
+               size_t chunk = total-offset;
+               reply = (chunk > len) ? "m" : "l";
+               reply.append(targetXml+offset, (chunk > len) ? len : chunk);
+            }
+         }
+         break;
+
+      case 'Q':
+         if(packet == "QStartNoAckMode")
+         {
+            sendPacket(client, "OK");
+            noAck = true;
+            return;
+         }
+         break;
+
+      case 'T':
+         reply = "OK";
+         break;
+   }
+
+   sendPacket(client, reply);
+}
@@ -0,0 +1,85 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+
+#include "machine.h"
+#include "debugger.h"
+
+/**
+ * GDB remote serial protocol server.
+ *
+ * Serves one client at a time on a local TCP port or unix socket from its
+ * own thread. The cpu loop is only parked while gdb holds it stopped (after
+ * a breakpoint, a step or an interrupt); while the target runs the stub
+ * sleeps in poll() and emulation is not touched.
+ *
+ * Register numbers: 0-15 V0-VF (8 bit), 16 I (16 bit), 17 SP (8 bit),
+ * 18 PC (16 bit), 19 DT (8 bit), 20 ST (8 bit). Memory is the 4KB
+ * address space.
+ */
+class GdbStub
+{
+public:
+   GdbStub(Machine& machine, Debugger& debugger);
+   ~GdbStub();
+
+   /**
+    * Starts listening and the server thread.
+    *
+    * @param[in] address: TCP port on 127.0.0.1, or unix:/path/to/socket
+    */
+   bool listen(const char* address);
+
+   /**
+    * Tells a connected client that the program exited and stops the server.
+    */
+   void close();
+
+   /**
+    * Called on the cpu thread when the debugger stops the machine. Blocks
+    * until gdb resumes it.
+    *
+    * @param[in] watchAddr: written address for a watchpoint stop, -1 otherwise
+    */
+   void stopped(int watchAddr);
+
+private:
+   static void* serverMain(void* arg);
+   void serve(int client);
+   void handlePacket(int client, const std::string& packet);
+   bool sendPacket(int client, const std::string& data);
+   bool sendAll(int client, const char* data, size_t size);
+   void sendStopReply(int client);
+
+   // cpu thread handshake, stub thread side
+   bool haltAndWait();
+   void resume(bool step);
+
+   std::string readRegisters();
+   bool writeRegister(int reg, const char* hex);
+
+   Machine& mach;
+   Debugger& dbg;
+
+   int listenFd;
+   std::string unixPath;
+   int wakePipe[2];
+   pthread_t thread;
+   bool started;
+   bool noAck;
+   bool hungUp;         // a send found the client gone
+
+   // shared with the cpu thread
+   pthread_mutex_t lock;
+   pthread_cond_t changed;
+   bool halted;
+   bool stopPending;
+   bool exited;
+   bool connected;
+   int stopWatch;
+};
+
+#endif //GDBSTUB_H
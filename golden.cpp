@@ -0,0 +1,274 @@
+#include "golden.h"
+#include <stdio.h>
+#include <string.h> //strncmp(), strcmp()
+#include <inttypes.h> //PRIx64
+
+// step digest characters, 6 bits each
+static const char digits[] =
+   "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_";
+
+GoldenTrace::GoldenTrace() :
+   seed(1),
+   frames(0),
+   every(1),
+   timing(TIMING_FAST)
+{
+}
+
+bool GoldenTrace::load(const char* path)
+{
+   FILE* f = fopen(path, "r");
+   if(f == NULL)
+   {
+      fprintf(stderr, "Cannot open trace %s\n", path);
+      return false;
+   }
+
+   // steps lines hold a character per instruction of a frame
+   char line[4096];
+   int lineNo = 0;
+   while(fgets(line, sizeof(line), f) != NULL)
+   {
+      ++lineNo;
+      if(strncmp(line, "check ", 6) == 0)
+      {
+         Check c;
+         unsigned pc;
+         if(sscanf(line, "check %u %" SCNu64 " %x %" SCNx64 " %" SCNx64,
+                   &c.frame, &c.instructions, &pc, &c.registers, &c.screen) != 5)
+         {
+            fprintf(stderr, "%s:%i: bad check line\n", path, lineNo);
+            fclose(f);
+            return false;
+         }
+         c.pc = pc;
+         c.stateHashOk = true;
+         expected.push_back(c);
+         continue;
+      }
+      if(strncmp(line, "steps ", 6) == 0)
+      {
+         expectedSteps.push_back(std::string(line+6, strcspn(line+6, " \r\n")));
+         continue;
+      }
+
+      setup.push_back(line);
+
+      unsigned a, b;
+      char model[8];
+      if(sscanf(line, "seed %u", &a) == 1)
+         seed = a;
+      else if(sscanf(line, "frames %u", &a) == 1)
+         frames = a;
+      else if(sscanf(line, "every %u", &a) == 1)
+         every = (a > 0) ? a : 1;
+      else if(sscanf(line, "timing %7s", model) == 1)
+      {
+         if(strcmp(model, "vip") == 0)
+            timing = TIMING_VIP;
+         else if(strcmp(model, "fast") == 0)
+            timing = TIMING_FAST;
+         else
+         {
+            fprintf(stderr, "%s:%i: unknown timing %s\n", path, lineNo, model);
+            fclose(f);
+            return false;
+         }
+      }
+      else if(sscanf(line, "input %u %x", &a, &b) == 2)
+      {
+         Input in = { a, (uint16_t)b };
+         inputs.push_back(in);
+      }
+   }
+
+   fclose(f);
+   return true;
+}
+
+void GoldenTrace::setupMachine(Machine& mach, uint8_t* program, int length) const
+{
+   mach.setHeadless(true);
+   mach.setSeed(seed);
+   mach.setTiming(timing);
+   mach.load(program, length);
+}
+
+void GoldenTrace::applyInputs(Machine& mach, uint32_t frame, size_t* nextInput) const
+{
+   // inputs are latched at frame boundaries, like the live input poll
+   while((*nextInput < inputs.size()) && (inputs[*nextInput].frame <= frame))
+      mach.setKeys(inputs[(*nextInput)++].mask);
+}
+
+void GoldenTrace::run(uint8_t*                  program,
+                      int                       length,
+                      std::vector<Check>&       checks,
+                      std::vector<std::string>* steps)
+{
+   Machine mach;
+   setupMachine(mach, program, length);
+
+   size_t nextInput = 0;
+   for(uint32_t frame=0; frame<frames; frame++)
+   {
+      applyInputs(mach, frame, &nextInput);
+
+      // runFrame() a step at a time, for the digests
+      std::string digests;
+      bool alive = true;
+      while(true)
+      {
+         if(!mach.running())
+         {
+            alive = false;
+            break;
+         }
+         bool frameEnd = mach.step();
+         uint64_t h = mach.stateHash();
+         digests += digits[(h ^ (h >> 32)) & 63];
+         if(frameEnd)
+            break;
+      }
+      if(steps != NULL)
+         steps->push_back(digests);
+
+      if((((frame+1) % every) == 0) || !alive)
+      {
+         Check c;
+         c.frame = frame+1;
+         c.instructions = mach.getInstructions();
+         c.pc = mach.getPC();
+         c.registers = mach.hashRegisters();
+         c.screen = mach.hashScreen();
+         c.stateHashOk = (mach.stateHash() == mach.computeStateHash());
+         checks.push_back(c);
+      }
+
+      if(!alive)
+         break;
+   }
+}
+
+void GoldenTrace::reportStep(const char* name, uint8_t* program, int length,
+                             uint32_t frame, size_t step) const
+{
+   // re-run up to the instruction whose result first differs
+   Machine mach;
+   setupMachine(mach, program, length);
+   size_t nextInput = 0;
+   for(uint32_t f=0; (f<frame) && mach.running(); f++)
+   {
+      applyInputs(mach, f, &nextInput);
+      mach.runFrame();
+   }
+   applyInputs(mach, frame, &nextInput);
+   for(size_t i=0; (i<step) && mach.running(); i++)
+      mach.step();
+
+   uint16_t pc = mach.getPC();
+   printf("%s: FAIL first divergence in frame %u, instruction %" PRIu64 " at pc 0x%03x (opcode %02x%02x)\n",
+          name, frame+1, mach.getInstructions()+1, pc, mach.getByte(pc), mach.getByte(pc+1));
+}
+
+bool GoldenTrace::verify(const char* name,
+                         uint8_t*    program,
+                         int         length)
+{
+   std::vector<Check> actual;
+   std::vector<std::string> actualSteps;
+   run(program, length, actual, &actualSteps);
+
+   // the first differing step, when the trace has them
+   for(size_t f=0; f<expectedSteps.size(); f++)
+   {
+      const std::string& e = expectedSteps[f];
+      const std::string none;
+      const std::string& a = (f < actualSteps.size()) ? actualSteps[f] : none;
+      if(e == a)
+         continue;
+      size_t step = 0;
+      while((step < e.size()) && (step < a.size()) && (e[step] == a[step]))
+         ++step;
+      reportStep(name, program, length, f, step);
+      if(e.size() != a.size())
+         printf("   instructions in the frame: expected %zu got %zu\n", e.size(), a.size());
+      return false;
+   }
+   if(!expectedSteps.empty() && (actualSteps.size() != expectedSteps.size()))
+   {
+      printf("%s: FAIL expected %zu frames, ran %zu\n", name, expectedSteps.size(), actualSteps.size());
+      return false;
+   }
+
+   uint64_t lastGood = 0;
+   size_t count = (actual.size() < expected.size()) ? actual.size() : expected.size();
+   for(size_t i=0; i<count; i++)
+   {
+      const Check& e = expected[i];
+      const Check& a = actual[i];
+      if(!a.stateHashOk)
+      {
+         printf("%s: FAIL incremental state hash drifted by frame %u\n", name, a.frame);
+         return false;
+      }
+      if((e.frame == a.frame) && (e.instructions == a.instructions) && (e.pc == a.pc) &&
+         (e.registers == a.registers) && (e.screen == a.screen))
+      {
+         lastGood = a.instructions;
+         continue;
+      }
+
+      printf("%s: FAIL first divergence at frame %u, between instructions %" PRIu64 " and %" PRIu64 "\n",
+             name, e.frame, lastGood, (a.instructions < e.instructions) ? a.instructions : e.instructions);
+      if(e.instructions != a.instructions)
+         printf("   instructions: expected %" PRIu64 " got %" PRIu64 "\n", e.instructions, a.instructions);
+      if(e.pc != a.pc)
+         printf("   pc:           expected 0x%03x got 0x%03x\n", e.pc, a.pc);
+      if(e.registers != a.registers)
+         printf("   registers differ\n");
+      if(e.screen != a.screen)
+         printf("   screen differs\n");
+      return false;
+   }
+
+   if(actual.size() != expected.size())
+   {
+      printf("%s: FAIL expected %zu checkpoints, got %zu\n", name, expected.size(), actual.size());
+      return false;
+   }
+
+   printf("%s: ok, %zu checkpoints, %" PRIu64 " instructions\n",
+          name, actual.size(), actual.empty() ? 0 : actual.back().instructions);
+   return true;
+}
+
+bool GoldenTrace::record(const char* path,
+                         uint8_t*    program,
+                         int         length)
+{
+   std::vector<Check> actual;
+   std::vector<std::string> steps;
+   run(program, length, actual, &steps);
+
+   FILE* f = fopen(path, "w");
+   if(f == NULL)
+   {
+      fprintf(stderr, "Cannot write trace %s\n", path);
+      return false;
+   }
+
+   for(size_t i=0; i<setup.size(); i++)
+      fputs(setup[i].c_str(), f);
+   for(size_t i=0; i<actual.size(); i++)
+   {
+      const Check& c = actual[i];
+      fprintf(f, "check %u %" PRIu64 " %03x %016" PRIx64 " %016" PRIx64 "\n",
+              c.frame, c.instructions, c.pc, c.registers, c.screen);
+   }
+   for(size_t i=0; i<steps.size(); i++)
+      fprintf(f, "steps %s\n", steps[i].c_str());
+
+   fclose(f);
+   return true;
+}
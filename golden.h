@@ -0,0 +1,97 @@
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+
+/**
+ * Golden output traces for regression runs.
+ *
+ * A trace file holds the run setup followed by the expected checkpoints:
+ *
+ *    seed 1             CXNN random seed
+ *    frames 1800        frames to run
+ *    every 1            checkpoint interval in frames
+ *    timing vip         cosmac vip cycle timing, fast when left out
+ *    input 120 0010     from frame 120 on the key mask is 0x0010
+ *    check <frame> <instructions> <pc> <register hash> <screen hash>
+ *    steps <digests>    per frame, a character per executed instruction
+ *
+ * record() runs the setup headless and rewrites the file with fresh check
+ * and steps lines. verify() runs it and compares. Every step digest is 6
+ * bits of stateHash() after the instruction, so a difference is found at
+ * the exact frame and instruction, which is re-run to report its pc.
+ */
+class GoldenTrace
+{
+public:
+   GoldenTrace();
+
+   /**
+    * Reads a trace file.
+    *
+    * @param[in] path: The trace file
+    */
+   bool load(const char* path);
+
+   /**
+    * Runs the program and compares against the loaded checkpoints.
+    *
+    * @param[in] name:    Label used in the report
+    * @param[in] program: The pointer to the program code
+    * @param[in] length:  The length of the program in bytes
+    * @return true when every checkpoint matched
+    */
+   bool verify(const char* name,
+               uint8_t*    program,
+               int         length);
+
+   /**
+    * Runs the program and writes the setup plus new checkpoints to path.
+    */
+   bool record(const char* path,
+               uint8_t*    program,
+               int         length);
+
+private:
+   struct Input
+   {
+      uint32_t frame;
+      uint16_t mask;
+   };
+
+   struct Check
+   {
+      uint32_t frame;
+      uint64_t instructions;
+      uint16_t pc;
+      uint64_t registers;
+      uint64_t screen;
+      bool stateHashOk; // incremental stateHash() matched a full one, not saved
+   };
+
+   void run(uint8_t*                  program,
+            int                       length,
+            std::vector<Check>&       checks,
+            std::vector<std::string>* steps);
+   void setupMachine(Machine& mach, uint8_t* program, int length) const;
+   void applyInputs(Machine& mach, uint32_t frame, size_t* nextInput) const;
+   void reportStep(const char* name, uint8_t* program, int length,
+                   uint32_t frame, size_t step) const;
+
+   uint32_t seed;
+   uint32_t frames;
+   uint32_t every;
+   TimingModel timing;
+   std::vector<Input> inputs;
+   std::vector<Check> expected;
+   std::vector<std::string> expectedSteps;
+
+   // setup lines kept verbatim for record()
+   std::vector<std::string> setup;
+};
+
+#endif //GOLDEN_H
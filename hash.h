@@ -0,0 +1,41 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+/**
+ * 64 bit FNV-1a, pass the previous result as seed to hash several buffers
+ * as one.
+ */
+static inline uint64_t hashBytes(const void* data,
+                                 size_t      length,
+                                 uint64_t    seed = FNV_OFFSET)
+{
+   const uint8_t* p = (const uint8_t*) data;
+   uint64_t h = seed;
+   for(size_t i=0; i<length; i++)
+   {
+      h ^= p[i];
+      h *= FNV_PRIME;
+   }
+   return h;
+}
+
+/**
+ * Zobrist style key, a well mixed 64 bit value per (position, value)
+ * pair (the splitmix64 finalizer). A state hash is the XOR of the keys of
+ * its parts, so changing one part costs two keys instead of a rehash.
+ */
+static inline uint64_t hashKey(uint64_t x)
+{
+   x += 0x9e3779b97f4a7c15ULL;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 31);
+}
+
+#endif //HASH_H
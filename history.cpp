@@ -0,0 +1,100 @@
+#include "history.h"
+
+History::History(Machine& machine) :
+   mach(machine),
+   keyframes(HISTORY_KEYFRAMES),
+   first(0),
+   count(0),
+   nextKeyframe(0),
+   lastKeys(0),
+   end(0),
+   replayNext(0),
+   replayKeys(0)
+{
+}
+
+void History::saveKeyframe(uint64_t pos)
+{
+   if(count == HISTORY_KEYFRAMES)
+   {
+      // drop the oldest keyframe and the inputs only it needed
+      first = (first+1)%HISTORY_KEYFRAMES;
+      --count;
+      uint64_t oldest = keyframes[first].position;
+      size_t drop = 0;
+      while((drop < inputs.size()) && (inputs[drop].position < oldest))
+         ++drop;
+      inputs.erase(inputs.begin(), inputs.begin()+drop);
+   }
+
+   Keyframe& k = keyframes[(first+count)%HISTORY_KEYFRAMES];
+   k.position = pos;
+   mach.saveState(&k.state);
+   ++count;
+   nextKeyframe = pos + HISTORY_INTERVAL;
+}
+
+void History::replayInputs(uint64_t pos)
+{
+   while((replayNext < inputs.size()) && (inputs[replayNext].position <= pos))
+      replayKeys = inputs[replayNext++].keys;
+   mach.setKeys(replayKeys);
+}
+
+int History::findKeyframe(uint64_t position) const
+{
+   for(int n=count-1; n>=0; n--)
+   {
+      if(keyframePosition(n) <= position)
+         return n;
+   }
+   return -1;
+}
+
+void History::restore(int n)
+{
+   const Keyframe& k = keyframes[(first+n)%HISTORY_KEYFRAMES];
+   mach.loadState(k.state);
+
+   replayKeys = k.state.keys;
+   replayNext = 0;
+   while((replayNext < inputs.size()) && (inputs[replayNext].position < k.position))
+      ++replayNext;
+}
+
+void History::replayStep()
+{
+   FrameCapture* capture = mach.capture;
+   AudioOutput* audio = mach.audio;
+   TraceRecorder* tracer = mach.tracer;
+   MachineMetrics* metrics = mach.metrics;
+   mach.capture = NULL;
+   mach.audio = NULL;
+   mach.tracer = NULL;
+   mach.metrics = NULL;
+
+   mach.step();
+
+   mach.capture = capture;
+   mach.audio = audio;
+   mach.tracer = tracer;
+   mach.metrics = metrics;
+
+   // replayed instructions were counted the first time round
+   mach.publishedInstructions = mach.instructions;
+}
+
+bool History::seek(uint64_t position)
+{
+   if(position > end)
+      return false;
+
+   int n = findKeyframe(position);
+   if(n < 0)
+      return false;
+
+   restore(n);
+   while((mach.instructions < position) && mach.running())
+      replayStep();
+   return true;
+}
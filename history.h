@@ -0,0 +1,119 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "machine.h"
+
+// instructions between keyframes, the most a reverse step re-executes
+#define HISTORY_INTERVAL 1000
+
+// keyframes kept, older ones are dropped (~6.4KB each, so 512 cover the
+// last 512000 instructions in about 3MB)
+#define HISTORY_KEYFRAMES 512
+
+/**
+ * Execution history for reverse debugging.
+ *
+ * Apart from the host inputs the machine is deterministic (CXNN runs from
+ * the rng state in the snapshot), so the history is a ring of periodic
+ * keyframes plus a log of key mask changes. Any earlier instruction is
+ * reached by restoring the nearest keyframe before it and re-executing
+ * forward with the logged inputs.
+ *
+ * Positions are instruction counts (Machine::getInstructions()), a state
+ * at position n is the one before instruction n executes. After rewinding,
+ * running forward again replays the logged inputs up to where recording
+ * stopped, so the future stays the same.
+ */
+class History
+{
+public:
+   History(Machine& machine);
+
+   /**
+    * Called by the machine before every instruction.
+    */
+   void onStep()
+   {
+      uint64_t pos = mach.instructions;
+      if(pos < end)
+      {
+         replayInputs(pos);
+         return;
+      }
+
+      uint16_t keys = mach.getKeys();
+      if(keys != lastKeys)
+      {
+         Input in = { pos, keys };
+         inputs.push_back(in);
+         lastKeys = keys;
+      }
+      if(pos >= nextKeyframe)
+         saveKeyframe(pos);
+      end = pos+1;
+   }
+
+   /**
+    * Rewinds (or replays forward) to a recorded position.
+    *
+    * @return false when the position is older than the oldest keyframe
+    */
+   bool seek(uint64_t position);
+
+   // keyframes oldest first
+   int keyframeCount() const { return count; }
+   uint64_t keyframePosition(int n) const { return keyframes[(first+n)%HISTORY_KEYFRAMES].position; }
+
+   // newest keyframe at or before a position, -1 if there is none
+   int findKeyframe(uint64_t position) const;
+
+   /**
+    * Loads keyframe n, the machine is then at keyframePosition(n).
+    */
+   void restore(int n);
+
+   /**
+    * Re-executes one instruction with the outputs (capture, audio, trace)
+    * detached, so replays are not seen or heard twice.
+    */
+   void replayStep();
+
+private:
+   struct Keyframe
+   {
+      uint64_t position;
+      MachineState state;
+   };
+
+   struct Input
+   {
+      uint64_t position;
+      uint16_t keys;
+   };
+
+   void saveKeyframe(uint64_t pos);
+   void replayInputs(uint64_t pos);
+
+   Machine& mach;
+
+   std::vector<Keyframe> keyframes;
+   int first;
+   int count;
+   uint64_t nextKeyframe;
+
+   // key mask changes, by position
+   std::vector<Input> inputs;
+   uint16_t lastKeys;
+
+   // first position not recorded yet
+   uint64_t end;
+
+   // input replay cursor while behind end
+   size_t replayNext;
+   uint16_t replayKeys;
+};
+
+#endif //HISTORY_H
@@ -0,0 +1,82 @@
+#include "keymap.h"
+#include <stdio.h>
+#include <string.h> //strncpy()
+#include <strings.h> //strcasecmp()
+#include <stdlib.h> //strtol()
+
+KeyMap::KeyMap() :
+   count(0)
+{
+   // the original hardcoded layout, row by row onto keys 0-F
+   const char* layout = "1234qwerasdfzxcv";
+   for(int i=0; i<16; i++)
+   {
+      char name[2] = { layout[i], 0 };
+      bind(name, i);
+   }
+   bind("escape", KEYMAP_QUIT);
+}
+
+bool KeyMap::bind(const char* name, uint8_t key)
+{
+   if(count == KEYMAP_MAX)
+      return false;
+
+   strncpy(bindings[count].name, name, KEYMAP_NAME-1);
+   bindings[count].name[KEYMAP_NAME-1] = 0;
+   bindings[count].key = key;
+   ++count;
+   return true;
+}
+
+int KeyMap::find(const char* name) const
+{
+   for(int i=0; i<count; i++)
+   {
+      if(strcasecmp(bindings[i].name, name) == 0)
+         return bindings[i].key;
+   }
+   return -1;
+}
+
+bool KeyMap::load(const char* path)
+{
+   FILE* f = fopen(path, "r");
+   if(f == NULL)
+   {
+      fprintf(stderr, "Cannot open key map %s\n", path);
+      return false;
+   }
+
+   clear();
+
+   char line[128];
+   int lineNo = 0;
+   while(fgets(line, sizeof(line), f) != NULL)
+   {
+      ++lineNo;
+      char host[KEYMAP_NAME];
+      char target[16];
+      if((line[0] == '#') || (sscanf(line, "%31s %15s", host, target) != 2))
+         continue;
+
+      if(strcasecmp(target, "quit") == 0)
+      {
+         bind(host, KEYMAP_QUIT);
+         continue;
+      }
+
+      char* end;
+      long key = strtol(target, &end, 16);
+      if((*end != 0) || (key < 0) || (key > 0xF))
+      {
+         fprintf(stderr, "%s:%i: bad chip-8 key %s\n", path, lineNo, target);
+         fclose(f);
+         return false;
+      }
+      bind(host, (uint8_t)key);
+   }
+
+   fclose(f);
+   return true;
+}
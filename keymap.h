@@ -0,0 +1,64 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdint.h>
+
+// bindings a key map can hold, several host keys may share a chip-8 key
+#define KEYMAP_MAX 64
+
+// host key name length, including the terminator
+#define KEYMAP_NAME 32
+
+// chip-8 key value used for the quit binding
+#define KEYMAP_QUIT 0xFF
+
+/**
+ * Host key to chip-8 keypad bindings.
+ *
+ * Keys are bound by name ("q", "1", "escape", "up" ...) so the same map
+ * works with every backend; each backend resolves the names to its own
+ * key codes once, when the window is created.
+ */
+class KeyMap
+{
+public:
+   /**
+    * Starts out with the default 1234/qwer/asdf/zxcv layout.
+    */
+   KeyMap();
+
+   /**
+    * Loads bindings from a file, one "<host key> <chip-8 key>" per line.
+    * The chip-8 key is a hex digit 0-f or "quit". Lines starting with #
+    * are comments.
+    *
+    * @param[in] path: The key map file
+    */
+   bool load(const char* path);
+
+   void clear() { count = 0; }
+   bool bind(const char* name, uint8_t key);
+
+   int size() const { return count; }
+   const char* name(int i) const { return bindings[i].name; }
+   uint8_t key(int i) const { return bindings[i].key; }
+
+   /**
+    * Looks up a host key name, case insensitive.
+    *
+    * @return the chip-8 key, KEYMAP_QUIT, or -1 when unbound
+    */
+   int find(const char* name) const;
+
+private:
+   struct Binding
+   {
+      char name[KEYMAP_NAME];
+      uint8_t key;
+   };
+
+   Binding bindings[KEYMAP_MAX];
+   int count;
+};
+
+#endif //KEYMAP_H
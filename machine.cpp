@@ -1,8 +1,21 @@
 #include "machine.h"
+#include "capture.h"
+#include "audio.h"
+#include "debugger.h"
+#include "trace.h"
+#include "history.h"
+#include "observer.h"
+#include "metrics.h"
+#ifdef BUILD_X11
+#include <X11/XKBlib.h> //XkbSetDetectableAutoRepeat()
+#include <X11/Xutil.h> //XDestroyImage()
+#endif
 #include <string.h> //memset()
-#include <stdlib.h> //rand()
+#include <stdlib.h> //exit()
 #include <unistd.h> //sleep()
 #include <time.h> //time() difftime()
+#include <ctype.h> //toupper()
+#include <sys/select.h> //select()
 
 // font set
 uint8_t chip8_fontset[80] =
@@ -25,12 +38,44 @@ uint8_t chip8_fontset[80] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+MachineHost::MachineHost() :
+   fading(false),
+   inputPending(false),
+   latencySum(0),
+   latencyMax(0),
+   latencyCount(0)
+{
+   for(int i=0; i<HOST_KEYS; i++)
+      hostKeys[i]=-1;
+}
+
 Machine::Machine() :
    I(0),
-   drawFlag(false),
    pc(0),
    sp(0),
-   kill(false)
+   kill(false),
+   idle(false),
+   drawFlag(false),
+   cycles(0),
+   stepCycles(1),
+   instructions(0),
+   timing(TIMING_FAST),
+   idleSkipped(0),
+   history(NULL),
+   tracer(NULL),
+   debugger(NULL),
+   keyMask(0),
+   frames(0),
+   frameLimit(0),
+   observer(NULL),
+   capture(NULL),
+   audio(NULL),
+   metrics(NULL),
+   frameStart(0),
+   hostTime(0),
+   publishedInstructions(0),
+   headless(false),
+   host(NULL)
 {
    // init memories
    memset(memory, 0, MEMORY_SIZE*sizeof(uint8_t));
@@ -41,6 +86,10 @@ Machine::Machine() :
    delayTimer=0;
    soundTimer=0;
    
+   // plain chip-8 beeper, a square wave of ~500Hz at the default pitch
+   memset(pattern, 0xF0, PATTERN_SIZE);
+   pitch=64;
+   
    // init fonts
    for(int i=0; i<80; i++)
       memory[i] = chip8_fontset[i];
@@ -48,20 +97,36 @@ Machine::Machine() :
    // init graphics
    for(int i=0; i<SCREEN_WIDTH*SCREEN_HEIGHT; i++)
          screen[i]=0;
-   
-   // init keys
-   for(int i=0; i<16; i++)
-      keys[i]=0;
-   
-   // get the graphics started
-   initGraphics();
+   memset(screenRows, 0, sizeof(screenRows));
+   rehash();
+   dirtyPages = 0;
+   screenDirty = false;
 
    // initialize random seed
-   srand(time(NULL));
+   setSeed(time(NULL));
 }
 
 Machine::~Machine()
 {
+   delete host;
+}
+
+MachineHost& Machine::hostState()
+{
+   if(host == NULL)
+      host = new MachineHost();
+   return *host;
+}
+
+// %04x without printf, the disassembler formats tens of thousands of these
+static char* putHex4(char* out, unsigned value)
+{
+   int shift = 12;
+   while((value >> shift) >= 16)
+      shift += 4;
+   for(; shift>=0; shift-=4)
+      *out++ = "0123456789abcdef"[(value >> shift) & 0xF];
+   return out;
 }
 
 void Machine::disassemble(uint8_t* program, int length)
@@ -72,682 +137,822 @@ void Machine::disassemble(uint8_t* program, int length)
    printf("addr  op  note\n");
    printf("---- ---- ---------------\n");
    
-   uint16_t instr = 0;
+   // the whole listing goes out in one write, a line is at most the
+   // address, opcode, mnemonic and 3 separators
+   int lines = (length+1)/2;
+   char* listing = (char*) malloc((size_t)lines*(8+2+OP_TEXT_SIZE+4) + 1);
+   char* out = listing;
+   
    for(int i=0; i<length; i+=2)
    {
-      instr = (program[i]<<8) | program[i+1];
-      printf("%04x %04x ", i+0x200, instr);
+      uint16_t instr = (program[i]<<8) | ((i+1 < length) ? program[i+1] : 0);
+      out = putHex4(out, i+0x200);
+      *out++ = ' ';
+      out = putHex4(out, instr);
+      *out++ = ' ';
+      out += formatOpcode(instr, out);
+      *out++ = '\n';
       
-      if( !decode(instr, false, true) )
-      {
-         //printf("unknown/bad opcode\n");
+      if(decodeOpcode(instr).kind == OP_UNKNOWN)
          ++badcodes;
-      }
    }
+   fflush(stdout);
+   fwrite(listing, 1, out-listing, stdout);
+   free(listing);
    
    printf("\ntotal instructions %i\n", length/2);
    printf("found %i unknown/bad instructions\n", badcodes);
 }
 
-void Machine::execute(uint8_t* program, int length)
-{   
+void Machine::load(uint8_t* program, int length)
+{
    // set program counter / stack pointer
    pc = START_ADDRESS;
    sp = 0;
    
    // copy the program into memory
+   if(length > (MEMORY_SIZE-START_ADDRESS))
+      length = MEMORY_SIZE-START_ADDRESS;
    memcpy(&(memory[pc]), program, length);
-   
-   while((!kill) && ((pc+1)<MEMORY_SIZE) && (pc != 0))
-   {
-      // wait for user input
-      //fgetc(stdin);
-      //for(int b=0; b<16; b++) printf("V[%i]=x%02X ", b, v[b]);
-      //printf("\n");
-      //printf("I=0x%x\n", I);
+   rehash();
+   dirtyPages = 0;
+   screenDirty = false;
+}
 
-      // sleep to slow down
-      usleep(500);
+bool Machine::running() const
+{
+   return (!kill) && ((pc+1)<MEMORY_SIZE) && (pc != 0);
+}
 
-      // *** fetch ***
-      uint16_t opcode = (memory[pc]<<8) | memory[pc+1];
-      
-      // *** decode ***
-      decode(opcode, true, false);
-      
-      // *** update timers ***
-      updateTimers();
-      
-      // *** update screen ***
-      if(drawFlag)
+bool Machine::step()
+{
+   if(timing == TIMING_VIP)
+      return stepTimed<VipTiming>();
+   return stepTimed<FastTiming>();
+}
+
+template<class Timing>
+bool Machine::stepTimed()
+{
+   // keyframes and the input log for reverse execution
+   if(history != NULL)
+      history->onStep();
+   
+   // *** fetch ***
+   uint16_t opcode = (memory[pc]<<8) | memory[pc+1];
+   
+   if(tracer != NULL)
+      tracer->begin(pc, opcode);
+   
+   // *** decode, execute ***
+   uint16_t from = pc;
+   interpret(opcode);
+   ++instructions;
+   const OpInfo& op = decodeOpcode(opcode);
+   stepCycles = Timing::cost(op, v, from, pc);
+   cycles += stepCycles;
+   
+   // *** idle or waiting for the display, fast forward to the next timer tick ***
+   idleSkipped = 0;
+   if(idle || (Timing::displayWait && (op.kind == OP_SPRITE)))
+   {
+      idle = false;
+      if(cycles < Timing::frameCycles)
       {
-         drawGraphics();
-         drawFlag = false;
+         idleSkipped = Timing::frameCycles - cycles;
+         cycles = Timing::frameCycles;
       }
-
-      // *** process inputs ***
-      pollInputs();
-   } // while
+   }
    
-   // let's cleanup
-   cleanupGraphics();
+   // *** update timers ***
+   bool frameEnd = updateTimers(Timing::frameCycles);
+   if(frameEnd)
+      endFrame();
+   
+   if(tracer != NULL)
+      tracer->end(frameEnd);
+   return frameEnd;
 }
 
-bool Machine::decode(uint16_t opcode,
-                     bool emulate,
-                     bool decode)
+bool Machine::runFrame()
 {
-   bool valid = true; // assume true for now
+   if(timing == TIMING_VIP)
+      return runFrameTimed<VipTiming>();
+   return runFrameTimed<FastTiming>();
+}
+
+template<class Timing>
+bool Machine::runFrameTimed()
+{
+   while(running())
+   {
+      if(stepTimed<Timing>())
+         return true;
+   }
+   return false;
+}
+
+void Machine::execute(uint8_t* program, int length)
+{   
+   load(program, length);
    
-   //printf("opcode 0x%04x\n", opcode);
+   // get the graphics started
+   if(!headless)
+   {
+      initGraphics();
+      if(audio != NULL)
+         audio->openDevice();
+   }
    
-   switch(opcode&0xF000)
+   while(running())
    {
-      //****************//
-      case 0x0000:
+      // breakpoints, watchpoints and single stepping
+      if((debugger != NULL) && debugger->shouldStop(pc))
       {
-         switch(opcode&0x00FF)
-         {
-            case 0x00E0: // 00E0    Clears the screen.
-            {
-               if(emulate)
-               {
-                  for(int i=0; i<SCREEN_HEIGHT*SCREEN_WIDTH; i++)
-                  {
-                     screen[i]=0;
-                     drawFlag = true;
-                  }
-               }
-               if(decode)
-               {
-                  printf("cls\n");
-               }
-            }
-            break;
-
-            case 0x00EE: // 00EE   Returns from a subroutine.
-            {
-               if(emulate)
-               {
-                  sp--;
-                  pc = stack[sp];
-               }
-               if(decode)
-               {
-                  printf("rtn\n");
-               }
-            }
+         uint64_t t0 = (metrics != NULL) ? metricsNow() : 0;
+         debugger->enter();
+         if(metrics != NULL)
+            hostTime += metricsNow() - t0;
+         if(!running())
             break;
-               
-            default:
-               printf("unknown opcode\n");
-               valid = false;
-               break;
-         }
-         pc += 2; // either commands will increment the pc
       }
-      break;
 
-      //****************//
-      case 0x1000: // 1NNN    Jumps to address NNN.
+      // sleep to slow down, headless runs flat out
+      if(!headless)
       {
-         if(emulate)
-         {
-            pc = opcode&0x0FFF;
-         }
-         if(decode)
-         {
-            printf("jmp 0x%x\n", opcode&0x0FFF);
-         }
+         uint64_t t0 = (metrics != NULL) ? metricsNow() : 0;
+         usleep(stepCycles*cycleMicros());
+         if(metrics != NULL)
+            hostTime += metricsNow() - t0;
       }
-      break;
+
+      bool frameEnd = step();
       
-      //****************//
-      case 0x2000: // 2NNN    Calls subroutine at NNN.
+      if(headless)
       {
-         if(emulate)
-         {
-            stack[sp++] = pc;  // push current onto stack
-            pc = opcode&0x0FFF; // set pc
-         }
-         if(decode)
-         {
-            printf("jsr 0x%x\n", opcode&0x0FFF);
-         }
+         drawFlag = false;
+         continue;
       }
-      break;
-
-      //****************//
-      case 0x3000: // 3XNN    Skips the next instruction if VX equals NN.
+      
+      // in real time sleep off the skipped instructions, but wake up
+      // early when an input arrives
+      uint64_t t0 = (metrics != NULL) ? metricsNow() : 0;
+      if(idleSkipped > 0)
+         waitEvents(idleSkipped*cycleMicros());
+      uint64_t t1 = (metrics != NULL) ? metricsNow() : 0;
+      
+      // *** process inputs, once per frame ***
+      if(frameEnd)
+         pollInputs();
+      uint64_t t2 = (metrics != NULL) ? metricsNow() : 0;
+      
+      // *** update screen ***
+      // present once per frame rather than after every draw, the renderer
+      // blends the frames games erase and redraw sprites in
+      if(frameEnd && (drawFlag || host->fading))
       {
-         if(emulate)
-         {
-            if(v[(opcode>>8)&0x000F] == (opcode&0x00FF))
-               pc+=2;
-            pc+=2;
-         }
-         if(decode)
+         drawGraphics();
+         drawFlag = false;
+         if(metrics != NULL)
+            MachineMetrics::add(metrics->presents, 1);
+         
+         if(host->inputPending)
          {
-            printf("skip.eq V%i,0x%x\n", (opcode>>8)&0x000F, opcode&0x00FF);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double ms = (now.tv_sec - host->inputStamp.tv_sec)*1000.0 +
+                        (now.tv_nsec - host->inputStamp.tv_nsec)/1000000.0;
+            host->latencySum += ms;
+            if(ms > host->latencyMax)
+               host->latencyMax = ms;
+            ++host->latencyCount;
+            host->inputPending = false;
+            
+            if(metrics != NULL)
+            {
+               uint64_t ns = ms*1000000.0;
+               MachineMetrics::add(metrics->latencyCount, 1);
+               MachineMetrics::add(metrics->latencySum, ns);
+               if(ns > metrics->latencyMax.load(std::memory_order_relaxed))
+                  MachineMetrics::set(metrics->latencyMax, ns);
+            }
          }
       }
-      break;
       
-      //****************//
-      case 0x4000: // 4XNN    Skips the next instruction if VX doesn't equal NN.
+      if(metrics != NULL)
       {
-         if(emulate)
-         {
-            if(v[(opcode>>8)&0x000F] != (opcode&0x00FF))
-               pc+=2;
-            pc+=2;
-         }
-         if(decode)
-         {
-            printf("skip.ne V%i,0x%x\n", (opcode>>8)&0x000F, opcode&0x00FF);
-         }
+         uint64_t t3 = metricsNow();
+         MachineMetrics::add(metrics->pollTime, t2 - t1);
+         MachineMetrics::add(metrics->drawTime, t3 - t2);
+         hostTime += t3 - t0;
       }
-      break;
+   } // while
+   
+   if((host != NULL) && (host->latencyCount > 0))
+      fprintf(stderr, "input to display latency: avg %.2f ms, max %.2f ms over %u inputs\n",
+              host->latencySum/host->latencyCount, host->latencyMax, host->latencyCount);
+   
+   // let's cleanup
+   if(audio != NULL)
+      audio->close();
+   if(!headless)
+      cleanupGraphics();
+}
 
-      //****************//
-      case 0x5000: // 5XY0    Skips the next instruction if VX equals VY.
-      {
-         if(emulate)
-         {
-            if(v[(opcode>>8)&0x000f] == v[(opcode>>4)&0x000f])
-               pc+=2;
-            pc+=2;
-         }
-         if(decode)
+void Machine::saveState(MachineState* state) const
+{
+   memcpy(state->memory, memory, sizeof(memory));
+   memcpy(state->v, v, sizeof(v));
+   state->I = I;
+   memcpy(state->stack, stack, sizeof(stack));
+   if(observer != NULL)
+      unpackScreen(state->screen);
+   else
+      memcpy(state->screen, screen, sizeof(screen));
+   state->pc = pc;
+   state->sp = sp;
+   state->delayTimer = delayTimer;
+   state->soundTimer = soundTimer;
+   memcpy(state->pattern, pattern, sizeof(pattern));
+   state->pitch = pitch;
+   state->keys = getKeys();
+   state->rngState = rngState;
+   state->cycles = cycles;
+   state->frames = frames;
+   state->instructions = instructions;
+   state->memoryHash = memoryHash;
+   state->screenHash = liveScreenHash();
+}
+
+void Machine::loadState(const MachineState& state)
+{
+   memcpy(memory, state.memory, sizeof(memory));
+   memcpy(screen, state.screen, sizeof(screen));
+   if(observer != NULL)
+      packScreen(state.screen);
+   dirtyPages = 0;
+   screenDirty = false;
+   loadRegisters(state);
+}
+
+void Machine::reset(const MachineState& state)
+{
+   kill = false;
+   loadState(state);
+}
+
+static_assert(MEMORY_PAGES <= 32, "dirtyPages has one bit per page");
+
+void Machine::revertState(const MachineState& base)
+{
+   for(uint32_t pages=dirtyPages; pages!=0; pages&=pages-1)
+   {
+      int offset = __builtin_ctz(pages) << MEMORY_PAGE_SHIFT;
+      memcpy(memory+offset, base.memory+offset, 1 << MEMORY_PAGE_SHIFT);
+   }
+   if(screenDirty && (observer != NULL))
+      packScreen(base.screen);
+   else if(screenDirty)
+      memcpy(screen, base.screen, sizeof(screen));
+   dirtyPages = 0;
+   screenDirty = false;
+   loadRegisters(base);
+}
+
+void Machine::loadRegisters(const MachineState& state)
+{
+   memcpy(v, state.v, sizeof(v));
+   I = state.I;
+   memcpy(stack, state.stack, sizeof(stack));
+   pc = state.pc;
+   sp = state.sp;
+   delayTimer = state.delayTimer;
+   soundTimer = state.soundTimer;
+   memcpy(pattern, state.pattern, sizeof(pattern));
+   pitch = state.pitch;
+   setKeys(state.keys);
+   rngState = state.rngState;
+   cycles = state.cycles;
+   frames = state.frames;
+   instructions = state.instructions;
+   publishedInstructions = instructions;
+   memoryHash = state.memoryHash;
+   screenHash = state.screenHash;
+   idle = false;
+   drawFlag = true;
+}
+
+// sprite byte to screen row bits, the msb is the leftmost pixel (bit 0)
+static inline uint64_t spriteBits(uint8_t b)
+{
+   b = (b >> 4) | (b << 4);
+   b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+   b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+   return b;
+}
+
+// stateHash() key spaces: memory (address, value) pairs, then lit screen
+// pixels, then (register, value) pairs
+#define SCREEN_KEYS   0x100000ULL
+#define REGISTER_KEYS 0x200000ULL
+
+enum StateKeyRegister
+{
+   KEY_V0,
+   KEY_I = GENERAL_REGS,
+   KEY_PC,
+   KEY_SP,
+   KEY_STACK0,
+   KEY_DT = KEY_STACK0+STACK_SIZE,
+   KEY_ST,
+   KEY_CYCLES,
+   KEY_RNG
+};
+
+static inline uint64_t memoryKey(uint16_t addr, uint8_t value)
+{
+   return hashKey(((uint64_t)addr << 8) | value);
+}
+
+static inline uint64_t pixelKey(int offset)
+{
+   return hashKey(SCREEN_KEYS + offset);
+}
+
+static inline uint64_t registerKey(int reg, uint32_t value)
+{
+   return hashKey(((REGISTER_KEYS + reg) << 32) | value);
+}
+
+inline void Machine::storeByte(uint16_t addr, uint8_t value)
+{
+   addr &= MEMORY_SIZE-1;
+   memoryHash ^= memoryKey(addr, memory[addr]) ^ memoryKey(addr, value);
+   memory[addr] = value;
+   dirtyPages |= 1u << (addr >> MEMORY_PAGE_SHIFT);
+   if(debugger != NULL)
+      debugger->onWrite(addr);
+   if(tracer != NULL)
+      tracer->onWrite(addr, value);
+}
+
+bool Machine::interpret(uint16_t opcode)
+{
+   const OpInfo& op = decodeOpcode(opcode);
+   
+   switch(op.kind)
+   {
+      case OP_CLS: // 00E0    Clears the screen.
+         if(observer != NULL)
+            memset(screenRows, 0, sizeof(screenRows));
+         else
          {
-            printf("skip.eq V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
+            memset(screen, 0, sizeof(screen));
+            screenHash = 0;
+            drawFlag = true;
          }
-      }
-      break;
+         screenDirty = true;
+         pc+=2;
+         break;
 
-      //****************//
-      case 0x6000: // 6XNN    Sets VX to NN.
-      {
-         if(emulate)
-         {
-            v[(opcode>>8)&0x000f] = (opcode&0x00ff);
+      case OP_RTN: // 00EE   Returns from a subroutine.
+         sp--;
+         pc = stack[sp&(STACK_SIZE-1)];
+         pc+=2;
+         break;
+
+      case OP_JMP: // 1NNN    Jumps to address NNN.
+         // a backward jump may close a loop that only polls the timers/keys
+         if(op.nnn <= pc)
+            idle = isIdleLoop(op.nnn, pc);
+         pc = op.nnn;
+         break;
+      
+      case OP_JSR: // 2NNN    Calls subroutine at NNN.
+         stack[(sp++)&(STACK_SIZE-1)] = pc;  // push current onto stack
+         pc = op.nnn; // set pc
+         break;
+
+      case OP_SKIP_EQ_IMM: // 3XNN    Skips the next instruction if VX equals NN.
+         if(v[op.x] == (op.nnn&0x00FF))
             pc+=2;
-         }
-         if(decode)
-         {
-            printf("mov V%i,0x%x\n", (opcode>>8)&0x000f, opcode&0x00ff);
-         }
-      }
-      break;
+         pc+=2;
+         break;
+      
+      case OP_SKIP_NE_IMM: // 4XNN    Skips the next instruction if VX doesn't equal NN.
+         if(v[op.x] != (op.nnn&0x00FF))
+            pc+=2;
+         pc+=2;
+         break;
 
-      //****************//
-      case 0x7000: // 7XNN    Adds NN to VX.
-      {
-         if(emulate)
-         {
-            v[(opcode>>8)&0x000f] += (opcode&0x00ff);
+      case OP_SKIP_EQ: // 5XY0    Skips the next instruction if VX equals VY.
+         if(v[op.x] == v[op.y])
             pc+=2;
-         }
-         if(decode)
-         {
-            printf("add V%i,0x%x\n", (opcode>>8)&0x000f, opcode&0x00ff);
-         }
-      }
-      break;
+         pc+=2;
+         break;
+
+      case OP_MOV_IMM: // 6XNN    Sets VX to NN.
+         v[op.x] = op.nnn&0x00FF;
+         pc+=2;
+         break;
+
+      case OP_ADD_IMM: // 7XNN    Adds NN to VX.
+         v[op.x] += op.nnn&0x00FF;
+         pc+=2;
+         break;
        
-      //****************//
-      case 0x8000:
-      {
-         switch(opcode&0x000F)
+      case OP_MOV: // 8XY0    Sets VX to the value of VY.
+         v[op.x] = v[op.y];
+         pc+=2;
+         break;
+               
+      case OP_OR: // 8XY1    Sets VX to VX or VY.
+         v[op.x] |= v[op.y];
+         pc+=2;
+         break;
+               
+      case OP_AND: // 8XY2    Sets VX to VX and VY.
+         v[op.x] &= v[op.y];
+         pc+=2;
+         break;
+               
+      case OP_XOR: // 8XY3    Sets VX to VX xor VY.
+         v[op.x] ^= v[op.y];
+         pc+=2;
+         break;
+               
+      case OP_ADD_C: // 8XY4    Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+         if( (v[op.x] + v[op.y]) > 0xFF )
+            v[0xF]=1;
+         else
+            v[0xF]=0;
+         v[op.x] += v[op.y];
+         pc+=2;
+         break;
+               
+      case OP_SUB_B: // 8XY5    VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+         if( (v[op.x] - v[op.y]) < 0 )
+            v[0xF]=1;
+         else
+            v[0xF]=0;
+         v[op.x] -= v[op.y];
+         pc+=2;
+         break;
+               
+      case OP_SHR: // 8XY6    Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
+         v[0xF] = v[op.x]&0x1;
+         v[op.x] >>= 1;
+         pc+=2;
+         break;
+               
+      case OP_RSB: // 8XY7    Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+         if(v[op.y] > (0xFF - v[op.x]))
+            v[0xF] = 1; // set carry
+         else
+            v[0xF] = 0;
+         v[op.x] = v[op.y] - v[op.x];
+         pc+=2;
+         break;
+
+      case OP_SHL: // 8XYE    Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.
+         v[0xF] = (v[op.x]>>0xf)&0x1;
+         v[op.x] <<= 1;
+         pc+=2;
+         break;
+
+      case OP_SKIP_NE: // 9XY0    Skips the next instruction if VX doesn't equal VY.
+         if(v[op.x] != v[op.y])
+            pc+=2;
+         pc+=2;
+         break;
+
+      case OP_MOV_I: // ANNN    Sets I to the address NNN.
+         I = op.nnn;
+         pc+=2;
+         break;
+
+      case OP_JMP_V0: // BNNN    Jumps to the address NNN plus V0.
+         pc = op.nnn + v[0];
+         break;
+
+      case OP_RAND: // CXNN  Sets VX to a random number and NN.
+         v[op.x] = (nextRandom()%255)&(op.nnn&0x00FF);
+         pc+=2;
+         break;
+
+      case OP_SPRITE: // DXYN    Sprites stored in memory at location in index register (I), maximum 8bits wide.
+      {               //         Wraps around the screen. If when drawn, clears a pixel, register VF is set to 1
+                      //         otherwise it is zero. All drawing is XOR drawing (i.e. it toggles the screen pixels)
+         uint8_t x = v[op.x];
+         uint8_t y = v[op.y];
+         uint8_t pixel;
+
+         v[0xF] = 0;
+         if(observer != NULL)
          {
-            case 0x0000: // 8XY0    Sets VX to the value of VY.
+            // a sprite row is 8 bits of a screen row, rotated to x so it wraps
+            int shift = x % SCREEN_WIDTH;
+            for(int yline = 0; yline < op.n; yline++)
             {
-               if(emulate)
-               {
-                  v[(opcode>>8)&0x000f] = v[(opcode>>4)&0x000f];
-               }
-               if(decode)
-               {
-                  printf("mov V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
-               }
+               uint64_t bits = spriteBits(memory[(I + yline)&(MEMORY_SIZE-1)]);
+               uint64_t mask = (bits << shift) | (bits >> ((SCREEN_WIDTH - shift) % SCREEN_WIDTH));
+               uint64_t& row = screenRows[(y + yline) % SCREEN_HEIGHT];
+               if(row & mask)
+                  v[0xF] = 1;
+               row ^= mask;
             }
+            screenDirty = true;
+            pc+=2;
             break;
-               
-            case 0x0001: // 8XY1    Sets VX to VX or VY.
+         }
+         for (int yline = 0; yline < op.n; yline++)
+         {
+            pixel = memory[(I + yline)&(MEMORY_SIZE-1)];
+            int row = ((y + yline) % SCREEN_HEIGHT) * SCREEN_WIDTH;
+            for(int xline = 0; xline < 8; xline++)
             {
-               if(emulate)
+               if((pixel & (0x80 >> xline)) != 0)
                {
-                  v[(opcode>>8)&0x000f] |= v[(opcode>>4)&0x000f];
-               }
-               if(decode)
-               {
-                  printf("or V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
-               }
-            }
-            break;
-               
-            case 0x0002: // 8XY2    Sets VX to VX and VY.
-            {
-               if(emulate)
-               {
-                  v[(opcode>>8)&0x000f] &= v[(opcode>>4)&0x000f];
-               }
-               if(decode)
-               {
-                  printf("and V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
-               }
-            }
-            break;
-               
-            case 0x0003: // 8XY3    Sets VX to VX xor VY.
-            {
-               if(emulate)
-               {
-                  v[(opcode>>8)&0x000f] ^= v[(opcode>>4)&0x000f];
-               }
-               if(decode)
-               {
-                  printf("xor V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
-               }
-            }
-            break;
-               
-            case 0x0004: // 8XY4    Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
-            {
-               if(emulate)
-               {
-                  if( (v[(opcode>>8)&0x000f] + v[(opcode>>4)&0x000f]) > 0xFF )
-                     v[0xF]=1;
-                  else
-                     v[0xF]=0;
-                  v[(opcode>>8)&0x000f] += v[(opcode>>4)&0x000f];
-               }
-               if(decode)
-               {
-                  printf("add.c V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
-               }
-            }
-            break;
-               
-            case 0x0005: // 8XY5    VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-            {
-               if(emulate)
-               {
-                  if( (v[(opcode>>8)&0x000f] - v[(opcode>>4)&0x000f]) < 0 )
-                     v[0xF]=1;
-                  else
-                     v[0xF]=0;
-                  v[(opcode>>8)&0x000f] -= v[(opcode>>4)&0x000f];
-               }
-               if(decode)
-               {
-                  printf("sub.b V%i,V%i\n", (opcode>>8)&0x000F, (opcode>>4)&0x000f);
-               }
-            }
-            break;
-               
-            case 0x0006: // 8XY6    Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
-            {
-               if(emulate)
-               {
-                  v[0xF] = v[(opcode>>8)&0x000F]&0x1;
-                  v[(opcode>>8)&0x000F] >>= 1;
-               }
-               if(decode)
-               {
-                  printf("shr V%i\n", (opcode>>8)&0x000F);
-               }
-               
-               
-            }
-            break;
-               
-            case 0x0007: // 8XY7    Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-            {
-               if(emulate)
-               {
-                  if(v[(opcode>>4)&0x000F] > (0xFF - v[(opcode&0x0F00)]))
-                     v[0xF] = 1; // set carry
-                  else
-                     v[0xF] = 0;
-                  v[(opcode>>8)&0x000F] = v[(opcode>>4)&0x000F] - v[(opcode>>8)&0x000F];
-               }
-               if(decode)
-               {
-                  printf("rsb V%i,V%i\n", (opcode>>8)&0x000F, (opcode>>4)&0x000F);
-               }
-               
-            }
-            break;
-
-            case 0x000E: // 8XYE    Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.
-            {
-               if(emulate)
-               {
-                  v[0xF] = (v[(opcode>>8)&0x000F]>>0xf)&0x1;
-                  v[(opcode>>8)&0x000F] <<= 1;
-               }
-               if(decode)
-               {
-                  printf("shl V%i\n", (opcode>>8)&0x000F);
+                  int offset = row + ((x + xline) % SCREEN_WIDTH);
+                  if(screen[offset] == 1)
+                  {
+                     v[0xF] = 1;
+                  }
+                  screen[offset] ^= 1;
+                  screenHash ^= pixelKey(offset);
                }
             }
-            break;
-               
-            default:
-               printf("unknown opcode\n");
-               valid = false;
-               break;
          }
+         drawFlag = true;
+         screenDirty = true;
          pc+=2;
       }
       break;
 
-      //****************
-      case 0x9000: // 9XY0    Skips the next instruction if VX doesn't equal VY.
-      {
-         if(emulate)
-         {
-            if(v[(opcode>>8)&0x000f] != v[(opcode>>4)&0x000f])
-               pc+=2;
+      case OP_SKIP_PRESS: // EX9E    Skips the next instruction if the key stored in VX is pressed.
+         if((keyMask.load(std::memory_order_relaxed) >> (v[op.x]&0xF)) & 1)
             pc+=2;
-         }
-         if(decode)
-         {
-            printf("skip.ne V%i,V%i\n", (opcode>>8)&0x000f, (opcode>>4)&0x000f);
-         }
-      }
-      break;
+         pc+=2;
+         break;
 
-      //****************
-      case 0xA000: // ANNN    Sets I to the address NNN.
-      {
-         if(emulate)
-         {
-            I = opcode&0x0fff;
+      case OP_SKIP_NPRESS: // EXA1    Skips the next instruction if the key stored in VX isn't pressed.
+         if(((keyMask.load(std::memory_order_relaxed) >> (v[op.x]&0xF)) & 1) == 0)
             pc+=2;
-         }
-         if(decode)
-         {
-            printf("mov I,0x%x\n", opcode&0x0fff);
-         }
-      }
-      break;
-
-      //****************
-      case 0xB000: // BNNN    Jumps to the address NNN plus V0.
-      {
-         if(emulate)
-         {
-            pc = (opcode&0x0fff) + v[0];
-         }
-         if(decode)
-         {
-            printf("jmp 0x%x+V0\n", opcode&0x0fff);
-         }
-      }
-      break;
+         pc+=2;
+         break;
 
-      //****************
-      case 0xC000: // CXNN  Sets VX to a random number and NN.
+      case OP_AUDIO: // F002    (xo-chip) Loads the 16 byte audio pattern from memory at I.
+         for(int indx=0; indx<PATTERN_SIZE; indx++)
+            pattern[indx] = memory[(I+indx)&(MEMORY_SIZE-1)];
+         pc+=2;
+         break;
+               
+      case OP_GDELAY: // FX07    Sets VX to the value of the delay timer.
+         v[op.x] = delayTimer;
+         pc+=2;
+         break;
+               
+      case OP_KEY: // FX0A   A key press is awaited, and then stored in VX.
       {
-         if(emulate)
-         {
-            v[(opcode>>8)&0x000f] = (rand()%255)&(opcode&0x00ff);
-            pc+=2;
-         }
-         if(decode)
-         {
-            printf("rand V%i,rnd&0x%x\n", (opcode>>8)&0x000f, opcode&0x00ff);
-         }
-      }
-      break;
-
-      //****************
-      case 0xD000:   // DXYN    Sprites stored in memory at location in index register (I), maximum 8bits wide. 
-      {              //         Wraps around the screen. If when drawn, clears a pixel, register VF is set to 1 
-                     //         otherwise it is zero. All drawing is XOR drawing (i.e. it toggles the screen pixels)
-         uint8_t x = v[(opcode>>8)&0x000F];
-         uint8_t y = v[(opcode>>4)&0x000F];
-         uint8_t n = opcode&0x000F;
-         if(emulate)
+         uint16_t mask = keyMask.load(std::memory_order_relaxed);
+         if(mask != 0)
          {
-            uint8_t pixel;
-
-            v[0xF] = 0;
-            for (int yline = 0; yline < n; yline++)
-            {
-               pixel = memory[I + yline];
-               for(int xline = 0; xline < 8; xline++)
-               {
-                  if((pixel & (0x80 >> xline)) != 0)
-                  {
-                     if(screen[(x + xline + ((y + yline) * 64))] == 1)
-                     {
-                        v[0xF] = 1;
-                     }
-                     screen[x + xline + ((y + yline) * 64)] ^= 1;
-                  }
-               }
-            }
-            drawFlag = true;
+            v[op.x] = __builtin_ctz(mask); // lowest key down
             pc+=2;
          }
-         if(decode)
-         {
-            printf("sprite V%i,V%i,%i\n", (opcode>>8)&0x000F, (opcode>>4)&0x000F, opcode&0x000F);
-         }
-      }
-      break;
-
-      //****************
-      case 0xE000:
-      {
-         switch(opcode&0x00FF)
-         {
-            case 0x009E: // EX9E    Skips the next instruction if the key stored in VX is pressed.
-            {
-               if(emulate)
-               {
-                  if(keys[v[(opcode>>8)&0xF]] > 0)
-                     pc+=2;
-               }
-               if(decode)
-               {
-                  printf("skip.press V%i\n", (opcode>>8)&0xF);
-               }
-            }
-            break;
-
-            case 0x00A1: // EXA1    Skips the next instruction if the key stored in VX isn't pressed.
-            {
-               if(emulate)
-               {
-                  if(keys[v[(opcode>>8)&0xF]] == 0)
-                     pc+=2;
-               }
-               if(decode)
-               {
-                  printf("skip.npress V%i\n", (opcode>>8)&0xF);
-               }
-            }
-            break;
-
-            default:
-               printf("unknown opcode\n");
-               valid = false;
-               break;
-         }
-         pc+=2;
+         else
+            idle = true; // nothing changes before the next input poll, the pc stays
       }
       break;
-
-      //****************
-      case 0xF000:
-      {
-         switch(opcode&0x00FF)
-         {
-            case 0x0007: // FX07    Sets VX to the value of the delay timer.
-            {
-               if(emulate)
-               {
-                  v[(opcode>>8)&0xF] = delayTimer;
-               }
-               if(decode)
-               {
-                  printf("gdelay V%i\n", (opcode>>8)&0xF);
-               }
-            }
-            break;
-               
-            case 0x000A: // FX0A   A key press is awaited, and then stored in VX.
-            {
-               if(emulate)
-               {
-                  int waitKey=0;
-                  for(waitKey=0; waitKey<16; waitKey++)
-                  {
-                     if(keys[waitKey] > 0)
-                     {
-                        v[(opcode>>8)&0xF] = waitKey;
-                        break;
-                     }
-                  }
-                  if(waitKey==16)
-                     pc -= 2; // do not increment the pc reg
-               }
-               if(decode)
-               {
-                  printf("key V%i\n", (opcode>>8)&0xF);
-               }
-            }
-            break;
                
-            case 0x0015: // FX15    Sets the delay timer to VX.
-            {
-               if(emulate)
-               {
-                  delayTimer = (opcode>>8)&0xF;
-               }
-               if(decode)
-               {
-                  printf("sdelay V%i\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_SDELAY: // FX15    Sets the delay timer to VX.
+         delayTimer = v[op.x];
+         pc+=2;
+         break;
                
-            case 0x0018: // FX18    Sets the sound timer to VX.
-            {
-               if(emulate)
-               {
-                  soundTimer = (opcode>>8)&0xF;
-               }
-               if(decode)
-               {
-                  printf("ssound V%i\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_SSOUND: // FX18    Sets the sound timer to VX.
+         soundTimer = v[op.x];
+         pc+=2;
+         break;
                
-            case 0x001E: // FX1E    Adds VX to I.
-            {
-               if(emulate)
-               {
-                  I += v[(opcode>>8)&0x000F];
-               }
-               if(decode)
-               {
-                  printf("add I,V%i\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_ADD_I: // FX1E    Adds VX to I.
+         I += v[op.x];
+         pc+=2;
+         break;
                
-            case 0x0029: // FX29    Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
-            {
-               if(emulate)
-               {
-                  I = v[(opcode>>8)&0xF] * 5;
-               }
-               if(decode)
-               {
-                  printf("font I,V%i\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_FONT: // FX29    Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
+         I = v[op.x] * 5;
+         pc+=2;
+         break;
 
-            case 0x0033: // FX33    Stores the Binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the 
-            {            //         middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation 
-                         //         of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
-               if(emulate)
-               {
-                  memory[I+2] =  v[(opcode>>8)&0xF] % 10; // least significant
-                  memory[I+1] = (v[(opcode>>8)&0xF] / 10) % 10;
-                  memory[I]   =  v[(opcode>>8)&0xF] / 100;
-               }
-               if(decode)
-               {
-                  printf("bcd I,V%i\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_BCD: // FX33    Stores the Binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the
+                   //         middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation
+                   //         of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
+         storeByte(I+2,  v[op.x] % 10); // least significant
+         storeByte(I+1, (v[op.x] / 10) % 10);
+         storeByte(I,    v[op.x] / 100);
+         pc+=2;
+         break;
                
-            case 0x0055: // FX55 - stores V0 to VX in memory starting at address I
-            {
-               if(emulate)
-               {
-                  for(int indx=0; indx<=((opcode>>8)&0x000F); indx++)
-                     memory[I+indx] = v[indx];
-               }
-               if(decode)
-               {
-                  printf("store [I],V0-V%i\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_PITCH: // FX3A    (xo-chip) Sets the audio pattern playback pitch to VX.
+         pitch = v[op.x];
+         pc+=2;
+         break;
                
-            case 0x0065: // FX65  Fills V0 to VX with values from memory starting at address I
-            {
-               if(emulate)
-               {
-                  for(int indx=0; indx<=((opcode>>8)&0x000F); indx++)
-                     v[indx] = memory[I+indx];
-               }
-               if(decode)
-               {
-                  printf("load V0-V%i,[I]\n", (opcode>>8)&0x000F);
-               }
-            }
-            break;
+      case OP_STORE: // FX55 - stores V0 to VX in memory starting at address I
+         for(int indx=0; indx<=op.x; indx++)
+            storeByte(I+indx, v[indx]);
+         pc+=2;
+         break;
+               
+      case OP_LOAD: // FX65  Fills V0 to VX with values from memory starting at address I
+         for(int indx=0; indx<=op.x; indx++)
+            v[indx] = memory[(I+indx)&(MEMORY_SIZE-1)];
+         pc+=2;
+         break;
 
-            default:
-               printf("unknown opcode\n");
-               valid = false;
-               break;
-         }
+      default:
+         // keep stdout clean for capture streams
+         fprintf(stderr, "unknown opcode 0x%04x at 0x%03x\n", opcode, pc);
          pc+=2;
+         return false;
+   }
+   return true;
+}
+
+void Machine::setSeed(uint32_t seed)
+{
+   // xorshift must not start from 0
+   rngState = (seed != 0) ? seed : 0x2545F491;
+}
+
+uint32_t Machine::nextRandom()
+{
+   rngState ^= rngState << 13;
+   rngState ^= rngState >> 17;
+   rngState ^= rngState << 5;
+   return rngState;
+}
+
+void Machine::rehash()
+{
+   memoryHash = hashMemory();
+   screenHash = hashPixels();
+}
+
+uint64_t Machine::hashMemory() const
+{
+   uint64_t h = 0;
+   for(int addr=0; addr<MEMORY_SIZE; addr++)
+      h ^= memoryKey(addr, memory[addr]);
+   return h;
+}
+
+uint64_t Machine::hashPixels() const
+{
+   uint64_t h = 0;
+   if(observer != NULL)
+   {
+      for(int y=0; y<SCREEN_HEIGHT; y++)
+      {
+         for(uint64_t bits=screenRows[y]; bits!=0; bits&=bits-1)
+            h ^= pixelKey(y*SCREEN_WIDTH + __builtin_ctzll(bits));
       }
-      break;
+      return h;
+   }
+   for(int i=0; i<SCREEN_WIDTH*SCREEN_HEIGHT; i++)
+   {
+      if(screen[i])
+         h ^= pixelKey(i);
+   }
+   return h;
+}
 
-      default:
-         printf("unknown opcode\n");
-         if(emulate)
-         {
-            pc+=2;
-         }
-         valid = false;
-         break;
-         
-   } // switch
-      
-   return valid;
+uint64_t Machine::stateHash() const
+{
+   uint64_t h = memoryHash ^ liveScreenHash();
+   for(int i=0; i<GENERAL_REGS; i++)
+      h ^= registerKey(KEY_V0+i, v[i]);
+   for(int i=0; i<STACK_SIZE; i++)
+      h ^= registerKey(KEY_STACK0+i, stack[i]);
+   h ^= registerKey(KEY_I, I);
+   h ^= registerKey(KEY_PC, pc);
+   h ^= registerKey(KEY_SP, sp);
+   h ^= registerKey(KEY_DT, delayTimer);
+   h ^= registerKey(KEY_ST, soundTimer);
+   h ^= registerKey(KEY_CYCLES, cycles);
+   return h ^ registerKey(KEY_RNG, rngState);
+}
+
+uint64_t Machine::computeStateHash() const
+{
+   // swap the incremental parts for freshly computed ones
+   return stateHash() ^ memoryHash ^ liveScreenHash() ^ hashMemory() ^ hashPixels();
+}
+
+// observing keeps no incremental screen hash, it is recounted from the rows
+uint64_t Machine::liveScreenHash() const
+{
+   return (observer != NULL) ? hashPixels() : screenHash;
+}
+
+void Machine::packScreen(const uint8_t* pixels)
+{
+   for(int y=0; y<SCREEN_HEIGHT; y++)
+   {
+      uint64_t bits = 0;
+      for(int x=0; x<SCREEN_WIDTH; x++)
+         bits |= (uint64_t)(pixels[y*SCREEN_WIDTH+x]&1) << x;
+      screenRows[y] = bits;
+   }
+}
+
+void Machine::unpackScreen(uint8_t* pixels) const
+{
+   for(int y=0; y<SCREEN_HEIGHT; y++)
+   {
+      for(int x=0; x<SCREEN_WIDTH; x++)
+         pixels[y*SCREEN_WIDTH+x] = (screenRows[y] >> x) & 1;
+   }
+}
+
+void Machine::setMetrics(MachineMetrics* metrics)
+{
+   this->metrics = metrics;
+   frameStart = metricsNow();
+   hostTime = 0;
+   publishedInstructions = instructions;
+}
+
+void Machine::setObserver(RamObserver* observer)
+{
+   if((observer != NULL) && (this->observer == NULL))
+      packScreen(screen);
+   else if((observer == NULL) && (this->observer != NULL))
+   {
+      unpackScreen(screen);
+      this->observer = NULL;
+      screenHash = hashPixels();
+      drawFlag = true;
+   }
+   this->observer = observer;
+}
+
+uint64_t Machine::hashRegisters() const
+{
+   uint64_t h = hashBytes(v, sizeof(v));
+   h = hashBytes(&I, sizeof(I), h);
+   h = hashBytes(&pc, sizeof(pc), h);
+   h = hashBytes(&sp, sizeof(sp), h);
+   h = hashBytes(stack, sizeof(stack), h);
+   h = hashBytes(&delayTimer, sizeof(delayTimer), h);
+   return hashBytes(&soundTimer, sizeof(soundTimer), h);
+}
+
+uint64_t Machine::hashScreen() const
+{
+   if(observer != NULL)
+   {
+      uint8_t pixels[SCREEN_WIDTH*SCREEN_HEIGHT];
+      unpackScreen(pixels);
+      return hashBytes(pixels, sizeof(pixels));
+   }
+   return hashBytes(screen, sizeof(screen));
 }
 
-void Machine::updateTimers()
+bool Machine::isIdleLoop(uint16_t target, uint16_t jump)
 {
-   static int c = 0;
+   // only loops of a few instructions are recognised
+   if((jump - target) > 4)
+      return false;
+   // an odd distance jumps into the middle of an instruction
+   if((jump - target) & 1)
+      return false;
+
+   const OpInfo& first = decodeOpcode((memory[target]<<8) | memory[target+1]);
+
+   // 1NNN onto itself, the program has halted
+   if(jump == target)
+      return true;
+
+   // EX9E/EXA1 ; 1NNN - keys only change at the next input poll
+   if((jump - target) == 2)
+      return (first.kind == OP_SKIP_PRESS) || (first.kind == OP_SKIP_NPRESS);
+
+   // FX07 ; 3XNN/4XNN ; 1NNN - the delay timer only changes at the next tick
+   const OpInfo& second = decodeOpcode((memory[target+2]<<8) | memory[target+3]);
+   if(first.kind != OP_GDELAY)
+      return false;
+   if((second.kind != OP_SKIP_EQ_IMM) && (second.kind != OP_SKIP_NE_IMM))
+      return false;
+   return first.x == second.x;
+}
 
-   // the timers are only updated every 25 instructions. This seems to look ok
-   if(++c == 25)
+bool Machine::updateTimers(int frameCycles)
+{
+   // the timers tick once a frame, every 25 instructions in the fast
+   // model. This seems to look ok
+   if(cycles >= frameCycles)
    {
       // *** update delay timer ***
       if(delayTimer > 0)
@@ -757,36 +962,89 @@ void Machine::updateTimers()
       if(soundTimer > 0)
          --soundTimer;
 
-      c = 0;
+      // an instruction running over the tick is charged to the next frame
+      cycles -= frameCycles;
+      return true;
    }
+   return false;
+}
+
+void Machine::endFrame()
+{
+   ++frames;
+   
+   // the counters are published once a frame as increments, so they keep
+   // counting across loaded states. Execution is the frame's wall time
+   // less what the host loop spent around it
+   if(metrics != NULL)
+   {
+      uint64_t now = metricsNow();
+      uint64_t elapsed = now - frameStart;
+      MachineMetrics::add(metrics->executeTime, (elapsed > hostTime) ? elapsed - hostTime : 0);
+      MachineMetrics::add(metrics->instructions, instructions - publishedInstructions);
+      MachineMetrics::add(metrics->frames, 1);
+      publishedInstructions = instructions;
+      if(capture != NULL)
+         MachineMetrics::set(metrics->droppedFrames, capture->framesDropped());
+      frameStart = now;
+      hostTime = 0;
+   }
+   
+   if(observer != NULL)
+      observer->record(memory);
+   else if(capture != NULL)
+      capture->submit(screen);
+   
+   if(audio != NULL)
+      audio->frame(soundTimer > 0, pattern, pitch);
+   
+   if((frameLimit != 0) && (frames >= frameLimit))
+      kill = true;
 }
 
 void Machine::initGraphics()
 {
+   hostState();
+   
 #ifdef BUILD_X11
    // setup display borrowed from
    // http://rosettacode.org/wiki/Window_creation/X11
-   d = XOpenDisplay(NULL);
-   if (d == NULL)
+   host->d = XOpenDisplay(NULL);
+   if (host->d == NULL)
    {
       fprintf(stderr, "Cannot open display\n");
       exit(1);
    }
+   
+   if(!host->renderer.init())
+   {
+      fprintf(stderr, "Cannot allocate the frame buffer\n");
+      exit(1);
+   }
 
-   s = DefaultScreen(d);
-   window = XCreateSimpleWindow(d,                 // display
-                                RootWindow(d, s),  // parent
-                                0,                 // x
-                                0,                 // y
-                                SCREEN_WIDTH*10,   // width
-                                SCREEN_HEIGHT*10,  // height
-                                1,                 // border width
-                                BlackPixel(d, s),  // border
-                                WhitePixel(d, s)); // background
-
-   XSelectInput(d, window, ExposureMask | KeyPressMask);
-   XMapWindow(d, window);
-   XFlush(d);
+   host->s = DefaultScreen(host->d);
+   host->window = XCreateSimpleWindow(host->d,                     // display
+                                      RootWindow(host->d, host->s), // parent
+                                      0,                            // x
+                                      0,                            // y
+                                      host->renderer.getWidth(),    // width
+                                      host->renderer.getHeight(),   // height
+                                      1,                            // border width
+                                      BlackPixel(host->d, host->s), // border
+                                      WhitePixel(host->d, host->s));// background
+
+   XSelectInput(host->d, host->window, ExposureMask | KeyPressMask | KeyReleaseMask);
+   XMapWindow(host->d, host->window);
+   XFlush(host->d);
+   
+   // no synthetic release/press pairs while a key is held
+   XkbSetDetectableAutoRepeat(host->d, True, NULL);
+   
+   // the image wraps the renderer's buffer, presenting is one XPutImage
+   host->image = XCreateImage(host->d, DefaultVisual(host->d, host->s), DefaultDepth(host->d, host->s),
+                              ZPixmap, 0, (char*)host->renderer.getPixels(),
+                              host->renderer.getWidth(), host->renderer.getHeight(),
+                              32, host->renderer.getPitch()*4);
 #endif
 
 #ifdef BUILD_SDL
@@ -794,123 +1052,132 @@ void Machine::initGraphics()
    //Start SDL
    SDL_Init( SDL_INIT_EVERYTHING );
 
+   if(!host->renderer.init())
+   {
+      fprintf(stderr, "Cannot allocate the frame buffer\n");
+      exit(1);
+   }
+   
    //Set up screen
-   backbuff = NULL;
-   screenSurface = NULL;
-   screenSurface = SDL_SetVideoMode( SCREEN_WIDTH*10, SCREEN_HEIGHT*10, 32, SDL_SWSURFACE );
+   host->backbuff = NULL;
+   host->screenSurface = NULL;
+   host->screenSurface = SDL_SetVideoMode( host->renderer.getWidth(), host->renderer.getHeight(), 32, SDL_SWSURFACE );
+   
+   // the back buffer wraps the renderer's pixels, presenting is one blit
+   host->backbuff = SDL_CreateRGBSurfaceFrom((void*)host->renderer.getPixels(),
+                                             host->renderer.getWidth(), host->renderer.getHeight(),
+                                             32, host->renderer.getPitch()*4, 0xFF0000, 0x00FF00, 0x0000FF, 0);
 #endif
+
+   bindKeys();
 }
 
-void Machine::drawGraphics()
+void Machine::bindKeys()
 {
+   for(int i=0; i<HOST_KEYS; i++)
+      host->hostKeys[i] = -1;
+
 #ifdef BUILD_X11
-   for(int x=0; x<SCREEN_WIDTH; x++)
+   for(int i=0; i<host->keymap.size(); i++)
    {
-      for(int y=0; y<SCREEN_HEIGHT; y++)
+      // keysym names are case sensitive ("Escape"), try as given and capitalised
+      char name[KEYMAP_NAME];
+      strcpy(name, host->keymap.name(i));
+      KeySym sym = XStringToKeysym(name);
+      if(sym == NoSymbol)
       {
-         if(screen[(y*SCREEN_WIDTH)+x] == 1)
-            XFillRectangle(d,               // display
-                           window,          // window
-                           DefaultGC(d, s), // GC ???
-                           x*10,            // x
-                           y*10,            // y
-                           10,              // width
-                           10);             // height
-         else
-            XClearArea(d,      // display
-                       window, // window
-                       x*10,   // x
-                       y*10,   // y
-                       10,     // width
-                       10,     // height
-                       false); //
+         name[0] = toupper(name[0]);
+         sym = XStringToKeysym(name);
+      }
+      KeyCode code = (sym != NoSymbol) ? XKeysymToKeycode(host->d, sym) : 0;
+      if(code == 0)
+      {
+         fprintf(stderr, "unknown key %s\n", host->keymap.name(i));
+         continue;
       }
+      host->hostKeys[code] = host->keymap.key(i);
    }
-   XFlush(d);
 #endif
 
 #ifdef BUILD_SDL
-      for(int x=0; x<SCREEN_WIDTH; x++)
-      {
-         for(int y=0; y<SCREEN_HEIGHT; y++)
-         {
-            SDL_Rect rect;
-            rect.x = x*10;
-            rect.y = y*10;
-            rect.w = 10;
-            rect.h = 10;
-            if(screen[(y*SCREEN_WIDTH)+x] == 1)
-               SDL_FillRect(screenSurface, &rect, SDL_MapRGB(screenSurface->format, 255, 255, 255));
-            else
-               SDL_FillRect(screenSurface, &rect, SDL_MapRGB(screenSurface->format, 0, 0, 0));
-         }
-      }
-      SDL_Flip(screenSurface);
+   for(int sym=0; (sym<SDLK_LAST) && (sym<HOST_KEYS); sym++)
+      host->hostKeys[sym] = host->keymap.find(SDL_GetKeyName((SDLKey)sym));
+#endif
+}
+
+void Machine::drawGraphics()
+{
+   host->fading = host->renderer.render(screen);
+
+#ifdef BUILD_X11
+   XPutImage(host->d, host->window, DefaultGC(host->d, host->s), host->image, 0, 0, 0, 0, host->renderer.getWidth(), host->renderer.getHeight());
+   XFlush(host->d);
+#endif
+
+#ifdef BUILD_SDL
+   SDL_BlitSurface(host->backbuff, NULL, host->screenSurface, NULL);
+   SDL_Flip(host->screenSurface);
 #endif
 }
 
 void Machine::cleanupGraphics()
 {
 #ifdef BUILD_X11
-   // cleanup X11
-   XCloseDisplay(d);
+   // cleanup X11, the pixels belong to the renderer
+   host->image->data = NULL;
+   XDestroyImage(host->image);
+   XCloseDisplay(host->d);
 #endif
 
 #ifdef BUILD_SDL
    //Quit SDL
+   SDL_FreeSurface(host->backbuff);
    SDL_Quit();
 #endif
 }
 
-void Machine::pollInputs()
+void Machine::waitEvents(int usec)
 {
 #ifdef BUILD_X11
-   for(int i=0; i<16; i++)
+   // block on the X connection rather than spin
+   if(XPending(host->d))
+      return;
+   fd_set fds;
+   FD_ZERO(&fds);
+   FD_SET(ConnectionNumber(host->d), &fds);
+   struct timeval tv;
+   tv.tv_sec = usec/1000000;
+   tv.tv_usec = usec%1000000;
+   select(ConnectionNumber(host->d)+1, &fds, NULL, NULL, &tv);
+#endif
+
+#ifdef BUILD_SDL
+   // SDL 1.2 has no timed wait, doze in 1ms slices until something is queued
+   for(int waited=0; waited<usec; waited+=1000)
    {
-      if(keys[i] > 0)
-         keys[i]-=1;
+      SDL_PumpEvents();
+      if(SDL_PeepEvents(NULL, 0, SDL_PEEKEVENT, SDL_ALLEVENTS) > 0)
+         return;
+      SDL_Delay(1);
    }
-   while(XEventsQueued(d,QueuedAlready))
-   //while(XPending(d))
+#endif
+
+#ifdef BUILD_HEADLESS
+   // no window to wake us up early
+   usleep(usec);
+#endif
+}
+
+void Machine::pollInputs()
+{
+#ifdef BUILD_X11
+   while(XPending(host->d))
    {
-      uint8_t keystate = 0;
-      XNextEvent(d, &e);
-      if(e.type == KeyPress)
-         keystate = 100;
-      else if (e.type == KeyRelease)
-         keystate = 0;
-
-     //printf("KeyPress: keycode %u state %u\n", e.xkey.keycode, e.xkey.state);
-     switch(e.xkey.keycode)
-     {
-        case 10: //"1"
-        case 11: //"2"
-        case 12: //"3"
-        case 13: //"4"
-           keys[e.xkey.keycode-10] = keystate;
-           break;
-        case 24: //"q"
-        case 25: //"w"
-        case 26: //"e"
-        case 27: //"r"
-           keys[e.xkey.keycode-20] = keystate;
-           break;
-        case 38: //"a"
-        case 39: //"s"
-        case 40: //"d"
-        case 41: //"f"
-           keys[e.xkey.keycode-30] = keystate;
-           break;
-        case 52: //"z"
-        case 53: //"x"
-        case 54: //"c"
-        case 55: //"v"
-           keys[e.xkey.keycode-40] = keystate;
-           break;
-        case 9: //"esc"
-           kill=true;
-           break;
-     }
+      XNextEvent(host->d, &host->e);
+      if((host->e.type == KeyPress) || (host->e.type == KeyRelease))
+         keyEvent(host->hostKeys[host->e.xkey.keycode], host->e.type == KeyPress);
+      else if(host->e.type == Expose)
+         drawFlag = true;
    } // while(pending)
 #endif
 
@@ -927,70 +1194,32 @@ void Machine::pollInputs()
       //User presses a key
       else if( (e.type == SDL_KEYDOWN) || (e.type == SDL_KEYUP) )
       {
-         uint8_t action = 0; // key up
-         if(e.type == SDL_KEYDOWN)
-         {
-            action = 1;
-         }
-
-         //Select surfaces based on key press
-         switch( e.key.keysym.sym )
-         {
-         case SDLK_1:
-            keys[0] = action;
-            break;
-         case SDLK_2:
-            keys[1] = action;;
-            break;
-         case SDLK_3:
-            keys[2] = action;
-            break;
-         case SDLK_4:
-            keys[3] = action;
-            break;
-         case SDLK_q:
-            keys[4] = action;
-            break;
-         case SDLK_w:
-            keys[5] = action;
-            break;
-         case SDLK_e:
-            keys[6] = action;
-            break;
-         case SDLK_r:
-            keys[7] = action;
-            break;
-         case SDLK_a:
-            keys[8] = action;
-            break;
-         case SDLK_s:
-            keys[9] = action;
-            break;
-         case SDLK_d:
-            keys[10] = action;
-            break;
-         case SDLK_f:
-            keys[11] = action;
-            break;
-         case SDLK_z:
-            keys[12] = action;
-            break;
-         case SDLK_x:
-            keys[13] = action;
-            break;
-         case SDLK_c:
-            keys[14] = action;
-            break;
-         case SDLK_v:
-            keys[15] = action;
-            break;
-         case SDLK_ESCAPE:
-            kill = true;
-            break;
-         default:
-            break;
-         }
+         if(e.key.keysym.sym < HOST_KEYS)
+            keyEvent(host->hostKeys[e.key.keysym.sym], e.type == SDL_KEYDOWN);
       }
    }
 #endif
 }
+
+void Machine::keyEvent(int key, bool down)
+{
+   if(key < 0)
+      return; // unbound
+
+   if(key == KEYMAP_QUIT)
+   {
+      kill = true;
+      return;
+   }
+
+   if(down)
+      keyMask.fetch_or(1<<key, std::memory_order_relaxed);
+   else
+      keyMask.fetch_and(~(1<<key), std::memory_order_relaxed);
+
+   if(!host->inputPending)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &host->inputStamp);
+      host->inputPending = true;
+   }
+}
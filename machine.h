@@ -3,8 +3,19 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include "keymap.h"
+#include "hash.h"
+#include "render.h"
+#include "opcodes.h"
+#include "timing.h"
+#ifdef BUILD_X11
 #include <X11/Xlib.h>
+#endif
+#ifdef BUILD_SDL
 #include "SDL/SDL.h"
+#endif
 
 /** 
  * Hardware specs were taken from :
@@ -28,8 +39,100 @@
 // starting address of program, emulator occupies memory from 0x0-0x1FF
 #define START_ADDRESS 0x200
 
+// copy on write granularity for revertState(), 16 pages of 256 bytes
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGES      (MEMORY_SIZE>>MEMORY_PAGE_SHIFT)
+
+// host key codes the backends can bind (X11 keycodes, SDL keysyms)
+#define HOST_KEYS 512
+
+// xo-chip audio pattern buffer
+#define PATTERN_SIZE 16
+
+class FrameCapture;
+class AudioOutput;
+class Debugger;
+class TraceRecorder;
+class History;
+class RamObserver;
+struct MachineMetrics;
+
+/**
+ * The window side of a Machine: renderer, key bindings, input latency and
+ * the backend handles, about 10KB. Allocated apart from the Machine the
+ * first time a window, bindings or render options are asked for, so
+ * headless instances neither carry nor touch it.
+ */
+struct MachineHost
+{
+   MachineHost();
+   
+   // expands the screen into the window pixels, fading is set while
+   // blended frames or phosphor ghosts still need frames presented
+   Renderer renderer;
+   bool fading;
+   
+   // host key bindings and their backend key code lookup (-1 unbound)
+   KeyMap keymap;
+   int16_t hostKeys[HOST_KEYS];
+   
+   // input to display latency, from the poll that saw a key change to
+   // the next present
+   bool inputPending;
+   struct timespec inputStamp;
+   double latencySum;
+   double latencyMax;
+   uint32_t latencyCount;
+
+#ifdef BUILD_X11
+   // X11 window stuff
+   Display *d;
+   Window window;
+   XEvent e;
+   int s;
+   XImage* image;
+#endif
+
+#ifdef BUILD_SDL
+   SDL_Surface* screenSurface;
+   SDL_Surface* backbuff;
+#endif
+};
+
+/**
+ * Everything that decides how a machine continues, enough to rewind it.
+ * Host side state (window, outputs, debugger) is not included.
+ */
+struct MachineState
+{
+   uint8_t memory[MEMORY_SIZE];
+   uint8_t v[GENERAL_REGS];
+   uint16_t I;
+   uint16_t stack[STACK_SIZE];
+   uint8_t screen[SCREEN_WIDTH*SCREEN_HEIGHT];
+   uint16_t pc;
+   uint8_t sp;
+   uint8_t delayTimer;
+   uint8_t soundTimer;
+   uint8_t pattern[PATTERN_SIZE];
+   uint8_t pitch;
+   uint16_t keys;
+   uint32_t rngState;
+   int cycles;
+   uint32_t frames;
+   uint64_t instructions;
+   uint64_t memoryHash;
+   uint64_t screenHash;
+};
+
 class Machine
 {
+   friend class Debugger;
+   friend class GdbStub;
+   friend class TraceRecorder;
+   friend class History;
+   friend class InputScript;
+   
 public:
    Machine();
    ~Machine();
@@ -47,42 +150,200 @@ public:
                 int     length);
    
    /**
-    * decodes an instruction. depending on flags will either decode to readable
-    * string or emulate the instruction.
+    * Copies a program into memory and points the pc at it, without
+    * running it. Use with step()/runFrame() to drive the machine.
+    * 
+    * @param[in] program: The pointer to the program code
+    * @param[in] length:  The length of the program in bytes
+    */
+   void load(uint8_t *program,
+             int     length);
+   
+   /**
+    * Executes one instruction (or fast forwards an idle loop).
+    *
+    * @return true when the instruction ended a frame
+    */
+   bool step();
+   
+   /**
+    * Executes instructions up to the end of the current frame.
+    *
+    * @return false when the program stopped before the frame ended
+    */
+   bool runFrame();
+   
+   // program has not halted or been killed
+   bool running() const;
+   
+   /**
+    * Executes one already fetched instruction, the operands come from the
+    * compile time opcode table.
     *
     * @param[in] opcode:  The instruction
-    * @param[in] emulate: Flag so instruction is emulated
-    * @param[in] decode:  Flag so instruction is decoded
+    * @return false for an unknown opcode, which is skipped
+    */
+   bool interpret(uint16_t opcode);
+   
+   /**
+    * How instructions are charged against the frame, TIMING_FAST (the
+    * default) or TIMING_VIP for programs that need authentic speed.
+    */
+   void setTiming(TimingModel timing) { this->timing = timing; }
+   TimingModel getTiming() const { return timing; }
+   
+   /**
+    * Runs without a window, inputs or the per instruction sleep.
+    */
+   void setHeadless(bool headless) { this->headless = headless; }
+   
+   /**
+    * Stops execution after a number of frames, 0 runs forever.
+    */
+   void setFrameLimit(uint32_t frames) { frameLimit = frames; }
+   
+   /**
+    * Hands every frame to a capture stream, NULL disables capture.
+    */
+   void setCapture(FrameCapture* capture) { this->capture = capture; }
+   
+   /**
+    * Feeds the sound timer to an audio output, NULL disables sound.
+    */
+   void setAudio(AudioOutput* audio) { this->audio = audio; }
+   
+   /**
+    * Attaches a debugger that is consulted before every instruction, NULL
+    * detaches it.
+    */
+   void setDebugger(Debugger* debugger) { this->debugger = debugger; }
+   
+   /**
+    * Logs every executed instruction to a trace recorder, NULL disables
+    * tracing.
+    */
+   void setTracer(TraceRecorder* tracer) { this->tracer = tracer; }
+   
+   /**
+    * Keeps keyframes and inputs for reverse execution, NULL disables it.
+    */
+   void setHistory(History* history) { this->history = history; }
+   
+   /**
+    * Observation mode for headless runs that only need memory: the screen
+    * is kept as bit rows for the DXYN collision flag alone, nothing is
+    * drawn, captured or hashed per pixel, and the observer gets the
+    * watched bytes after every frame. NULL goes back to the full screen.
+    */
+   void setObserver(RamObserver* observer);
+   
+   /**
+    * Publishes this machine's counters for a metrics exporter, NULL
+    * disables them.
+    */
+   void setMetrics(MachineMetrics* metrics);
+   
+   /**
+    * Copies the machine state out / back in. Restoring redraws the screen.
     */
-   bool decode(uint16_t opcode,
-               bool emulate,
-               bool decode);
+   void saveState(MachineState* state) const;
+   void loadState(const MachineState& state);
+   
+   /**
+    * Back to a state loaded earlier with loadState(), copying only the
+    * memory pages written since (and the screen if it changed), so many
+    * runs from one shared base state cost a few hundred bytes each
+    * instead of a full snapshot.
+    */
+   void revertState(const MachineState& base);
+   
+   /**
+    * loadState() for a recycled machine, also clears a kill so it runs
+    * again.
+    */
+   void reset(const MachineState& state);
+   
+   /**
+    * Window scale and filters, takes effect when the window opens.
+    */
+   void setRenderOptions(const RenderOptions& options) { hostState().renderer.setOptions(options); }
+   
+   /**
+    * Replaces the host key bindings, takes effect when the window opens.
+    */
+   void setKeyMap(const KeyMap& map) { hostState().keymap = map; }
+   
+   /**
+    * Keypad state, bit n set means key n is down. Safe to call from any
+    * thread, e.g. to drive a headless machine.
+    */
+   void setKeys(uint16_t mask) { keyMask.store(mask, std::memory_order_relaxed); }
+   uint16_t getKeys() const { return keyMask.load(std::memory_order_relaxed); }
+   
+   /**
+    * Seeds the CXNN random number generator, runs with the same seed and
+    * inputs are identical.
+    */
+   void setSeed(uint32_t seed);
+   
+   /**
+    * Zobrist hash of everything that decides how the program continues:
+    * memory, screen, registers, stack, timers, the position in the frame
+    * and the rng state (not the keys, they are input, nor the xo-chip
+    * sound). Memory and screen keys are kept up to date as they are
+    * written, the ~40 register keys are folded in here, so a call costs
+    * the same whatever the memory size. Equal states give equal hashes
+    * across runs and builds.
+    */
+   uint64_t stateHash() const;
+   
+   /**
+    * stateHash() recomputed from scratch, to check the incremental one.
+    */
+   uint64_t computeStateHash() const;
+   
+   // state summaries used to compare runs
+   uint64_t hashRegisters() const;
+   uint64_t hashScreen() const;
+   uint16_t getPC() const { return pc; }
+   uint8_t getByte(uint16_t addr) const { return memory[addr&(MEMORY_SIZE-1)]; }
+   uint32_t getFrame() const { return frames; }
+   uint64_t getInstructions() const { return instructions; }
    
 private:
-   void updateTimers();
+   template<class Timing> bool stepTimed();
+   template<class Timing> bool runFrameTimed();
+   double cycleMicros() const { return (timing == TIMING_VIP) ? VipTiming::cycleMicros : FastTiming::cycleMicros; }
+   bool updateTimers(int frameCycles);
+   void endFrame();
    void initGraphics();
    void drawGraphics();
    void cleanupGraphics();
    void pollInputs();
+   void waitEvents(int usec);
+   bool isIdleLoop(uint16_t target, uint16_t jump);
+   uint32_t nextRandom();
+   void storeByte(uint16_t addr, uint8_t value);
+   void keyEvent(int key, bool down);
+   void bindKeys();
    
-   // memory
-   uint8_t memory[MEMORY_SIZE];
+   // recomputes the incremental hashes after memory or the screen were
+   // replaced wholesale
+   void rehash();
+   void loadRegisters(const MachineState& state);
+   uint64_t hashMemory() const;
+   uint64_t hashPixels() const;
+   uint64_t liveScreenHash() const;
    
-   // registers (16 general) (1 address aka index)
-   uint8_t v[GENERAL_REGS];
-   uint16_t I;
-   
-   // fixed stack size, allows call depth of 16
-   uint16_t stack[STACK_SIZE];
-   
-   // screen buffer
-   uint8_t screen[SCREEN_WIDTH*SCREEN_HEIGHT];
+   // observation mode screen, bit n of a row is pixel n
+   void packScreen(const uint8_t* pixels);
+   void unpackScreen(uint8_t* pixels) const;
    
-   // flag that indicates we need to draw the screen
-   bool drawFlag;
+   // *** hot: one cache line that every step reads and writes ***
    
-   // keys
-   uint8_t keys[16];
+   // registers (16 general) (1 address aka index)
+   alignas(64) uint8_t v[GENERAL_REGS];
+   uint16_t I;
    
    // program counter
    uint16_t pc;
@@ -90,25 +351,104 @@ private:
    // stack pointer
    uint8_t sp;
    
-   // flag used to kill the execute loop
-   bool kill;
-   
    // timer counters
    uint8_t delayTimer;
    uint8_t soundTimer;
-
-#ifdef BUILD_X11
-   // X11 window stuff
-   Display *d;
-   Window window;
-   XEvent e;
-   int s;
-#endif
-
-#ifdef BUILD_SDL
-   SDL_Surface* screenSurface;
-   SDL_Surface* backbuff;
-#endif
+   
+   // flag used to kill the execute loop
+   bool kill;
+   
+   // set by interpret() when the program can make no progress before the next
+   // timer tick or input poll (FX0A waiting, timer/key polling loops)
+   bool idle;
+   
+   // flag that indicates we need to draw the screen
+   bool drawFlag;
+   
+   // pages written and screen changed since the last load, for revertState()
+   bool screenDirty;
+   uint32_t dirtyPages;
+   
+   // cycles since the last timer tick, instructions in the fast timing
+   // model, and the cost of the last step, both in the model's cycles
+   int cycles;
+   int stepCycles;
+   
+   // xorshift state for CXNN
+   uint32_t rngState;
+   
+   // instructions executed, not counting fast forwarded idle loops
+   uint64_t instructions;
+   
+   // the key of every (address, value) of memory
+   uint64_t memoryHash;
+   
+   // *** warm: the stack and what every step checks ***
+   
+   // fixed stack size, allows call depth of 16
+   alignas(64) uint16_t stack[STACK_SIZE];
+   
+   TimingModel timing;
+   int idleSkipped;
+   
+   // optional reverse execution history
+   History* history;
+   
+   // optional execution trace
+   TraceRecorder* tracer;
+   
+   // optional debugger
+   Debugger* debugger;
+   
+   // *** once per frame ***
+   
+   // keys, one bit per key, written by the input poll once per frame
+   alignas(64) std::atomic<uint16_t> keyMask;
+   
+   // frames since execution started, and where to stop (0 never)
+   uint32_t frames;
+   uint32_t frameLimit;
+   
+   // the key of every lit pixel of the screen
+   uint64_t screenHash;
+   
+   // optional memory observer, set in observation mode
+   RamObserver* observer;
+   
+   // optional frame capture stream
+   FrameCapture* capture;
+   
+   // optional sound output
+   AudioOutput* audio;
+   
+   // optional runtime counters, the current frame's start and the time
+   // spent in it on the host (sleeping, presenting, polling) in ns, and
+   // the instruction count last published (loading a state moves it)
+   MachineMetrics* metrics;
+   uint64_t frameStart;
+   uint64_t hostTime;
+   uint64_t publishedInstructions;
+   
+   // *** memory and screen ***
+   
+   alignas(64) uint8_t memory[MEMORY_SIZE];
+   uint8_t screen[SCREEN_WIDTH*SCREEN_HEIGHT];
+   
+   // the screen while observing, screen and screenHash are stale then
+   uint64_t screenRows[SCREEN_HEIGHT];
+   
+   // *** cold ***
+   
+   // xo-chip sound, 128 1-bit samples played at 4000*2^((pitch-64)/48) Hz
+   uint8_t pattern[PATTERN_SIZE];
+   uint8_t pitch;
+   
+   // no window, no inputs, no throttling
+   bool headless;
+   
+   // window side, created on first use
+   MachineHost* host;
+   MachineHost& hostState();
 };
 
 #endif //MACHINE_H
@@ -0,0 +1,126 @@
+#include "machinepool.h"
+#include <stdio.h>
+#include <stdlib.h> //exit()
+#include <new>
+#include <unistd.h> //syscall()
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static_assert(sizeof(Machine) % 64 == 0, "machines fill whole cache lines");
+
+MachinePool::MachinePool(size_t capacity) :
+   arena(NULL),
+   arenaSize(0),
+   capacity(capacity),
+   constructed(0),
+   inUse(0),
+   hasImage(false)
+{
+   pthread_mutex_init(&lock, NULL);
+   slotNode.resize(capacity);
+   for(int n=0; n<MACHINE_POOL_NODES; n++)
+      freeLists[n].reserve(capacity);
+
+   // reserved only, pages are backed when a slot is first constructed
+   size_t page = sysconf(_SC_PAGESIZE);
+   arenaSize = (capacity*sizeof(Machine) + page-1) / page * page;
+   if(arenaSize == 0)
+      return;
+   void* map = mmap(NULL, arenaSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if(map == MAP_FAILED)
+   {
+      perror("machine pool");
+      exit(1);
+   }
+   arena = (uint8_t*)map;
+}
+
+MachinePool::~MachinePool()
+{
+   for(size_t i=0; i<constructed; i++)
+      slot(i)->~Machine();
+   if(arena != NULL)
+      munmap(arena, arenaSize);
+   pthread_mutex_destroy(&lock);
+}
+
+void MachinePool::setTemplate(const MachineState& image)
+{
+   pthread_mutex_lock(&lock);
+   this->image = image;
+   hasImage = true;
+   pthread_mutex_unlock(&lock);
+}
+
+int MachinePool::currentNode()
+{
+   unsigned cpu;
+   unsigned node;
+   if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+      return 0;
+   return node % MACHINE_POOL_NODES;
+}
+
+Machine* MachinePool::acquire()
+{
+   int node = currentNode();
+   Machine* mach = NULL;
+   bool fresh = false;
+
+   pthread_mutex_lock(&lock);
+   if(!freeLists[node].empty())
+   {
+      mach = freeLists[node].back();
+      freeLists[node].pop_back();
+   }
+   else if(constructed < capacity)
+   {
+      // the slot is claimed here, built outside the lock
+      mach = slot(constructed);
+      slotNode[constructed] = node;
+      ++constructed;
+      fresh = true;
+   }
+   else
+   {
+      for(int n=1; (n<MACHINE_POOL_NODES) && (mach == NULL); n++)
+      {
+         std::vector<Machine*>& list = freeLists[(node+n) % MACHINE_POOL_NODES];
+         if(!list.empty())
+         {
+            mach = list.back();
+            list.pop_back();
+         }
+      }
+   }
+   if(mach != NULL)
+      ++inUse;
+   pthread_mutex_unlock(&lock);
+
+   if(mach == NULL)
+      return NULL;
+   if(fresh)
+      new(mach) Machine();
+   // the image is only replaced between runs, not while machines are taken
+   if(hasImage)
+      mach->reset(image);
+   return mach;
+}
+
+void MachinePool::release(Machine* mach)
+{
+   size_t index = ((uint8_t*)mach - arena) / sizeof(Machine);
+   pthread_mutex_lock(&lock);
+   freeLists[slotNode[index]].push_back(mach);
+   --inUse;
+   pthread_mutex_unlock(&lock);
+}
+
+size_t MachinePool::used() const
+{
+   pthread_mutex_lock(&lock);
+   size_t n = inUse;
+   pthread_mutex_unlock(&lock);
+   return n;
+}
@@ -0,0 +1,79 @@
+#ifndef MACHINEPOOL_H
+#define MACHINEPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <vector>
+
+#include "machine.h"
+
+// numa nodes with their own free list, higher node ids share them
+#define MACHINE_POOL_NODES 8
+
+/**
+ * Arena of Machines for hosts that run many instances (rollouts, batch
+ * runs), recycled instead of constructed and freed.
+ *
+ * The arena is reserved up front as one mapping of capacity slots, each a
+ * whole number of cache lines, so no two machines share a line. A slot is
+ * only constructed, and its pages first touched, by the thread that first
+ * acquires it, which is how Linux places it on that thread's numa node.
+ * Released machines go back on the free list of the node they were built
+ * on, and acquire() prefers its own node's list, then a fresh slot, then
+ * another node's machine.
+ *
+ * With a template image set, acquire() resets the machine to it, a copy
+ * of memory, screen and registers, rather than rebuilding it. Attachments
+ * (capture, metrics, observer, ...) are left as they were released.
+ */
+class MachinePool
+{
+public:
+   /**
+    * @param[in] capacity: Most machines handed out at once
+    */
+   MachinePool(size_t capacity);
+   ~MachinePool();
+
+   /**
+    * The state acquire() resets machines to, copied.
+    */
+   void setTemplate(const MachineState& image);
+
+   /**
+    * A machine for the calling thread, thread safe.
+    *
+    * @return NULL when all capacity machines are in use
+    */
+   Machine* acquire();
+
+   /**
+    * Gives a machine from acquire() back, thread safe.
+    */
+   void release(Machine* mach);
+
+   size_t size() const { return capacity; }
+   size_t used() const;
+
+private:
+   static int currentNode();
+   Machine* slot(size_t index) const { return (Machine*)(arena + index*sizeof(Machine)); }
+
+   uint8_t* arena;
+   size_t arenaSize;
+   size_t capacity;
+
+   // slots below constructed are built, slotNode says on which node
+   size_t constructed;
+   std::vector<uint8_t> slotNode;
+   std::vector<Machine*> freeLists[MACHINE_POOL_NODES];
+   size_t inUse;
+
+   MachineState image;
+   bool hasImage;
+
+   mutable pthread_mutex_t lock;
+};
+
+#endif //MACHINEPOOL_H
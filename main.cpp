@@ -2,18 +2,95 @@
 #include <stdint.h> //uint8_t
 #include <stdlib.h> //malloc
 #include <string.h>
+#include <unistd.h> //getopt()
+#include <inttypes.h> //PRIu64
+#include <time.h> //clock_gettime()
 #include "machine.h"
+#include "capture.h"
+#include "audio.h"
+#include "keymap.h"
+#include "golden.h"
+#include "debugger.h"
+#include "gdbstub.h"
+#include "trace.h"
+#include "history.h"
+#include "render.h"
+#include "simd.h"
+#include "analyzer.h"
+#include "rollout.h"
+#include "transposition.h"
+#include "observer.h"
+#include "metrics.h"
+#include "script.h"
 
 void printHelp(char* app)
 {
-   printf("Usage: %s [-?hde] FILE\n", app);
+   printf("Usage: %s [-?hdeHmDX] [-n FRAMES] [-c FORMAT -o OUT [-x SCALE]] [-w WAV] [-k KEYMAP] [-s SEED] [-V|-R TRACE] [-g PORT|unix:PATH] [-M FILE|unix:PATH] [-t TRACE] [-z SCALE] [-l] [-O ADDRS -o OUT] [-P SCRIPT] [-p PERSIST] [-b FRAMES] [-C LEVEL] [-T TIMING] [-a DIR [-j THREADS]] [-r ROLLOUTS,FRAMES [-S ADDR[*WEIGHT],...] [-L ADDR]] FILE\n", app);
    printf(" ?\tDisplay this help menu\n");
    printf(" h\tPerform hex dump\n");
    printf(" d\tPerform disassembly\n");
    printf(" e\tPerform emulation\n");
+   printf(" H\tEmulate headless, no window and no throttling\n");
+   printf(" D\tStart emulation in the debugger, with reverse stepping\n");
+   printf(" g\tServe the gdb remote protocol on a local port or unix socket\n");
+   printf(" M\tExport Prometheus metrics to a file (rewritten every second) or unix socket\n");
+   printf(" t\tRecord every executed instruction to a trace file, see c8trace\n");
+   printf(" n\tStop emulation after FRAMES frames\n");
+   printf(" P\tPlay a scripted input file headless at full speed, exit 1 when it fails\n");
+   printf(" O\tObserve memory bytes ADDR[-LAST],... per frame, raw to -o, no screen\n");
+   printf(" c\tCapture frames as y4m, gif or delta\n");
+   printf(" o\tCapture output file, - for stdout\n");
+   printf(" x\tCapture upscale factor (default 10)\n");
+   printf(" w\tWrite sound to a wav file\n");
+   printf(" m\tMute, do not open the audio device\n");
+   printf(" z\tWindow scale (default 10)\n");
+   printf(" l\tDarken every scaled row's last line, like scanlines\n");
+   printf(" p\tPhosphor persistence 0-255, ghosts fade by PERSIST/256 per frame\n");
+   printf(" b\tShow pixels lit in any of the last FRAMES frames (default 2, 1 off)\n");
+   printf(" C\tCap the SIMD kernels at scalar, sse2, avx2 or avx512\n");
+   printf(" T\tTiming, fast (default) or vip for cosmac vip cycles and display wait\n");
+   printf(" X\tCross-check every SIMD kernel variant against scalar, test the transposition table and exit\n");
+   printf(" a\tAnalyze every rom below DIR in parallel, CSV to stdout or -o\n");
+   printf(" j\tAnalyzer and rollout threads (default one per cpu)\n");
+   printf(" r\tRun random-input rollouts from the state after -n frames\n");
+   printf(" S\tRollout score, the weighted sum of these memory bytes\n");
+   printf(" L\tRollout lives byte, a rollout ends when it drops\n");
+   printf(" k\tLoad key bindings, \"<host key> <0-f|quit>\" per line\n");
+   printf(" s\tSeed the random number generator\n");
+   printf(" V\tVerify a headless run against a golden trace\n");
+   printf(" R\tRecord the checkpoints of a golden trace\n");
    printf("\n");
 }
 
+// "ADDR[*WEIGHT],..." into score terms, weight 1 when left out
+bool parseScore(const char* text, std::vector<RolloutScore>* score)
+{
+   score->clear();
+   while(*text != '\0')
+   {
+      char* end;
+      RolloutScore term;
+      term.address = strtoul(text, &end, 0);
+      term.weight = 1;
+      if(end == text)
+         return false;
+      if(*end == '*')
+      {
+         text = end+1;
+         term.weight = strtol(text, &end, 0);
+         if(end == text)
+            return false;
+      }
+      score->push_back(term);
+      if(*end == ',')
+         ++end;
+      else if(*end != '\0')
+         return false;
+      text = end;
+   }
+   return !score->empty();
+}
+
 void hexdump(uint8_t* binary, int length)
 {
    int address = 0;
@@ -46,39 +123,250 @@ int main(int argc, char* argv[])
    bool dump=false;
    bool diss=false;
    bool emulate=false;
+   bool headless=false;
+   bool debug=false;
+   const char* gdbAddress=NULL;
+   const char* traceOut=NULL;
+   RenderOptions renderOptions;
+   uint32_t frameLimit=0;
+   bool captureFrames=false;
+   CaptureFormat captureFormat=CAPTURE_Y4M;
+   const char* captureOut=NULL;
+   int captureScale=10;
+   const char* wavOut=NULL;
+   bool mute=false;
+   const char* keymapFile=NULL;
+   bool seeded=false;
+   uint32_t seed=0;
+   const char* verifyTrace=NULL;
+   const char* recordTrace=NULL;
+   bool selfTest=false;
+   const char* analyzeDir=NULL;
+   const char* metricsAddress=NULL;
+   int threads=0;
+   TimingModel timing=TIMING_FAST;
+   const char* observeSpec=NULL;
+   const char* scriptFile=NULL;
+   bool rollouts=false;
+   RolloutOptions rolloutOptions;
    
-   if(argc<3)
+   if(argc<2)
    {
       printHelp(argv[0]);
       return 0;
    }
    
    // validate options
-   if(argv[1][0] == '-')
+   int opt;
+   while((opt = getopt(argc, argv, "?hdeHmDXn:c:o:x:w:k:s:V:R:g:t:z:lp:b:C:a:j:r:S:L:O:T:M:P:")) != -1)
    {
-      if( strstr(argv[1], "?") != NULL )
+      switch(opt)
       {
-         printHelp(argv[0]);
-         return 0;
+         case 'h':
+            dump=true;
+            break;
+         case 'd':
+            diss=true;
+            break;
+         case 'e':
+            emulate=true;
+            break;
+         case 'H':
+            headless=true;
+            break;
+         case 'D':
+            debug=true;
+            break;
+         case 'g':
+            gdbAddress=optarg;
+            break;
+         case 't':
+            traceOut=optarg;
+            break;
+         case 'z':
+            renderOptions.scale=strtoul(optarg, NULL, 0);
+            break;
+         case 'l':
+            renderOptions.scanlines=true;
+            break;
+         case 'p':
+            renderOptions.persistence=strtoul(optarg, NULL, 0);
+            break;
+         case 'b':
+            renderOptions.blendFrames=strtoul(optarg, NULL, 0);
+            break;
+         case 'X':
+            selfTest=true;
+            break;
+         case 'C':
+         {
+            SimdLevel level;
+            if(!simdParse(optarg, &level))
+            {
+               printf("invalid simd level %s\n", optarg);
+               return -1;
+            }
+            simdCap(level);
+            break;
+         }
+         case 'a':
+            analyzeDir=optarg;
+            break;
+         case 'M':
+            metricsAddress=optarg;
+            break;
+         case 'j':
+            threads=atoi(optarg);
+            break;
+         case 'r':
+            if(sscanf(optarg, "%i,%i", &rolloutOptions.rollouts, &rolloutOptions.frames) != 2)
+            {
+               printf("invalid rollouts %s, use ROLLOUTS,FRAMES\n", optarg);
+               return -1;
+            }
+            rollouts=true;
+            break;
+         case 'S':
+            if(!parseScore(optarg, &rolloutOptions.score))
+            {
+               printf("invalid score %s, use ADDR[*WEIGHT],...\n", optarg);
+               return -1;
+            }
+            break;
+         case 'L':
+            rolloutOptions.lifeAddress=strtoul(optarg, NULL, 0) & (MEMORY_SIZE-1);
+            break;
+         case 'T':
+            if(strcmp(optarg, "fast") == 0)
+               timing=TIMING_FAST;
+            else if(strcmp(optarg, "vip") == 0)
+               timing=TIMING_VIP;
+            else
+            {
+               printf("invalid timing %s, use fast or vip\n", optarg);
+               return -1;
+            }
+            break;
+         case 'O':
+            observeSpec=optarg;
+            headless=true;
+            break;
+         case 'P':
+            scriptFile=optarg;
+            emulate=true;
+            headless=true;
+            break;
+         case 'n':
+            frameLimit=strtoul(optarg, NULL, 0);
+            break;
+         case 'c':
+            if(!FrameCapture::parseFormat(optarg, &captureFormat))
+            {
+               printf("invalid capture format %s\n", optarg);
+               return -1;
+            }
+            captureFrames=true;
+            break;
+         case 'o':
+            captureOut=optarg;
+            break;
+         case 'x':
+            captureScale=atoi(optarg);
+            break;
+         case 'w':
+            wavOut=optarg;
+            break;
+         case 'm':
+            mute=true;
+            break;
+         case 'k':
+            keymapFile=optarg;
+            break;
+         case 's':
+            seed=strtoul(optarg, NULL, 0);
+            seeded=true;
+            break;
+         case 'V':
+            verifyTrace=optarg;
+            break;
+         case 'R':
+            recordTrace=optarg;
+            break;
+         case '?':
+            printHelp(argv[0]);
+            return 0;
+         default:
+            printf("invalid option\n");
+            printHelp(argv[0]);
+            return -1;
       }
-         
-      if( strstr(argv[1], "h") != NULL )
-         dump=true;
-      
-      if( strstr(argv[1], "d") != NULL )
-         diss=true;
+   }
+   
+   if(selfTest)
+   {
+      printf("cpu: %s, using %s\n", simdName(simdDetect()), simdName(simdLevel()));
+      int failures = Renderer::selfTest() + transpositionSelfTest();
+      return (failures == 0) ? 0 : 1;
+   }
+   
+   if(analyzeDir != NULL)
+   {
+      RomAnalyzer analyzer;
+      if(!analyzer.scan(analyzeDir))
+         return -1;
+      analyzer.run(threads);
       
-      if( strstr(argv[1], "e") != NULL )
-         emulate=true;
+      FILE* out = stdout;
+      if((captureOut != NULL) && (strcmp(captureOut, "-") != 0))
+         out = fopen(captureOut, "w");
+      if(out == NULL)
+      {
+         printf("cannot open %s\n", captureOut);
+         return -1;
+      }
+      analyzer.writeCsv(out);
+      if(out != stdout)
+         fclose(out);
+      return 0;
    }
-   else
+   
+   if(optind >= argc)
    {
-      printf("invalid option\n");
       printHelp(argv[0]);
       return -1;
    }
    
-   FILE* f = (FILE*) fopen(argv[2], "r");
+   if(captureFrames && (captureOut == NULL))
+   {
+      printf("capture needs an output, use -o\n");
+      return -1;
+   }
+   
+   if((observeSpec != NULL) && (captureFrames || (captureOut == NULL)))
+   {
+      printf("observation writes memory to -o and keeps no screen to capture\n");
+      return -1;
+   }
+   
+   // reverse execution re-runs frames, which would be observed twice
+   if((observeSpec != NULL) && debug)
+   {
+      printf("observation runs without the debugger\n");
+      return -1;
+   }
+   
+   if((scriptFile != NULL) && (debug || (gdbAddress != NULL)))
+   {
+      printf("scripts run unattended, without the debugger\n");
+      return -1;
+   }
+   
+   InputScript script;
+   if((scriptFile != NULL) && !script.load(scriptFile))
+      return -1;
+   
+   bool passed=true;
+   FILE* f = (FILE*) fopen(argv[optind], "r");
    if(f != NULL) // if pointer is valid
    {
       // how big is file
@@ -91,6 +379,62 @@ int main(int argc, char* argv[])
       fread(binary, fsize, sizeof(uint8_t), f);
       fclose(f); // close file
       
+      MetricsRegistry registry;
+      if((metricsAddress != NULL) && !registry.start(metricsAddress))
+         return -1;
+      
+      // golden trace regression runs
+      if((verifyTrace != NULL) || (recordTrace != NULL))
+      {
+         GoldenTrace trace;
+         const char* path = (verifyTrace != NULL) ? verifyTrace : recordTrace;
+         bool ok = trace.load(path);
+         if(ok && (verifyTrace != NULL))
+            ok = trace.verify(argv[optind], binary, fsize);
+         else if(ok)
+            ok = trace.record(path, binary, fsize);
+         free(binary);
+         return ok ? 0 : 1;
+      }
+      
+      // monte-carlo rollouts from the state after the warm up frames
+      if(rollouts)
+      {
+         Machine base;
+         base.setHeadless(true);
+         base.setTiming(timing);
+         if(seeded)
+            base.setSeed(seed);
+         base.load(binary, fsize);
+         for(uint32_t i=0; (i<frameLimit) && base.runFrame(); i++)
+            ;
+         MachineState state;
+         base.saveState(&state);
+         free(binary);
+         
+         if(seeded)
+            rolloutOptions.seed=seed;
+         rolloutOptions.timing=timing;
+         RolloutEngine engine(threads);
+         if(metricsAddress != NULL)
+            engine.setMetrics(&registry);
+         RolloutStats stats;
+         struct timespec t0, t1;
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         engine.run(state, rolloutOptions, &stats);
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         double seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+         
+         printf("rollouts: %i x %i frames on %i threads in %.3f s, %.0f rollouts/s\n",
+                stats.rollouts, rolloutOptions.frames, engine.threads(), seconds,
+                (seconds > 0) ? stats.rollouts/seconds : 0);
+         printf("score: mean %.3f stddev %.3f min %" PRId64 " max %" PRId64 "\n",
+                stats.meanScore, stats.scoreStddev, stats.minScore, stats.maxScore);
+         printf("survival: mean %.2f frames, %i of %i ran all frames\n",
+                stats.meanFrames, stats.survivors, stats.rollouts);
+         return 0;
+      }
+      
       // hexdump
       if(dump)
          hexdump(binary, fsize);
@@ -102,11 +446,102 @@ int main(int argc, char* argv[])
       
       // emulate
       if(emulate)
-         mach.execute(binary, fsize);
+      {
+         FrameCapture capture;
+         if(captureFrames)
+         {
+            // headless exports wait for the encoder, live capture drops frames
+            if(!capture.open(captureOut, captureFormat, captureScale, headless))
+               return -1;
+            mach.setCapture(&capture);
+         }
+         
+         // live sound unless muted, the device is only opened with a window
+         AudioOutput audio;
+         if((wavOut != NULL) && !audio.openWav(wavOut))
+            return -1;
+         if((wavOut != NULL) || !(mute || headless))
+            mach.setAudio(&audio);
+         
+         if(keymapFile != NULL)
+         {
+            KeyMap keymap;
+            if(!keymap.load(keymapFile))
+               return -1;
+            mach.setKeyMap(keymap);
+         }
+         
+         Debugger debugger(mach);
+         History history(mach);
+         if(debug)
+         {
+            debugger.interrupt();
+            debugger.setHistory(&history);
+            mach.setDebugger(&debugger);
+            mach.setHistory(&history);
+         }
+         
+         GdbStub stub(mach, debugger);
+         if(gdbAddress != NULL)
+         {
+            if(!stub.listen(gdbAddress))
+               return -1;
+            debugger.setRemote(&stub);
+            mach.setDebugger(&debugger);
+         }
+         
+         RamObserver observer;
+         if(observeSpec != NULL)
+         {
+            if(!observer.watch(observeSpec))
+            {
+               printf("invalid addresses %s, use ADDR[-LAST],...\n", observeSpec);
+               return -1;
+            }
+            if(!observer.open(captureOut))
+               return -1;
+            mach.setObserver(&observer);
+         }
+         
+         TraceRecorder tracer(mach);
+         if(traceOut != NULL)
+         {
+            if(!tracer.open(traceOut))
+               return -1;
+            mach.setTracer(&tracer);
+         }
+         
+         if(seeded)
+            mach.setSeed(seed);
+         mach.setRenderOptions(renderOptions);
+         mach.setHeadless(headless);
+         mach.setTiming(timing);
+         if(metricsAddress != NULL)
+            mach.setMetrics(registry.add("main"));
+         mach.setFrameLimit(frameLimit);
+         if(scriptFile != NULL)
+            passed = script.run(mach, binary, fsize, frameLimit);
+         else
+            mach.execute(binary, fsize);
+         
+         stub.close();
+         tracer.close();
+         if(traceOut != NULL)
+            fprintf(stderr, "trace: %" PRIu64 " instructions in %" PRIu64 " bytes, %u writer stalls\n",
+                    tracer.instructionsWritten(), tracer.bytesWritten(), tracer.writerStalls());
+         capture.close();
+         audio.close();
+         observer.close();
+         if(observeSpec != NULL)
+            fprintf(stderr, "observe: %" PRIu64 " frames of %zu bytes\n",
+                    observer.framesRecorded(), observer.width());
+         if(capture.framesDropped() > 0)
+            fprintf(stderr, "capture dropped %u frames\n", capture.framesDropped());
+      }
       
       // cleanup memory
       free(binary);
    }
    
-   return 0;
+   return passed ? 0 : 1;
 }
\ No newline at end of file
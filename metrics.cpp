@@ -0,0 +1,281 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h> //strncmp() memset()
+#include <unistd.h> //write() close() unlink()
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+MachineMetrics::MachineMetrics(const std::string& name) :
+   name(name),
+   instructions(0),
+   frames(0),
+   presents(0),
+   droppedFrames(0),
+   latencyCount(0),
+   latencySum(0),
+   latencyMax(0),
+   executeTime(0),
+   drawTime(0),
+   pollTime(0)
+{
+}
+
+MetricsRegistry::MetricsRegistry() :
+   started(metricsNow()),
+   listenFd(-1),
+   running(false),
+   quit(false)
+{
+   pthread_mutex_init(&lock, NULL);
+   wakePipe[0] = -1;
+   wakePipe[1] = -1;
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+   stop();
+   for(size_t i=0; i<machines.size(); i++)
+      delete machines[i];
+   pthread_mutex_destroy(&lock);
+}
+
+MachineMetrics* MetricsRegistry::add(const std::string& name)
+{
+   MachineMetrics* m = new MachineMetrics(name);
+   Sample s = { started, 0, 0 };
+   pthread_mutex_lock(&lock);
+   machines.push_back(m);
+   samples.push_back(s);
+   pthread_mutex_unlock(&lock);
+   return m;
+}
+
+bool MetricsRegistry::start(const char* address)
+{
+   if(strncmp(address, "unix:", 5) == 0)
+   {
+      struct sockaddr_un sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sun_family = AF_UNIX;
+      strncpy(sa.sun_path, address+5, sizeof(sa.sun_path)-1);
+      unixPath = sa.sun_path;
+      unlink(sa.sun_path);
+
+      listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if((listenFd < 0) || (bind(listenFd, (struct sockaddr*)&sa, sizeof(sa)) < 0) ||
+         (::listen(listenFd, 4) < 0))
+      {
+         perror("metrics");
+         return false;
+      }
+   }
+   else
+   {
+      filePath = address;
+      if(!writeFile())
+         return false;
+   }
+
+   if(pipe(wakePipe) < 0)
+   {
+      perror("metrics");
+      return false;
+   }
+   running = true;
+   pthread_create(&thread, NULL, exporterMain, this);
+   return true;
+}
+
+void MetricsRegistry::stop()
+{
+   if(!running)
+      return;
+
+   quit.store(true);
+   if(write(wakePipe[1], "x", 1) < 0)
+      perror("metrics");
+   pthread_join(thread, NULL);
+   running = false;
+
+   if(!filePath.empty())
+      writeFile();
+   if(listenFd >= 0)
+      ::close(listenFd);
+   if(!unixPath.empty())
+      unlink(unixPath.c_str());
+   ::close(wakePipe[0]);
+   ::close(wakePipe[1]);
+   listenFd = -1;
+}
+
+void* MetricsRegistry::exporterMain(void* arg)
+{
+   MetricsRegistry* registry = (MetricsRegistry*) arg;
+
+   while(!registry->quit.load())
+   {
+      // files are rewritten on a timer, sockets answered when connected to
+      struct pollfd fds[2];
+      fds[0].fd = registry->wakePipe[0];
+      fds[0].events = POLLIN;
+      fds[1].fd = registry->listenFd;
+      fds[1].events = POLLIN;
+      int n = poll(fds, (registry->listenFd >= 0) ? 2 : 1,
+                   (registry->listenFd >= 0) ? -1 : METRICS_PERIOD_MS);
+      if(registry->quit.load())
+         break;
+
+      if(registry->listenFd < 0)
+      {
+         if(n == 0)
+            registry->writeFile();
+         continue;
+      }
+
+      if((n > 0) && (fds[1].revents & POLLIN))
+      {
+         int client = accept(registry->listenFd, NULL, NULL);
+         if(client < 0)
+            continue;
+         std::string text = registry->collect();
+         const char* p = text.data();
+         size_t left = text.size();
+         // a scraper that hangs up early must not SIGPIPE the emulator
+         while(left > 0)
+         {
+            ssize_t written = send(client, p, left, MSG_NOSIGNAL);
+            if(written <= 0)
+               break;
+            p += written;
+            left -= written;
+         }
+         ::close(client);
+      }
+   }
+   return NULL;
+}
+
+bool MetricsRegistry::writeFile()
+{
+   // readers only ever see a whole file
+   std::string text = collect();
+   std::string temp = filePath + ".tmp";
+   FILE* f = fopen(temp.c_str(), "w");
+   if(f == NULL)
+   {
+      fprintf(stderr, "Cannot write %s\n", temp.c_str());
+      return false;
+   }
+   bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+   ok = (fclose(f) == 0) && ok;
+   if(!ok || (rename(temp.c_str(), filePath.c_str()) != 0))
+   {
+      fprintf(stderr, "Cannot write %s\n", filePath.c_str());
+      return false;
+   }
+   return true;
+}
+
+// one metric family, a value per machine
+struct Family
+{
+   const char* name;
+   const char* type;
+   const char* help;
+};
+
+static const Family families[] =
+{
+   { "c8emul_instructions_total", "counter", "Instructions executed." },
+   { "c8emul_frames_total", "counter", "Frames (timer ticks) emulated." },
+   { "c8emul_instructions_per_second", "gauge", "Instructions per second since the last collection." },
+   { "c8emul_frames_per_second", "gauge", "Frames per second since the last collection." },
+   { "c8emul_presents_total", "counter", "Frames presented to the window." },
+   { "c8emul_dropped_frames_total", "counter", "Captured frames dropped because the encoder fell behind." },
+   { "c8emul_present_latency_seconds_total", "counter", "Input to display latency, summed over the inputs." },
+   { "c8emul_present_latency_inputs_total", "counter", "Inputs whose display latency was measured." },
+   { "c8emul_present_latency_max_seconds", "gauge", "Input to display latency, worst case." },
+   { "c8emul_execute_seconds_total", "counter", "Time fetching, decoding and executing instructions." },
+   { "c8emul_draw_seconds_total", "counter", "Time presenting frames (drawGraphics)." },
+   { "c8emul_poll_seconds_total", "counter", "Time polling host inputs (pollInputs)." }
+};
+
+#define FAMILIES (sizeof(families)/sizeof(families[0]))
+
+// a label value of the exposition format, \\, \" and \n escaped
+static std::string escapeLabel(const std::string& value)
+{
+   std::string out;
+   for(size_t i=0; i<value.size(); i++)
+   {
+      if(value[i] == '\n')
+         out += "\\n";
+      else
+      {
+         if((value[i] == '\\') || (value[i] == '"'))
+            out += '\\';
+         out += value[i];
+      }
+   }
+   return out;
+}
+
+std::string MetricsRegistry::collect()
+{
+   uint64_t now = metricsNow();
+   std::vector<double> values[FAMILIES];
+   std::vector<std::string> labels;
+
+   pthread_mutex_lock(&lock);
+   for(size_t i=0; i<machines.size(); i++)
+   {
+      const MachineMetrics& m = *machines[i];
+      uint64_t instructions = m.instructions.load(std::memory_order_relaxed);
+      uint64_t frames = m.frames.load(std::memory_order_relaxed);
+      Sample& prev = samples[i];
+      double seconds = (now - prev.time)*1e-9;
+
+      double v[FAMILIES] =
+      {
+         (double)instructions,
+         (double)frames,
+         (seconds > 0) ? (instructions - prev.instructions)/seconds : 0,
+         (seconds > 0) ? (frames - prev.frames)/seconds : 0,
+         (double)m.presents.load(std::memory_order_relaxed),
+         (double)m.droppedFrames.load(std::memory_order_relaxed),
+         m.latencySum.load(std::memory_order_relaxed)*1e-9,
+         (double)m.latencyCount.load(std::memory_order_relaxed),
+         m.latencyMax.load(std::memory_order_relaxed)*1e-9,
+         m.executeTime.load(std::memory_order_relaxed)*1e-9,
+         m.drawTime.load(std::memory_order_relaxed)*1e-9,
+         m.pollTime.load(std::memory_order_relaxed)*1e-9
+      };
+      for(size_t f=0; f<FAMILIES; f++)
+         values[f].push_back(v[f]);
+      labels.push_back(escapeLabel(m.name));
+
+      prev.time = now;
+      prev.instructions = instructions;
+      prev.frames = frames;
+   }
+   pthread_mutex_unlock(&lock);
+
+   std::string text;
+   char line[256];
+   for(size_t f=0; f<FAMILIES; f++)
+   {
+      snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+               families[f].name, families[f].help, families[f].name, families[f].type);
+      text += line;
+      // not instance, prometheus sets that one to the scrape target
+      for(size_t i=0; i<labels.size(); i++)
+      {
+         text += families[f].name;
+         text += "{machine=\"" + labels[i] + "\"}";
+         snprintf(line, sizeof(line), " %.15g\n", values[f][i]);
+         text += line;
+      }
+   }
+   return text;
+}
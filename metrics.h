@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// how often the exporter rewrites a metrics file
+#define METRICS_PERIOD_MS 1000
+
+static inline uint64_t metricsNow()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Counters of one Machine. Only the thread running that machine writes
+ * them, with plain relaxed loads and stores (no locked instructions), and
+ * mostly once per frame, so keeping them costs the emulation nothing
+ * measurable. The exporter reads them whenever it is asked to.
+ */
+struct MachineMetrics
+{
+   std::string name;       // the machine label
+
+   std::atomic<uint64_t> instructions;
+   std::atomic<uint64_t> frames;
+   std::atomic<uint64_t> presents;
+   std::atomic<uint64_t> droppedFrames;
+
+   // input to display latency, in ns
+   std::atomic<uint64_t> latencyCount;
+   std::atomic<uint64_t> latencySum;
+   std::atomic<uint64_t> latencyMax;
+
+   // wall time, in ns, running instructions (fetch, decode, execute) and
+   // presenting and polling on the host
+   std::atomic<uint64_t> executeTime;
+   std::atomic<uint64_t> drawTime;
+   std::atomic<uint64_t> pollTime;
+
+   MachineMetrics(const std::string& name);
+
+   // single writer increment
+   static void add(std::atomic<uint64_t>& counter, uint64_t n)
+   {
+      counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+   }
+   static void set(std::atomic<uint64_t>& counter, uint64_t n)
+   {
+      counter.store(n, std::memory_order_relaxed);
+   }
+};
+
+/**
+ * Prometheus text exposition of every registered machine, written to a
+ * file every METRICS_PERIOD_MS or served to each client of a unix socket.
+ *
+ * Registering takes a lock, collecting takes it to walk the list, the
+ * machines themselves never do: the counters are summed lazily when a
+ * file is written or a scraper connects. Rates (instructions and frames
+ * per second) are worked out against the previous collection.
+ */
+class MetricsRegistry
+{
+public:
+   MetricsRegistry();
+   ~MetricsRegistry();
+
+   /**
+    * New counters for a machine, owned by the registry.
+    *
+    * @param[in] name: The machine label, e.g. "main" or "rollout-3"
+    */
+   MachineMetrics* add(const std::string& name);
+
+   /**
+    * Starts the exporter thread.
+    *
+    * @param[in] address: A file path, or unix:/path/to/socket
+    */
+   bool start(const char* address);
+
+   /**
+    * Writes a last file and stops the exporter.
+    */
+   void stop();
+
+   /**
+    * The exposition text as of now.
+    */
+   std::string collect();
+
+private:
+   static void* exporterMain(void* arg);
+   bool writeFile();
+
+   // previous collection of a machine, for the rates
+   struct Sample
+   {
+      uint64_t time;
+      uint64_t instructions;
+      uint64_t frames;
+   };
+
+   pthread_mutex_t lock;
+   std::vector<MachineMetrics*> machines;
+   std::vector<Sample> samples;
+   uint64_t started;
+
+   // exporter
+   std::string filePath;
+   std::string unixPath;
+   int listenFd;
+   int wakePipe[2];
+   bool running;
+   std::atomic<bool> quit;
+   pthread_t thread;
+};
+
+#endif //METRICS_H
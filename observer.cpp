@@ -0,0 +1,129 @@
+#include "observer.h"
+#include <string.h> //memcpy()
+#include <stdlib.h> //strtoul()
+
+// frames per batch unless set, 64KB with a few hundred watched bytes
+#define OBSERVER_BATCH_FRAMES 256
+
+RamObserver::RamObserver() :
+   bytes(0),
+   capacity(OBSERVER_BATCH_FRAMES),
+   count(0),
+   out(NULL),
+   recorded(0),
+   dropped(0)
+{
+}
+
+RamObserver::~RamObserver()
+{
+   close();
+}
+
+bool RamObserver::watch(const char* spec)
+{
+   while(*spec != '\0')
+   {
+      char* end;
+      unsigned long first = strtoul(spec, &end, 0);
+      if(end == spec)
+         return false;
+      unsigned long last = first;
+      if(*end == '-')
+      {
+         spec = end+1;
+         last = strtoul(spec, &end, 0);
+         if(end == spec)
+            return false;
+      }
+      if((first > last) || (last >= MEMORY_SIZE))
+         return false;
+      for(unsigned long addr=first; addr<=last; addr++)
+         watch(addr);
+
+      if(*end == ',')
+         ++end;
+      else if(*end != '\0')
+         return false;
+      spec = end;
+   }
+   return bytes > 0;
+}
+
+void RamObserver::watch(uint16_t addr)
+{
+   addr &= MEMORY_SIZE-1;
+   // extends the last run when it is the next byte
+   if(!runs.empty() && (runs.back().first + runs.back().length == addr))
+      ++runs.back().length;
+   else
+   {
+      Run run = { addr, 1 };
+      runs.push_back(run);
+   }
+   ++bytes;
+   batch.resize(capacity*bytes);
+   count = 0;
+}
+
+void RamObserver::setBatchFrames(size_t frames)
+{
+   capacity = (frames > 0) ? frames : 1;
+   batch.resize(capacity*bytes);
+   count = 0;
+}
+
+bool RamObserver::open(const char* path)
+{
+   if(strcmp(path, "-") == 0)
+      out = stdout;
+   else
+      out = fopen(path, "wb");
+   if(out == NULL)
+   {
+      fprintf(stderr, "Cannot open %s\n", path);
+      return false;
+   }
+   return true;
+}
+
+void RamObserver::record(const uint8_t* memory)
+{
+   if(full())
+   {
+      if(out == NULL)
+      {
+         ++dropped;
+         return;
+      }
+      flush();
+   }
+
+   uint8_t* row = batch.data() + count*bytes;
+   for(size_t i=0; i<runs.size(); i++)
+   {
+      memcpy(row, memory + runs[i].first, runs[i].length);
+      row += runs[i].length;
+   }
+   ++count;
+   ++recorded;
+}
+
+void RamObserver::flush()
+{
+   if((out != NULL) && (count > 0))
+      fwrite(batch.data(), bytes, count, out);
+   count = 0;
+}
+
+void RamObserver::close()
+{
+   if(out == NULL)
+      return;
+   flush();
+   if(out != stdout)
+      fclose(out);
+   else
+      fflush(out);
+   out = NULL;
+}
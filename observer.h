@@ -0,0 +1,87 @@
+#ifndef OBSERVER_H
+#define OBSERVER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "machine.h"
+
+/**
+ * Collects a fixed set of memory bytes (score, positions, ...) once per
+ * frame into one contiguous batch: frame after frame, the watched bytes
+ * of a frame in the order they were added.
+ *
+ * Attached with Machine::setObserver(), which also stops the machine
+ * keeping pixels, so a run that only needs game variables pays for the
+ * bytes it reads and not for the screen. The watched addresses are kept
+ * as runs of consecutive bytes and copied a run at a time.
+ */
+class RamObserver
+{
+public:
+   RamObserver();
+   ~RamObserver();
+
+   /**
+    * Adds "ADDR[-LAST],..." to the watched bytes, e.g. "0x2F0-0x2F3,0x310".
+    */
+   bool watch(const char* spec);
+   void watch(uint16_t addr);
+
+   /**
+    * Frames per batch, resets the batch.
+    */
+   void setBatchFrames(size_t frames);
+
+   /**
+    * Writes every full batch to a file (or stdout) and starts a new one,
+    * without an output the caller drains the batch with clear().
+    */
+   bool open(const char* path);
+
+   /**
+    * Appends the watched bytes of one frame. With no output and a full
+    * batch the frame is dropped.
+    *
+    * @param[in] memory: MEMORY_SIZE bytes
+    */
+   void record(const uint8_t* memory);
+
+   /**
+    * Writes out what is left of the batch and closes the output.
+    */
+   void close();
+
+   const uint8_t* data() const { return batch.data(); }
+   size_t width() const { return bytes; }
+   size_t frames() const { return count; }
+   bool full() const { return count >= capacity; }
+   void clear() { count = 0; }
+
+   uint64_t framesRecorded() const { return recorded; }
+   uint64_t framesDropped() const { return dropped; }
+
+private:
+   struct Run
+   {
+      uint16_t first;
+      uint16_t length;
+   };
+
+   void flush();
+
+   std::vector<Run> runs;
+   size_t bytes;             // watched bytes per frame
+
+   std::vector<uint8_t> batch;
+   size_t capacity;          // frames per batch
+   size_t count;             // frames in the batch
+
+   FILE* out;
+   uint64_t recorded;
+   uint64_t dropped;
+};
+
+#endif //OBSERVER_H
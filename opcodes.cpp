@@ -0,0 +1,188 @@
+#include "opcodes.h"
+
+// same matching as the interpreter always did: the 0, E and F groups only
+// look at the low byte, 5XY0/9XY0 ignore the last nibble
+static constexpr uint8_t decodeKind(uint16_t opcode)
+{
+   switch(opcode&0xF000)
+   {
+      case 0x0000:
+         switch(opcode&0x00FF)
+         {
+            case 0x00E0: return OP_CLS;
+            case 0x00EE: return OP_RTN;
+         }
+         return OP_UNKNOWN;
+      case 0x1000: return OP_JMP;
+      case 0x2000: return OP_JSR;
+      case 0x3000: return OP_SKIP_EQ_IMM;
+      case 0x4000: return OP_SKIP_NE_IMM;
+      case 0x5000: return OP_SKIP_EQ;
+      case 0x6000: return OP_MOV_IMM;
+      case 0x7000: return OP_ADD_IMM;
+      case 0x8000:
+         switch(opcode&0x000F)
+         {
+            case 0x0000: return OP_MOV;
+            case 0x0001: return OP_OR;
+            case 0x0002: return OP_AND;
+            case 0x0003: return OP_XOR;
+            case 0x0004: return OP_ADD_C;
+            case 0x0005: return OP_SUB_B;
+            case 0x0006: return OP_SHR;
+            case 0x0007: return OP_RSB;
+            case 0x000E: return OP_SHL;
+         }
+         return OP_UNKNOWN;
+      case 0x9000: return OP_SKIP_NE;
+      case 0xA000: return OP_MOV_I;
+      case 0xB000: return OP_JMP_V0;
+      case 0xC000: return OP_RAND;
+      case 0xD000: return OP_SPRITE;
+      case 0xE000:
+         switch(opcode&0x00FF)
+         {
+            case 0x009E: return OP_SKIP_PRESS;
+            case 0x00A1: return OP_SKIP_NPRESS;
+         }
+         return OP_UNKNOWN;
+      case 0xF000:
+         switch(opcode&0x00FF)
+         {
+            case 0x0002: return (opcode == 0xF002) ? OP_AUDIO : OP_UNKNOWN; // F002 only
+            case 0x0007: return OP_GDELAY;
+            case 0x000A: return OP_KEY;
+            case 0x0015: return OP_SDELAY;
+            case 0x0018: return OP_SSOUND;
+            case 0x001E: return OP_ADD_I;
+            case 0x0029: return OP_FONT;
+            case 0x0033: return OP_BCD;
+            case 0x003A: return OP_PITCH;
+            case 0x0055: return OP_STORE;
+            case 0x0065: return OP_LOAD;
+         }
+         return OP_UNKNOWN;
+   }
+   return OP_UNKNOWN;
+}
+
+constexpr OpcodeTable::OpcodeTable() :
+   info()
+{
+   for(int opcode=0; opcode<0x10000; opcode++)
+   {
+      OpInfo& op = info[opcode];
+      op.kind = decodeKind(opcode);
+      op.x = (opcode>>8)&0xF;
+      op.y = (opcode>>4)&0xF;
+      op.n = opcode&0xF;
+      op.nnn = opcode&0xFFF;
+   }
+}
+
+constexpr OpcodeTable opcodeTable;
+
+static_assert(opcodeTable.info[0x00E0].kind == OP_CLS, "opcode table");
+static_assert(opcodeTable.info[0x8AB4].kind == OP_ADD_C, "opcode table");
+static_assert(opcodeTable.info[0xF565].kind == OP_LOAD, "opcode table");
+static_assert(opcodeTable.info[0xF565].x == 5, "opcode table");
+
+// mnemonic per kind, %X %Y %N are the operands in decimal, %A the address
+// and %K the low byte in hex
+static const char* formats[OP_KINDS] =
+{
+   "unknown opcode",
+   "cls",
+   "rtn",
+   "jmp 0x%A",
+   "jsr 0x%A",
+   "skip.eq V%X,0x%K",
+   "skip.ne V%X,0x%K",
+   "skip.eq V%X,V%Y",
+   "mov V%X,0x%K",
+   "add V%X,0x%K",
+   "mov V%X,V%Y",
+   "or V%X,V%Y",
+   "and V%X,V%Y",
+   "xor V%X,V%Y",
+   "add.c V%X,V%Y",
+   "sub.b V%X,V%Y",
+   "shr V%X",
+   "rsb V%X,V%Y",
+   "shl V%X",
+   "skip.ne V%X,V%Y",
+   "mov I,0x%A",
+   "jmp 0x%A+V0",
+   "rand V%X,rnd&0x%K",
+   "sprite V%X,V%Y,%N",
+   "skip.press V%X",
+   "skip.npress V%X",
+   "audio [I]",
+   "gdelay V%X",
+   "key V%X",
+   "sdelay V%X",
+   "ssound V%X",
+   "add I,V%X",
+   "font I,V%X",
+   "bcd I,V%X",
+   "pitch V%X",
+   "store [I],V0-V%X",
+   "load V0-V%X,[I]"
+};
+
+static const char* patterns[OP_KINDS] =
+{
+   "????", "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN",
+   "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+   "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1", "F002",
+   "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX3A", "FX55",
+   "FX65"
+};
+
+const char* opcodePattern(int kind)
+{
+   return ((kind >= 0) && (kind < OP_KINDS)) ? patterns[kind] : patterns[OP_UNKNOWN];
+}
+
+static char* putDecimal(char* out, int value)
+{
+   if(value >= 10)
+      *out++ = '0' + value/10;
+   *out++ = '0' + value%10;
+   return out;
+}
+
+// lower case without leading zeros, like %x
+static char* putHex(char* out, unsigned value)
+{
+   int shift = 0;
+   while((value >> shift) >= 16)
+      shift += 4;
+   for(; shift>=0; shift-=4)
+      *out++ = "0123456789abcdef"[(value >> shift) & 0xF];
+   return out;
+}
+
+int formatOpcode(uint16_t opcode, char* text)
+{
+   const OpInfo& op = decodeOpcode(opcode);
+   char* out = text;
+   for(const char* f=formats[op.kind]; *f; f++)
+   {
+      if(*f != '%')
+      {
+         *out++ = *f;
+         continue;
+      }
+      switch(*++f)
+      {
+         case 'X': out = putDecimal(out, op.x); break;
+         case 'Y': out = putDecimal(out, op.y); break;
+         case 'N': out = putDecimal(out, op.n); break;
+         case 'A': out = putHex(out, op.nnn); break;
+         case 'K': out = putHex(out, op.nnn&0xFF); break;
+      }
+   }
+   *out = '\0';
+   return out - text;
+}
@@ -0,0 +1,89 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include <stdint.h>
+
+// one per instruction, the interpreter switches on these
+enum OpKind
+{
+   OP_UNKNOWN,
+   OP_CLS,          // 00E0
+   OP_RTN,          // 00EE
+   OP_JMP,          // 1NNN
+   OP_JSR,          // 2NNN
+   OP_SKIP_EQ_IMM,  // 3XNN
+   OP_SKIP_NE_IMM,  // 4XNN
+   OP_SKIP_EQ,      // 5XY0
+   OP_MOV_IMM,      // 6XNN
+   OP_ADD_IMM,      // 7XNN
+   OP_MOV,          // 8XY0
+   OP_OR,           // 8XY1
+   OP_AND,          // 8XY2
+   OP_XOR,          // 8XY3
+   OP_ADD_C,        // 8XY4
+   OP_SUB_B,        // 8XY5
+   OP_SHR,          // 8XY6
+   OP_RSB,          // 8XY7
+   OP_SHL,          // 8XYE
+   OP_SKIP_NE,      // 9XY0
+   OP_MOV_I,        // ANNN
+   OP_JMP_V0,       // BNNN
+   OP_RAND,         // CXNN
+   OP_SPRITE,       // DXYN
+   OP_SKIP_PRESS,   // EX9E
+   OP_SKIP_NPRESS,  // EXA1
+   OP_AUDIO,        // F002 (xo-chip)
+   OP_GDELAY,       // FX07
+   OP_KEY,          // FX0A
+   OP_SDELAY,       // FX15
+   OP_SSOUND,       // FX18
+   OP_ADD_I,        // FX1E
+   OP_FONT,         // FX29
+   OP_BCD,          // FX33
+   OP_PITCH,        // FX3A (xo-chip)
+   OP_STORE,        // FX55
+   OP_LOAD,         // FX65
+   OP_KINDS
+};
+
+// an opcode with its operands already pulled out
+struct OpInfo
+{
+   uint8_t kind;   // OpKind
+   uint8_t x;      // register operands
+   uint8_t y;
+   uint8_t n;      // low nibble, the sprite height
+   uint16_t nnn;   // address, the low byte is the NN immediate
+};
+
+// longest mnemonic ("rand V15,rnd&0xff") and its NUL
+#define OP_TEXT_SIZE 18
+
+// every opcode decoded once, at compile time
+struct OpcodeTable
+{
+   OpInfo info[0x10000];
+
+   constexpr OpcodeTable();
+};
+
+extern const OpcodeTable opcodeTable;
+
+inline const OpInfo& decodeOpcode(uint16_t opcode)
+{
+   return opcodeTable.info[opcode];
+}
+
+// the opcode pattern of a kind, e.g. "8XY4", "????" for OP_UNKNOWN
+const char* opcodePattern(int kind);
+
+/**
+ * Writes the disassembly of an opcode.
+ *
+ * @param[in]  opcode: The instruction
+ * @param[out] text:   At least OP_TEXT_SIZE chars, NUL terminated
+ * @return the length without the NUL
+ */
+int formatOpcode(uint16_t opcode, char* text);
+
+#endif //OPCODES_H
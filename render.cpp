@@ -0,0 +1,639 @@
+#include "render.h"
+#include "simd.h"
+#include <stdio.h> //printf()
+#include <stdlib.h> //posix_memalign() free()
+#include <string.h> //memset() memcpy()
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define SOURCE_PIXELS (RENDER_SOURCE_WIDTH*RENDER_SOURCE_HEIGHT)
+
+// one entry per SimdLevel, picked when the renderer is created
+struct RenderKernels
+{
+   // packs 0/1 pixel bytes into one uint64_t per row, bit n is pixel n
+   void (*packRows)(const uint8_t* screen, uint64_t* rows);
+   // ORs count packed frames together
+   void (*blendRows)(const uint64_t (*frames)[RENDER_SOURCE_HEIGHT], int count, uint64_t* out);
+   // expands packed rows into 0x00/0xFF bytes
+   void (*unpackRows)(const uint64_t* rows, uint8_t* lit);
+   // levels = max(lit, levels*persistence/256), returns non zero while some
+   // unlit pixel still glows
+   uint8_t (*updateLevels)(const uint8_t* litMask, uint8_t* levels, int persistence);
+   // writes one scaled output row, every source pixel becomes scale copies
+   // of its palette colour
+   void (*expandRow)(const uint8_t* levels, const uint32_t* palette, uint32_t* out, int scale);
+   // scanline row, every channel at half intensity
+   void (*darkenRow)(const uint32_t* in, uint32_t* out, int width);
+};
+
+// scalar reference kernels, the vector ones must match them bit for bit
+
+static void packRowsScalar(const uint8_t* screen, uint64_t* rows)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      const uint8_t* in = screen + y*RENDER_SOURCE_WIDTH;
+      uint64_t bits = 0;
+      for(int x=0; x<RENDER_SOURCE_WIDTH; x++)
+         bits |= (uint64_t)(in[x]&1) << x;
+      rows[y] = bits;
+   }
+}
+
+static void blendRowsScalar(const uint64_t (*frames)[RENDER_SOURCE_HEIGHT], int count, uint64_t* out)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      uint64_t acc = frames[0][y];
+      for(int f=1; f<count; f++)
+         acc |= frames[f][y];
+      out[y] = acc;
+   }
+}
+
+static void unpackRowsScalar(const uint64_t* rows, uint8_t* lit)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      for(int x=0; x<RENDER_SOURCE_WIDTH; x++)
+         lit[y*RENDER_SOURCE_WIDTH+x] = ((rows[y] >> x) & 1) ? 0xFF : 0x00;
+   }
+}
+
+static uint8_t updateLevelsScalar(const uint8_t* litMask, uint8_t* levels, int persistence)
+{
+   uint8_t glow = 0;
+   for(int i=0; i<SOURCE_PIXELS; i++)
+   {
+      uint8_t lit = litMask[i];
+      uint8_t faded = (levels[i]*persistence) >> 8;
+      levels[i] = (lit > faded) ? lit : faded;
+      glow |= levels[i] & ~lit;
+   }
+   return glow;
+}
+
+static void expandRowScalar(const uint8_t* levels, const uint32_t* palette, uint32_t* out, int scale)
+{
+   for(int x=0; x<RENDER_SOURCE_WIDTH; x++)
+   {
+      uint32_t c = palette[levels[x]];
+      for(int k=0; k<scale; k++)
+         out[x*scale+k] = c;
+   }
+}
+
+static void darkenRowScalar(const uint32_t* in, uint32_t* out, int width)
+{
+   for(int i=0; i<width; i++)
+      out[i] = (in[i] >> 1) & 0x7F7F7F7F;
+}
+
+#ifdef SIMD_X86
+
+// SSE2, every x86-64 host has it
+
+SIMD_TARGET("sse2")
+static void packRowsSse2(const uint8_t* screen, uint64_t* rows)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      const uint8_t* in = screen + y*RENDER_SOURCE_WIDTH;
+      uint64_t bits = 0;
+      // shift the pixel bit up to the sign bit that movemask collects
+      for(int x=0; x<RENDER_SOURCE_WIDTH; x+=16)
+      {
+         __m128i v = _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(in+x)), 7);
+         bits |= (uint64_t)(uint32_t)_mm_movemask_epi8(v) << x;
+      }
+      rows[y] = bits;
+   }
+}
+
+SIMD_TARGET("sse2")
+static void blendRowsSse2(const uint64_t (*frames)[RENDER_SOURCE_HEIGHT], int count, uint64_t* out)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y+=2)
+   {
+      __m128i acc = _mm_loadu_si128((const __m128i*)(frames[0]+y));
+      for(int f=1; f<count; f++)
+         acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(frames[f]+y)));
+      _mm_storeu_si128((__m128i*)(out+y), acc);
+   }
+}
+
+SIMD_TARGET("sse2")
+static void unpackRowsSse2(const uint64_t* rows, uint8_t* lit)
+{
+   // copy each source byte into 8 lanes, then test one bit per lane
+   const __m128i select = _mm_set1_epi64x(0x8040201008040201LL);
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      for(int x=0; x<RENDER_SOURCE_WIDTH; x+=16)
+      {
+         uint64_t lo = (rows[y] >> x) & 0xFF;
+         uint64_t hi = (rows[y] >> (x+8)) & 0xFF;
+         __m128i v = _mm_set_epi64x(hi*0x0101010101010101ULL, lo*0x0101010101010101ULL);
+         v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+         _mm_storeu_si128((__m128i*)(lit + y*RENDER_SOURCE_WIDTH + x), v);
+      }
+   }
+}
+
+SIMD_TARGET("sse2")
+static uint8_t updateLevelsSse2(const uint8_t* litMask, uint8_t* levels, int persistence)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i decay = _mm_set1_epi16(persistence);
+   __m128i glowAcc = zero;
+   for(int i=0; i<SOURCE_PIXELS; i+=16)
+   {
+      __m128i lit = _mm_loadu_si128((const __m128i*)(litMask+i));
+      __m128i old = _mm_loadu_si128((const __m128i*)(levels+i));
+      __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(old, zero), decay), 8);
+      __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(old, zero), decay), 8);
+      __m128i level = _mm_max_epu8(lit, _mm_packus_epi16(lo, hi));
+      _mm_storeu_si128((__m128i*)(levels+i), level);
+      glowAcc = _mm_or_si128(glowAcc, _mm_andnot_si128(lit, level));
+   }
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(glowAcc, zero)) != 0xFFFF;
+}
+
+SIMD_TARGET("sse2")
+static void expandRowSse2(const uint8_t* levels, const uint32_t* palette, uint32_t* out, int scale)
+{
+   if(scale < 4)
+   {
+      expandRowScalar(levels, palette, out, scale);
+      return;
+   }
+
+   // whole vector stores, the tail of one pixel is overwritten by the
+   // next and the last one runs into the row padding
+   for(int x=0; x<RENDER_SOURCE_WIDTH; x++)
+   {
+      __m128i c = _mm_set1_epi32(palette[levels[x]]);
+      uint32_t* p = out + x*scale;
+      for(int k=0; k<scale; k+=4)
+         _mm_storeu_si128((__m128i*)(p+k), c);
+   }
+}
+
+SIMD_TARGET("sse2")
+static void darkenRowSse2(const uint32_t* in, uint32_t* out, int width)
+{
+   int i = 0;
+   __m128i mask = _mm_set1_epi32(0x7F7F7F7F);
+   for(; i+4<=width; i+=4)
+   {
+      __m128i c = _mm_loadu_si128((const __m128i*)(in+i));
+      _mm_storeu_si128((__m128i*)(out+i), _mm_and_si128(_mm_srli_epi32(c, 1), mask));
+   }
+   for(; i<width; i++)
+      out[i] = (in[i] >> 1) & 0x7F7F7F7F;
+}
+
+// AVX2, twice the width, unpackRows has nothing to gain over SSE2
+
+SIMD_TARGET("avx2")
+static void packRowsAvx2(const uint8_t* screen, uint64_t* rows)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      const uint8_t* in = screen + y*RENDER_SOURCE_WIDTH;
+      uint64_t bits = 0;
+      for(int x=0; x<RENDER_SOURCE_WIDTH; x+=32)
+      {
+         __m256i v = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(in+x)), 7);
+         bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(v) << x;
+      }
+      rows[y] = bits;
+   }
+}
+
+SIMD_TARGET("avx2")
+static void blendRowsAvx2(const uint64_t (*frames)[RENDER_SOURCE_HEIGHT], int count, uint64_t* out)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y+=4)
+   {
+      __m256i acc = _mm256_loadu_si256((const __m256i*)(frames[0]+y));
+      for(int f=1; f<count; f++)
+         acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(frames[f]+y)));
+      _mm256_storeu_si256((__m256i*)(out+y), acc);
+   }
+}
+
+SIMD_TARGET("avx2")
+static uint8_t updateLevelsAvx2(const uint8_t* litMask, uint8_t* levels, int persistence)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i decay = _mm256_set1_epi16(persistence);
+   __m256i glowAcc = zero;
+   for(int i=0; i<SOURCE_PIXELS; i+=32)
+   {
+      __m256i lit = _mm256_loadu_si256((const __m256i*)(litMask+i));
+      __m256i old = _mm256_loadu_si256((const __m256i*)(levels+i));
+      __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(old, zero), decay), 8);
+      __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(old, zero), decay), 8);
+      __m256i level = _mm256_max_epu8(lit, _mm256_packus_epi16(lo, hi));
+      _mm256_storeu_si256((__m256i*)(levels+i), level);
+      glowAcc = _mm256_or_si256(glowAcc, _mm256_andnot_si256(lit, level));
+   }
+   return !_mm256_testz_si256(glowAcc, glowAcc);
+}
+
+SIMD_TARGET("avx2")
+static void expandRowAvx2(const uint8_t* levels, const uint32_t* palette, uint32_t* out, int scale)
+{
+   if(scale < 8)
+   {
+      expandRowSse2(levels, palette, out, scale);
+      return;
+   }
+
+   for(int x=0; x<RENDER_SOURCE_WIDTH; x++)
+   {
+      __m256i c = _mm256_set1_epi32(palette[levels[x]]);
+      uint32_t* p = out + x*scale;
+      for(int k=0; k<scale; k+=8)
+         _mm256_storeu_si256((__m256i*)(p+k), c);
+   }
+}
+
+SIMD_TARGET("avx2")
+static void darkenRowAvx2(const uint32_t* in, uint32_t* out, int width)
+{
+   int i = 0;
+   __m256i mask = _mm256_set1_epi32(0x7F7F7F7F);
+   for(; i+8<=width; i+=8)
+   {
+      __m256i c = _mm256_loadu_si256((const __m256i*)(in+i));
+      _mm256_storeu_si256((__m256i*)(out+i), _mm256_and_si256(_mm256_srli_epi32(c, 1), mask));
+   }
+   for(; i<width; i++)
+      out[i] = (in[i] >> 1) & 0x7F7F7F7F;
+}
+
+// AVX-512 with BW, a source row is exactly one vector and mask registers
+// do the bit packing both ways in one instruction
+
+SIMD_TARGET("avx512f,avx512bw")
+static void packRowsAvx512(const uint8_t* screen, uint64_t* rows)
+{
+   const __m512i one = _mm512_set1_epi8(1);
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      __m512i v = _mm512_loadu_si512((const void*)(screen + y*RENDER_SOURCE_WIDTH));
+      rows[y] = _mm512_test_epi8_mask(v, one);
+   }
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void blendRowsAvx512(const uint64_t (*frames)[RENDER_SOURCE_HEIGHT], int count, uint64_t* out)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y+=8)
+   {
+      __m512i acc = _mm512_loadu_si512((const void*)(frames[0]+y));
+      for(int f=1; f<count; f++)
+         acc = _mm512_or_si512(acc, _mm512_loadu_si512((const void*)(frames[f]+y)));
+      _mm512_storeu_si512((void*)(out+y), acc);
+   }
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void unpackRowsAvx512(const uint64_t* rows, uint8_t* lit)
+{
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+      _mm512_storeu_si512((void*)(lit + y*RENDER_SOURCE_WIDTH), _mm512_movm_epi8(rows[y]));
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static uint8_t updateLevelsAvx512(const uint8_t* litMask, uint8_t* levels, int persistence)
+{
+   __m512i zero = _mm512_setzero_si512();
+   __m512i decay = _mm512_set1_epi16(persistence);
+   __m512i glowAcc = zero;
+   for(int i=0; i<SOURCE_PIXELS; i+=64)
+   {
+      __m512i lit = _mm512_loadu_si512((const void*)(litMask+i));
+      __m512i old = _mm512_loadu_si512((const void*)(levels+i));
+      __m512i lo = _mm512_srli_epi16(_mm512_mullo_epi16(_mm512_unpacklo_epi8(old, zero), decay), 8);
+      __m512i hi = _mm512_srli_epi16(_mm512_mullo_epi16(_mm512_unpackhi_epi8(old, zero), decay), 8);
+      __m512i level = _mm512_max_epu8(lit, _mm512_packus_epi16(lo, hi));
+      _mm512_storeu_si512((void*)(levels+i), level);
+      glowAcc = _mm512_or_si512(glowAcc, _mm512_andnot_si512(lit, level));
+   }
+   return _mm512_test_epi8_mask(glowAcc, glowAcc) != 0;
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void expandRowAvx512(const uint8_t* levels, const uint32_t* palette, uint32_t* out, int scale)
+{
+   if(scale < 16)
+   {
+      expandRowAvx2(levels, palette, out, scale);
+      return;
+   }
+
+   for(int x=0; x<RENDER_SOURCE_WIDTH; x++)
+   {
+      __m512i c = _mm512_set1_epi32(palette[levels[x]]);
+      uint32_t* p = out + x*scale;
+      for(int k=0; k<scale; k+=16)
+         _mm512_storeu_si512((void*)(p+k), c);
+   }
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void darkenRowAvx512(const uint32_t* in, uint32_t* out, int width)
+{
+   int i = 0;
+   __m512i mask = _mm512_set1_epi32(0x7F7F7F7F);
+   for(; i+16<=width; i+=16)
+   {
+      __m512i c = _mm512_loadu_si512((const void*)(in+i));
+      _mm512_storeu_si512((void*)(out+i), _mm512_and_si512(_mm512_srli_epi32(c, 1), mask));
+   }
+   for(; i<width; i++)
+      out[i] = (in[i] >> 1) & 0x7F7F7F7F;
+}
+
+static const RenderKernels kernelTable[SIMD_LEVELS] =
+{
+   { packRowsScalar, blendRowsScalar, unpackRowsScalar, updateLevelsScalar, expandRowScalar, darkenRowScalar },
+   { packRowsSse2, blendRowsSse2, unpackRowsSse2, updateLevelsSse2, expandRowSse2, darkenRowSse2 },
+   { packRowsAvx2, blendRowsAvx2, unpackRowsSse2, updateLevelsAvx2, expandRowAvx2, darkenRowAvx2 },
+   { packRowsAvx512, blendRowsAvx512, unpackRowsAvx512, updateLevelsAvx512, expandRowAvx512, darkenRowAvx512 }
+};
+
+#else
+
+static const RenderKernels scalarKernels =
+   { packRowsScalar, blendRowsScalar, unpackRowsScalar, updateLevelsScalar, expandRowScalar, darkenRowScalar };
+
+static const RenderKernels kernelTable[SIMD_LEVELS] =
+   { scalarKernels, scalarKernels, scalarKernels, scalarKernels };
+
+#endif //SIMD_X86
+
+Renderer::Renderer() :
+   kernels(&kernelTable[simdLevel()]),
+   level(simdLevel()),
+   pixels(NULL),
+   width(0),
+   height(0),
+   pitch(0),
+   historyNext(0),
+   steadyFrames(0)
+{
+   memset(history, 0, sizeof(history));
+   memset(levels, 0, sizeof(levels));
+   memset(palette, 0, sizeof(palette));
+}
+
+Renderer::~Renderer()
+{
+   free(pixels);
+}
+
+void Renderer::setOptions(const RenderOptions& options)
+{
+   this->options = options;
+   if(this->options.scale < 1)
+      this->options.scale = 1;
+   if(this->options.persistence < 0)
+      this->options.persistence = 0;
+   if(this->options.persistence > 255)
+      this->options.persistence = 255;
+   if(this->options.blendFrames < 1)
+      this->options.blendFrames = 1;
+   if(this->options.blendFrames > RENDER_MAX_BLEND)
+      this->options.blendFrames = RENDER_MAX_BLEND;
+}
+
+void Renderer::setSimdLevel(SimdLevel level)
+{
+   if(level > simdDetect())
+      level = simdDetect();
+   this->level = level;
+   kernels = &kernelTable[level];
+}
+
+bool Renderer::init()
+{
+   free(pixels);
+   pixels = NULL;
+
+   width = RENDER_SOURCE_WIDTH*options.scale;
+   height = RENDER_SOURCE_HEIGHT*options.scale;
+   pitch = width + RENDER_ROW_PAD;
+   if(posix_memalign((void**)&pixels, 64, (size_t)pitch*height*sizeof(uint32_t)) != 0)
+   {
+      pixels = NULL;
+      return false;
+   }
+   memset(pixels, 0, (size_t)pitch*height*sizeof(uint32_t));
+
+   // level 0 is the background, 255 the foreground, blended per channel
+   for(int level=0; level<256; level++)
+   {
+      uint32_t c = 0;
+      for(int shift=0; shift<24; shift+=8)
+      {
+         int fg = (options.foreground >> shift) & 0xFF;
+         int bg = (options.background >> shift) & 0xFF;
+         c |= (uint32_t)((bg*(255-level) + fg*level) / 255) << shift;
+      }
+      palette[level] = c;
+   }
+   memset(levels, 0, sizeof(levels));
+   memset(history, 0, sizeof(history));
+   historyNext = 0;
+   steadyFrames = 0;
+   return true;
+}
+
+bool Renderer::render(const uint8_t* screen)
+{
+   if(pixels == NULL)
+      return false;
+
+   // frame history, the output only settles once all kept frames agree
+   int blend = options.blendFrames;
+   uint64_t* newest = history[historyNext];
+   uint64_t* previous = history[(historyNext+blend-1)%blend];
+   kernels->packRows(screen, newest);
+   if(memcmp(newest, previous, sizeof(history[0])) == 0)
+      ++steadyFrames;
+   else
+      steadyFrames = 0;
+   historyNext = (historyNext+1)%blend;
+
+   uint64_t blended[RENDER_SOURCE_HEIGHT];
+   kernels->blendRows(history, blend, blended);
+   kernels->unpackRows(blended, lit);
+
+   bool changing = kernels->updateLevels(lit, levels, options.persistence) || (steadyFrames < blend-1);
+
+   int scale = options.scale;
+   for(int y=0; y<RENDER_SOURCE_HEIGHT; y++)
+   {
+      uint32_t* first = pixels + (size_t)y*scale*pitch;
+      kernels->expandRow(levels + y*RENDER_SOURCE_WIDTH, palette, first, scale);
+
+      for(int k=1; k<scale; k++)
+      {
+         uint32_t* row = first + (size_t)k*pitch;
+         if(options.scanlines && (k == scale-1))
+            kernels->darkenRow(first, row, width);
+         else
+            memcpy(row, first, width*sizeof(uint32_t));
+      }
+   }
+   return changing;
+}
+
+// xorshift, the self test wants the same inputs on every run
+static uint32_t testRandom(uint32_t* state)
+{
+   uint32_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return *state = x;
+}
+
+static void testFill(uint8_t* data, size_t size, uint32_t* state)
+{
+   for(size_t i=0; i<size; i++)
+      data[i] = testRandom(state);
+}
+
+// runs one variant against the scalar kernels, returns the first kernel
+// that disagrees or NULL
+static const char* testKernels(const RenderKernels& test, uint32_t* state)
+{
+   const RenderKernels& ref = kernelTable[SIMD_SCALAR];
+
+   for(int round=0; round<64; round++)
+   {
+      uint8_t screen[SOURCE_PIXELS];
+      testFill(screen, sizeof(screen), state);
+      uint64_t rowsRef[RENDER_SOURCE_HEIGHT];
+      uint64_t rowsTest[RENDER_SOURCE_HEIGHT];
+      ref.packRows(screen, rowsRef);
+      test.packRows(screen, rowsTest);
+      if(memcmp(rowsRef, rowsTest, sizeof(rowsRef)) != 0)
+         return "packRows";
+
+      uint64_t frames[RENDER_MAX_BLEND][RENDER_SOURCE_HEIGHT];
+      testFill((uint8_t*)frames, sizeof(frames), state);
+      int count = 1 + round%RENDER_MAX_BLEND;
+      ref.blendRows(frames, count, rowsRef);
+      test.blendRows(frames, count, rowsTest);
+      if(memcmp(rowsRef, rowsTest, sizeof(rowsRef)) != 0)
+         return "blendRows";
+
+      uint8_t litRef[SOURCE_PIXELS];
+      uint8_t litTest[SOURCE_PIXELS];
+      ref.unpackRows(rowsRef, litRef);
+      test.unpackRows(rowsRef, litTest);
+      if(memcmp(litRef, litTest, sizeof(litRef)) != 0)
+         return "unpackRows";
+
+      uint8_t levelsRef[SOURCE_PIXELS];
+      uint8_t levelsTest[SOURCE_PIXELS];
+      testFill(levelsRef, sizeof(levelsRef), state);
+      memcpy(levelsTest, levelsRef, sizeof(levelsRef));
+      int persistence = (round == 0) ? 0 : testRandom(state)%256;
+      uint8_t glowRef = ref.updateLevels(litRef, levelsRef, persistence);
+      uint8_t glowTest = test.updateLevels(litRef, levelsTest, persistence);
+      if((memcmp(levelsRef, levelsTest, sizeof(levelsRef)) != 0) || ((glowRef != 0) != (glowTest != 0)))
+         return "updateLevels";
+
+      // every scale up to past the widest store, plus the row padding the
+      // vector stores may spill into
+      uint32_t palette[256];
+      testFill((uint8_t*)palette, sizeof(palette), state);
+      int scale = 1 + round%24;
+      int width = RENDER_SOURCE_WIDTH*scale;
+      uint32_t rowRef[RENDER_SOURCE_WIDTH*24 + RENDER_ROW_PAD];
+      uint32_t rowTest[RENDER_SOURCE_WIDTH*24 + RENDER_ROW_PAD];
+      ref.expandRow(levelsRef, palette, rowRef, scale);
+      test.expandRow(levelsRef, palette, rowTest, scale);
+      if(memcmp(rowRef, rowTest, width*sizeof(uint32_t)) != 0)
+         return "expandRow";
+
+      // odd widths for the scalar tails
+      width -= testRandom(state)%16;
+      uint32_t darkRef[RENDER_SOURCE_WIDTH*24];
+      uint32_t darkTest[RENDER_SOURCE_WIDTH*24];
+      ref.darkenRow(rowRef, darkRef, width);
+      test.darkenRow(rowRef, darkTest, width);
+      if(memcmp(darkRef, darkTest, width*sizeof(uint32_t)) != 0)
+         return "darkenRow";
+   }
+   return NULL;
+}
+
+// renders the same random frames with both renderers
+static bool testFrames(Renderer& ref, Renderer& test, uint32_t* state)
+{
+   for(int frame=0; frame<32; frame++)
+   {
+      // sparse screens so blending and fading have something to show
+      uint8_t screen[SOURCE_PIXELS];
+      for(int i=0; i<SOURCE_PIXELS; i++)
+         screen[i] = (testRandom(state)%4) == 0;
+      if(ref.render(screen) != test.render(screen))
+         return false;
+
+      for(int y=0; y<ref.getHeight(); y++)
+      {
+         const uint32_t* a = ref.getPixels() + (size_t)y*ref.getPitch();
+         const uint32_t* b = test.getPixels() + (size_t)y*test.getPitch();
+         if(memcmp(a, b, ref.getWidth()*sizeof(uint32_t)) != 0)
+            return false;
+      }
+   }
+   return true;
+}
+
+int Renderer::selfTest()
+{
+   int failures = 0;
+   for(int level=SIMD_SSE2; level<=simdDetect(); level++)
+   {
+      uint32_t state = 0x2545F491;
+      const char* failed = testKernels(kernelTable[level], &state);
+
+      for(int scale=1; (failed == NULL) && (scale<=17); scale+=4)
+      {
+         RenderOptions options;
+         options.scale = scale;
+         options.scanlines = (scale%2) != 0;
+         options.persistence = (scale*37)%256;
+         options.blendFrames = 1 + scale%RENDER_MAX_BLEND;
+
+         Renderer ref;
+         Renderer test;
+         ref.setSimdLevel(SIMD_SCALAR);
+         test.setSimdLevel((SimdLevel)level);
+         ref.setOptions(options);
+         test.setOptions(options);
+         if(!ref.init() || !test.init() || !testFrames(ref, test, &state))
+            failed = "render";
+      }
+
+      if(failed != NULL)
+      {
+         printf("render %s: %s differs from scalar\n", simdName((SimdLevel)level), failed);
+         failures++;
+      }
+      else
+         printf("render %s: ok\n", simdName((SimdLevel)level));
+   }
+   return failures;
+}
@@ -0,0 +1,121 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+
+#include "simd.h"
+
+// the machine screen size, kept here so the renderer does not need machine.h
+#define RENDER_SOURCE_WIDTH  64
+#define RENDER_SOURCE_HEIGHT 32
+
+// most frames the flicker filter can blend
+#define RENDER_MAX_BLEND 8
+
+// spare pixels after each output row, the fill kernels store whole vectors
+// (up to 16 pixels) and may run past the last pixel
+#define RENDER_ROW_PAD 16
+
+struct RenderOptions
+{
+   int scale;            // integer upscale factor
+   bool scanlines;       // darken the last row of every scaled pixel row
+   int persistence;      // phosphor decay per frame, 0 off .. 255 slowest
+   int blendFrames;      // pixels lit in any of the last N frames show
+   uint32_t foreground;  // 0x00RRGGBB
+   uint32_t background;
+
+   RenderOptions() :
+      scale(10),
+      scanlines(false),
+      persistence(0),
+      blendFrames(2),
+      foreground(0xFFFFFF),
+      background(0x000000)
+   {
+   }
+};
+
+struct RenderKernels;
+
+/**
+ * Software renderer, turns the 64x32 screen into a 32 bit XRGB pixel
+ * buffer that the backends present with a single blit.
+ *
+ * Meant to be called once per frame. The last blendFrames screens are
+ * kept bit packed (one uint64_t per row) and OR'ed together, so sprites
+ * that games erase and redraw with XOR stay visible instead of flickering.
+ *
+ * Each source row is expanded once with vector stores and the other rows
+ * of the scaled pixel are plain copies, so a frame is 32 expansion loops
+ * and a few hundred memcpy()s instead of one fill call per pixel. The
+ * kernels come in scalar, SSE2, AVX2 and AVX-512 variants, a renderer
+ * uses simdLevel() unless told otherwise.
+ */
+class Renderer
+{
+public:
+   Renderer();
+   ~Renderer();
+
+   void setOptions(const RenderOptions& options);
+   const RenderOptions& getOptions() const { return options; }
+
+   /**
+    * Switches kernel variants, capped to what the cpu supports.
+    */
+   void setSimdLevel(SimdLevel level);
+   SimdLevel getSimdLevel() const { return level; }
+
+   /**
+    * Allocates the pixel buffer for the current options.
+    */
+   bool init();
+
+   /**
+    * Renders a frame.
+    *
+    * @param[in] screen: RENDER_SOURCE_WIDTH*RENDER_SOURCE_HEIGHT 0/1 pixels
+    * @return true while blended frames or ghosts still change the output,
+    *         so the caller keeps presenting though the screen is the same
+    */
+   bool render(const uint8_t* screen);
+
+   const uint32_t* getPixels() const { return pixels; }
+   int getWidth() const { return width; }
+   int getHeight() const { return height; }
+   int getPitch() const { return pitch; } // in pixels
+
+   /**
+    * Cross-checks every kernel variant this cpu runs against the scalar
+    * ones, kernel by kernel and over whole frames, and prints a line per
+    * variant.
+    *
+    * @return the number of variants that disagree
+    */
+   static int selfTest();
+
+private:
+   RenderOptions options;
+   const RenderKernels* kernels;
+   SimdLevel level;
+
+   uint32_t* pixels;
+   int width;
+   int height;
+   int pitch;
+
+   // the last blendFrames screens, bit n of a row is pixel n
+   uint64_t history[RENDER_MAX_BLEND][RENDER_SOURCE_HEIGHT];
+   int historyNext;
+   int steadyFrames;
+
+   // blended screen, 0xFF per lit pixel
+   uint8_t lit[RENDER_SOURCE_WIDTH*RENDER_SOURCE_HEIGHT];
+
+   // phosphor level per source pixel and its colour
+   uint8_t levels[RENDER_SOURCE_WIDTH*RENDER_SOURCE_HEIGHT];
+   uint32_t palette[256];
+};
+
+#endif //RENDER_H
@@ -0,0 +1,70 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Lock free single producer / single consumer ring buffer.
+ *
+ * One thread may only call push(), the other only pop(). SIZE must be a
+ * power of two. The indices run freely and are masked on access, so the
+ * whole SIZE is usable.
+ */
+template<typename T, uint32_t SIZE>
+class SpscRing
+{
+public:
+   SpscRing() : head(0), tail(0) {}
+
+   /**
+    * Copies up to count items in, returns how many fit.
+    */
+   uint32_t push(const T* items, uint32_t count)
+   {
+      uint32_t t = tail.load(std::memory_order_relaxed);
+      uint32_t h = head.load(std::memory_order_acquire);
+      uint32_t room = SIZE - (t - h);
+      if(count > room)
+         count = room;
+      for(uint32_t i=0; i<count; i++)
+         buffer[(t+i) & (SIZE-1)] = items[i];
+      tail.store(t+count, std::memory_order_release);
+      return count;
+   }
+
+   /**
+    * Copies up to count items out, returns how many were available.
+    */
+   uint32_t pop(T* items, uint32_t count)
+   {
+      uint32_t h = head.load(std::memory_order_relaxed);
+      uint32_t t = tail.load(std::memory_order_acquire);
+      uint32_t avail = t - h;
+      if(count > avail)
+         count = avail;
+      for(uint32_t i=0; i<count; i++)
+         items[i] = buffer[(h+i) & (SIZE-1)];
+      head.store(h+count, std::memory_order_release);
+      return count;
+   }
+
+   // items currently queued, approximate while the other side is running
+   uint32_t size() const
+   {
+      return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+   }
+
+   uint32_t capacity() const { return SIZE; }
+
+private:
+   static_assert((SIZE & (SIZE-1)) == 0, "ring size must be a power of two");
+
+   T buffer[SIZE];
+
+   // producer and consumer indices live on their own cache lines
+   alignas(64) std::atomic<uint32_t> head;
+   alignas(64) std::atomic<uint32_t> tail;
+};
+
+#endif //RINGBUFFER_H
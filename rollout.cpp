@@ -0,0 +1,203 @@
+#include "rollout.h"
+#include "hash.h"
+#include <stdio.h> //snprintf()
+#include <math.h> //sqrt()
+
+RolloutEngine::RolloutEngine(int threads) :
+   pool(threads),
+   machines(pool.size()),
+   registry(NULL),
+   runId(0),
+   base(NULL),
+   options(NULL),
+   results(NULL)
+{
+   workers.resize(pool.size());
+   for(size_t i=0; i<workers.size(); i++)
+   {
+      workers[i].machine = NULL;
+      workers[i].loaded = 0;
+   }
+}
+
+RolloutEngine::~RolloutEngine()
+{
+   for(size_t i=0; i<workers.size(); i++)
+   {
+      if(workers[i].machine != NULL)
+         machines.release(workers[i].machine);
+   }
+}
+
+void RolloutEngine::setMetrics(MetricsRegistry* registry)
+{
+   // machines taken later are published when they are taken
+   this->registry = registry;
+   for(size_t i=0; i<workers.size(); i++)
+   {
+      if(workers[i].machine != NULL)
+         publish(workers[i].machine, (int)i);
+   }
+}
+
+void RolloutEngine::publish(Machine* mach, int worker)
+{
+   char name[32];
+   snprintf(name, sizeof(name), "rollout-%d", worker);
+   mach->setMetrics(registry->add(name));
+}
+
+Machine* RolloutEngine::workerMachine(int worker)
+{
+   Machine* mach = machines.acquire();
+   mach->setHeadless(true);
+   if(registry != NULL)
+      publish(mach, worker);
+   return mach;
+}
+
+void RolloutEngine::run(const MachineState&           base,
+                        const RolloutOptions&         options,
+                        RolloutStats*                 stats,
+                        std::vector<RolloutResult>*   results)
+{
+   this->base = &base;
+   this->options = &options;
+   this->results = results;
+   if(results != NULL)
+      results->resize(options.rollouts);
+
+   // a new run id makes every worker load the (maybe new) base in full,
+   // machines taken from the pool during the run start from it
+   machines.setTemplate(base);
+   ++runId;
+   for(size_t i=0; i<workers.size(); i++)
+   {
+      Worker& w = workers[i];
+      w.count = 0;
+      w.sum = 0;
+      w.sumSquares = 0;
+      w.minScore = INT64_MAX;
+      w.maxScore = INT64_MIN;
+      w.frames = 0;
+      w.survivors = 0;
+   }
+
+   pool.parallelFor(options.rollouts, rolloutTask, this);
+
+   int count = 0;
+   int64_t sum = 0;
+   __int128 sumSquares = 0;
+   int64_t frames = 0;
+   stats->minScore = 0;
+   stats->maxScore = 0;
+   stats->survivors = 0;
+   for(size_t i=0; i<workers.size(); i++)
+   {
+      const Worker& w = workers[i];
+      if(w.count == 0)
+         continue;
+      if((count == 0) || (w.minScore < stats->minScore))
+         stats->minScore = w.minScore;
+      if((count == 0) || (w.maxScore > stats->maxScore))
+         stats->maxScore = w.maxScore;
+      count += w.count;
+      sum += w.sum;
+      sumSquares += w.sumSquares;
+      frames += w.frames;
+      stats->survivors += w.survivors;
+   }
+
+   stats->rollouts = count;
+   stats->meanScore = (count > 0) ? (double)sum/count : 0;
+   stats->meanFrames = (count > 0) ? (double)frames/count : 0;
+   // n*sum(x^2) - sum(x)^2 is exact in 128 bits
+   double spread = (count > 0) ? (double)((__int128)count*sumSquares - (__int128)sum*sum) : 0;
+   stats->scoreStddev = (count > 0) ? sqrt(spread)/count : 0;
+}
+
+void RolloutEngine::rolloutTask(void* context, int worker, size_t index)
+{
+   RolloutEngine* engine = (RolloutEngine*) context;
+   Worker& w = engine->workers[worker];
+
+   if(w.loaded != engine->runId)
+   {
+      // a machine from the pool comes reset to the base already
+      if(w.machine == NULL)
+         w.machine = engine->workerMachine(worker);
+      else
+         w.machine->reset(*engine->base);
+      w.machine->setTiming(engine->options->timing);
+      w.loaded = engine->runId;
+   }
+   else
+      w.machine->revertState(*engine->base);
+
+   RolloutResult r = engine->rollout(*w.machine, index);
+   if(engine->results != NULL)
+      (*engine->results)[index] = r;
+
+   ++w.count;
+   w.sum += r.score;
+   w.sumSquares += (__int128)r.score*r.score;
+   if(r.score < w.minScore)
+      w.minScore = r.score;
+   if(r.score > w.maxScore)
+      w.maxScore = r.score;
+   w.frames += r.frames;
+   if(r.frames == engine->options->frames)
+      ++w.survivors;
+}
+
+// xorshift64*
+static uint64_t nextRandom(uint64_t* state)
+{
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return x * 0x2545F4914F6CDD1DULL;
+}
+
+RolloutResult RolloutEngine::rollout(Machine& mach, size_t index)
+{
+   const RolloutOptions& opt = *options;
+
+   // the stream depends only on the seed and the rollout index
+   uint64_t rng = hashKey(opt.seed ^ hashKey(index)) | 1;
+   if(opt.reseed)
+      mach.setSeed((uint32_t)nextRandom(&rng));
+
+   // no key or one of the allowed keys, all equally likely
+   int choices = __builtin_popcount(opt.keys) + 1;
+   int hold = (opt.holdFrames > 0) ? opt.holdFrames : 1;
+   int life = (opt.lifeAddress >= 0) ? mach.getByte(opt.lifeAddress) : 0;
+
+   RolloutResult r;
+   r.frames = 0;
+   while(r.frames < opt.frames)
+   {
+      if((r.frames % hold) == 0)
+      {
+         int pick = nextRandom(&rng) % choices;
+         uint16_t mask = 0;
+         for(uint16_t keys=opt.keys; pick>0; keys&=keys-1, pick--)
+            mask = keys & -keys;
+         mach.setKeys(mask);
+      }
+
+      if(!mach.runFrame())
+         break;
+      ++r.frames;
+
+      if((opt.lifeAddress >= 0) && (mach.getByte(opt.lifeAddress) < life))
+         break;
+   }
+
+   r.score = 0;
+   for(size_t i=0; i<opt.score.size(); i++)
+      r.score += (int64_t)opt.score[i].weight * mach.getByte(opt.score[i].address);
+   return r;
+}
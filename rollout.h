@@ -0,0 +1,134 @@
+#ifndef ROLLOUT_H
+#define ROLLOUT_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "machine.h"
+#include "threadpool.h"
+#include "machinepool.h"
+#include "metrics.h"
+
+// one term of the score, weight * the byte at address, so multi byte
+// counters use weights 256,1 and BCD digits 100,10,1
+struct RolloutScore
+{
+   uint16_t address;
+   int32_t weight;
+};
+
+struct RolloutOptions
+{
+   int rollouts;           // M rollouts per run()
+   int frames;             // D frames per rollout at most
+   int holdFrames;         // frames the random policy holds a key choice
+   uint16_t keys;          // keys the policy may press, bit n is key n
+   std::vector<RolloutScore> score;
+   int lifeAddress;        // a rollout ends when this byte drops, -1 never
+   bool reseed;            // fresh CXNN seed per rollout, else the base's
+   uint64_t seed;          // rollout n always plays the same inputs
+   TimingModel timing;
+
+   RolloutOptions() :
+      rollouts(1000),
+      frames(60),
+      holdFrames(4),
+      keys(0xFFFF),
+      lifeAddress(-1),
+      reseed(true),
+      seed(1),
+      timing(TIMING_FAST)
+   {
+   }
+};
+
+struct RolloutResult
+{
+   int64_t score;          // at the end of the rollout
+   int frames;             // survived, D unless the life byte dropped or the program stopped
+};
+
+struct RolloutStats
+{
+   int rollouts;
+   int64_t minScore;
+   int64_t maxScore;
+   double meanScore;
+   double scoreStddev;
+   double meanFrames;
+   int survivors;          // rollouts that ran all D frames
+};
+
+/**
+ * Monte-Carlo rollouts from a machine state: M independent runs of up to D
+ * frames with random key presses, spread over a ThreadPool.
+ *
+ * Every worker owns one headless Machine, taken from a MachinePool by the
+ * worker's own thread on its first rollout, so its pages sit on that
+ * thread's numa node. The pool's template is the base, so a machine taken
+ * mid run starts from it. The first rollout of a run resets the machine
+ * to the base state in full, later ones revertState() to it, copying back
+ * only the memory pages the previous rollout wrote, so the base is shared
+ * read only and a clone costs a few hundred bytes. Statistics are summed
+ * per worker in integers and merged at the end, so the results do not
+ * depend on the thread count or on which worker ran what.
+ */
+class RolloutEngine
+{
+public:
+   /**
+    * @param[in] threads: Worker count, 0 for one per online cpu
+    */
+   RolloutEngine(int threads);
+   ~RolloutEngine();
+
+   /**
+    * Runs options.rollouts rollouts from base.
+    *
+    * @param[out] stats:   Aggregate over all rollouts
+    * @param[out] results: Per rollout, by index, may be NULL
+    */
+   void run(const MachineState&           base,
+            const RolloutOptions&         options,
+            RolloutStats*                 stats,
+            std::vector<RolloutResult>*   results = NULL);
+
+   int threads() const { return pool.size(); }
+
+   /**
+    * Publishes every worker machine as machine "rollout-N".
+    */
+   void setMetrics(MetricsRegistry* registry);
+
+private:
+   struct alignas(64) Worker
+   {
+      Machine* machine;
+      unsigned loaded;     // run the machine holds the base of
+      int count;
+      int64_t sum;
+      __int128 sumSquares;
+      int64_t minScore;
+      int64_t maxScore;
+      int64_t frames;
+      int survivors;
+   };
+
+   static void rolloutTask(void* context, int worker, size_t index);
+   RolloutResult rollout(Machine& mach, size_t index);
+   Machine* workerMachine(int worker);
+   void publish(Machine* mach, int worker);
+
+   ThreadPool pool;
+   MachinePool machines;
+   std::vector<Worker> workers;
+   MetricsRegistry* registry;
+
+   // the current run
+   unsigned runId;
+   const MachineState* base;
+   const RolloutOptions* options;
+   std::vector<RolloutResult>* results;
+};
+
+#endif //ROLLOUT_H
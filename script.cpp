@@ -0,0 +1,608 @@
+#include "script.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h> //strtoul()
+#include <string.h> //strchr()
+#include <strings.h> //strcasecmp() strncasecmp()
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
+
+InputScript::InputScript() :
+   lineNo(0),
+   next(0),
+   waiting(false),
+   deadline(0),
+   keys(0)
+{
+}
+
+// words of a line up to a comment, operators, ':' and ';' on their own
+// and commas as spaces, so "RAM[0x2F0]==3" is three words
+static void splitWords(const char* text, std::vector<std::string>* words)
+{
+   words->clear();
+   const char* p = text;
+   while((*p != '\0') && (*p != '#'))
+   {
+      if(isspace((unsigned char)*p) || (*p == ','))
+      {
+         ++p;
+         continue;
+      }
+      const char* start = p;
+      if(strchr("=!<>", *p) != NULL)
+      {
+         while((*p != '\0') && (strchr("=!<>", *p) != NULL))
+            ++p;
+      }
+      else if((*p == ':') || (*p == ';'))
+         ++p;
+      else
+      {
+         while((*p != '\0') && !isspace((unsigned char)*p) && (strchr("=!<>:;,#", *p) == NULL))
+            ++p;
+      }
+      words->push_back(std::string(start, p-start));
+   }
+}
+
+static bool parseNumber(const std::string& word, uint32_t* value)
+{
+   char* end;
+   unsigned long n = strtoul(word.c_str(), &end, 0);
+   if(word.empty() || (*end != '\0') || (n > UINT32_MAX))
+      return false;
+   *value = n;
+   return true;
+}
+
+static bool isWord(const std::vector<std::string>& words, size_t pos, const char* word)
+{
+   return (pos < words.size()) && (strcasecmp(words[pos].c_str(), word) == 0);
+}
+
+bool InputScript::load(const char* path)
+{
+   FILE* f = fopen(path, "r");
+   if(f == NULL)
+   {
+      fprintf(stderr, "Cannot open script %s\n", path);
+      return false;
+   }
+   this->path = path;
+   ops.clear();
+
+   char line[256];
+   lineNo = 0;
+   bool ok = true;
+   std::vector<std::string> words;
+   while(ok && (fgets(line, sizeof(line), f) != NULL))
+   {
+      ++lineNo;
+      splitWords(line, &words);
+
+      // commands of a line are separated by ;
+      size_t first = 0;
+      for(size_t i=0; ok && (i<=words.size()); i++)
+      {
+         if((i < words.size()) && (words[i] != ";"))
+            continue;
+         std::vector<std::string> command(words.begin()+first, words.begin()+i);
+         ok = parseLine(command);
+         first = i+1;
+      }
+   }
+   fclose(f);
+   if(!ok)
+      return false;
+
+   // pair every end with its repeat
+   std::vector<int> open;
+   for(size_t i=0; i<ops.size(); i++)
+   {
+      if(ops[i].kind == SCRIPT_REPEAT)
+         open.push_back(i);
+      else if(ops[i].kind == SCRIPT_END)
+      {
+         if(open.empty())
+         {
+            error(ops[i].line, "end without repeat");
+            return false;
+         }
+         ops[i].match = open.back();
+         ops[open.back()].match = i;
+         open.pop_back();
+      }
+   }
+   if(!open.empty())
+   {
+      error(ops[open.back()].line, "repeat without end");
+      return false;
+   }
+   return true;
+}
+
+bool InputScript::parseLine(const std::vector<std::string>& words)
+{
+   Op op;
+   op.line = lineNo;
+   op.count = 0;
+   op.keys = 0;
+   op.match = -1;
+
+   size_t pos = 0;
+   if(isWord(words, 0, "frame"))
+   {
+      if((words.size() < 3) || !parseNumber(words[1], &op.count) || (words[2] != ":"))
+      {
+         error(lineNo, "expected frame N:");
+         return false;
+      }
+      op.kind = SCRIPT_AT;
+      ops.push_back(op);
+      op.count = 0;
+      pos = 3;
+   }
+   if(pos == words.size())
+      return true;
+
+   const char* command = words[pos++].c_str();
+   if(strcasecmp(command, "press") == 0)
+   {
+      // hold, wait and release
+      if(!parseKeys(words, &pos, &op.keys))
+         return false;
+      uint32_t frames = 1;
+      if(isWord(words, pos, "for"))
+      {
+         if((pos+1 >= words.size()) || !parseNumber(words[pos+1], &frames) || (frames == 0))
+         {
+            error(lineNo, "expected for N frames");
+            return false;
+         }
+         pos += 2;
+         if(isWord(words, pos, "frame") || isWord(words, pos, "frames"))
+            ++pos;
+      }
+      op.kind = SCRIPT_HOLD;
+      ops.push_back(op);
+      op.kind = SCRIPT_WAIT;
+      op.count = frames;
+      ops.push_back(op);
+      op.kind = SCRIPT_RELEASE;
+      op.count = 0;
+   }
+   else if(strcasecmp(command, "hold") == 0)
+   {
+      op.kind = SCRIPT_HOLD;
+      if(!parseKeys(words, &pos, &op.keys))
+         return false;
+   }
+   else if(strcasecmp(command, "release") == 0)
+   {
+      op.kind = SCRIPT_RELEASE;
+      if(isWord(words, pos, "all"))
+      {
+         op.keys = 0xFFFF;
+         ++pos;
+      }
+      else if(!parseKeys(words, &pos, &op.keys))
+         return false;
+   }
+   else if((strcasecmp(command, "wait") == 0) && isWord(words, pos, "until"))
+   {
+      op.kind = SCRIPT_UNTIL;
+      ++pos;
+      if(!parseCondition(words, &pos, &op.tests))
+         return false;
+      if(isWord(words, pos, "within"))
+      {
+         if((pos+1 >= words.size()) || !parseNumber(words[pos+1], &op.count) || (op.count == 0))
+         {
+            error(lineNo, "expected within N frames");
+            return false;
+         }
+         pos += 2;
+         if(isWord(words, pos, "frame") || isWord(words, pos, "frames"))
+            ++pos;
+      }
+   }
+   else if(strcasecmp(command, "wait") == 0)
+   {
+      op.kind = SCRIPT_WAIT;
+      if((pos >= words.size()) || !parseNumber(words[pos], &op.count))
+      {
+         error(lineNo, "expected wait N or wait until");
+         return false;
+      }
+      ++pos;
+      if(isWord(words, pos, "frame") || isWord(words, pos, "frames"))
+         ++pos;
+   }
+   else if(strcasecmp(command, "assert") == 0)
+   {
+      op.kind = SCRIPT_ASSERT;
+      if(!parseCondition(words, &pos, &op.tests))
+         return false;
+   }
+   else if(strcasecmp(command, "print") == 0)
+   {
+      op.kind = SCRIPT_PRINT;
+      for(; pos<words.size(); pos++)
+      {
+         Operand operand;
+         if(!parseOperand(words[pos], &operand))
+         {
+            error(lineNo, "cannot print %s", words[pos].c_str());
+            return false;
+         }
+         op.operands.push_back(operand);
+      }
+      if(op.operands.empty())
+      {
+         error(lineNo, "nothing to print");
+         return false;
+      }
+   }
+   else if(strcasecmp(command, "repeat") == 0)
+   {
+      // no count repeats for ever, until the frame limit
+      op.kind = SCRIPT_REPEAT;
+      if(pos < words.size())
+      {
+         if(!parseNumber(words[pos], &op.count) || (op.count == 0))
+         {
+            error(lineNo, "expected repeat [N]");
+            return false;
+         }
+         ++pos;
+      }
+   }
+   else if(strcasecmp(command, "end") == 0)
+      op.kind = SCRIPT_END;
+   else if(strcasecmp(command, "stop") == 0)
+      op.kind = SCRIPT_STOP;
+   else
+   {
+      error(lineNo, "unknown command %s", command);
+      return false;
+   }
+
+   if(pos != words.size())
+   {
+      error(lineNo, "unexpected %s", words[pos].c_str());
+      return false;
+   }
+   ops.push_back(op);
+   return true;
+}
+
+bool InputScript::parseKeys(const std::vector<std::string>& words, size_t* pos, uint16_t* keys)
+{
+   // hex digits, one word each
+   *keys = 0;
+   for(; *pos<words.size(); (*pos)++)
+   {
+      const std::string& word = words[*pos];
+      if((word.size() != 1) || !isxdigit((unsigned char)word[0]))
+         break;
+      *keys |= 1 << strtoul(word.c_str(), NULL, 16);
+   }
+   if(*keys == 0)
+   {
+      error(lineNo, "expected keys 0-f");
+      return false;
+   }
+   return true;
+}
+
+bool InputScript::parseCondition(const std::vector<std::string>& words, size_t* pos, std::vector<Test>* tests)
+{
+   static const char* compares[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+   while(true)
+   {
+      if(*pos+3 > words.size())
+      {
+         error(lineNo, "expected a comparison");
+         return false;
+      }
+      Test test;
+      if(!parseOperand(words[*pos], &test.lhs) || !parseOperand(words[*pos+2], &test.rhs))
+      {
+         error(lineNo, "bad operand in %s %s %s", words[*pos].c_str(), words[*pos+1].c_str(),
+               words[*pos+2].c_str());
+         return false;
+      }
+      int cmp = 0;
+      while((cmp < 6) && (words[*pos+1] != compares[cmp]))
+         ++cmp;
+      if(cmp == 6)
+      {
+         error(lineNo, "bad comparison %s", words[*pos+1].c_str());
+         return false;
+      }
+      test.cmp = (Compare)cmp;
+      tests->push_back(test);
+      *pos += 3;
+
+      if(!isWord(words, *pos, "and"))
+         return true;
+      ++(*pos);
+   }
+}
+
+bool InputScript::parseOperand(const std::string& word, Operand* operand)
+{
+   static const struct { const char* name; OperandKind kind; } names[] =
+   {
+      { "i", OPERAND_I },
+      { "pc", OPERAND_PC },
+      { "sp", OPERAND_SP },
+      { "dt", OPERAND_DT },
+      { "st", OPERAND_ST },
+      { "frame", OPERAND_FRAME },
+      { "keys", OPERAND_KEYS }
+   };
+
+   operand->value = 0;
+   if(parseNumber(word, &operand->value))
+   {
+      operand->kind = OPERAND_NUMBER;
+      return true;
+   }
+   if((word.size() > 5) && (strncasecmp(word.c_str(), "ram[", 4) == 0) && (word[word.size()-1] == ']'))
+   {
+      operand->kind = OPERAND_RAM;
+      return parseNumber(word.substr(4, word.size()-5), &operand->value) &&
+             (operand->value < MEMORY_SIZE);
+   }
+   if((word.size() == 2) && ((word[0] == 'v') || (word[0] == 'V')) && isxdigit((unsigned char)word[1]))
+   {
+      operand->kind = OPERAND_V;
+      operand->value = strtoul(word.c_str()+1, NULL, 16);
+      return true;
+   }
+   for(size_t i=0; i<sizeof(names)/sizeof(names[0]); i++)
+   {
+      if(strcasecmp(word.c_str(), names[i].name) == 0)
+      {
+         operand->kind = names[i].kind;
+         return true;
+      }
+   }
+   return false;
+}
+
+void InputScript::error(int line, const char* format, ...) const
+{
+   fprintf(stderr, "%s:%i: ", path.c_str(), line);
+   va_list args;
+   va_start(args, format);
+   vfprintf(stderr, format, args);
+   va_end(args);
+   fprintf(stderr, "\n");
+}
+
+uint32_t InputScript::read(const Machine& mach, const Operand& operand) const
+{
+   switch(operand.kind)
+   {
+      case OPERAND_NUMBER: return operand.value;
+      case OPERAND_RAM:    return mach.memory[operand.value];
+      case OPERAND_V:      return mach.v[operand.value];
+      case OPERAND_I:      return mach.I;
+      case OPERAND_PC:     return mach.pc;
+      case OPERAND_SP:     return mach.sp;
+      case OPERAND_DT:     return mach.delayTimer;
+      case OPERAND_ST:     return mach.soundTimer;
+      case OPERAND_FRAME:  return mach.frames;
+      case OPERAND_KEYS:   return mach.getKeys();
+   }
+   return 0;
+}
+
+bool InputScript::holds(const Machine& mach, const std::vector<Test>& tests) const
+{
+   for(size_t i=0; i<tests.size(); i++)
+   {
+      uint32_t lhs = read(mach, tests[i].lhs);
+      uint32_t rhs = read(mach, tests[i].rhs);
+      bool now = false;
+      switch(tests[i].cmp)
+      {
+         case CMP_EQ: now = (lhs == rhs); break;
+         case CMP_NE: now = (lhs != rhs); break;
+         case CMP_LT: now = (lhs <  rhs); break;
+         case CMP_LE: now = (lhs <= rhs); break;
+         case CMP_GT: now = (lhs >  rhs); break;
+         case CMP_GE: now = (lhs >= rhs); break;
+      }
+      if(!now)
+         return false;
+   }
+   return true;
+}
+
+std::string InputScript::describe(const Machine& mach, const std::vector<Operand>& operands) const
+{
+   static const char* names[] = { "", "RAM", "V", "I", "PC", "SP", "DT", "ST", "frame", "keys" };
+
+   std::string text;
+   char item[48];
+   for(size_t i=0; i<operands.size(); i++)
+   {
+      const Operand& o = operands[i];
+      uint32_t value = read(mach, o);
+      if(o.kind == OPERAND_NUMBER)
+         snprintf(item, sizeof(item), " %u", value);
+      else if(o.kind == OPERAND_RAM)
+         snprintf(item, sizeof(item), " RAM[0x%03X]=%u", o.value, value);
+      else if(o.kind == OPERAND_V)
+         snprintf(item, sizeof(item), " V%X=%u", o.value, value);
+      else
+         snprintf(item, sizeof(item), " %s=%u", names[o.kind], value);
+      text += item;
+   }
+   return text;
+}
+
+std::string InputScript::describe(const Machine& mach, const std::vector<Test>& tests) const
+{
+   // the values a failed condition saw, numbers left out
+   std::vector<Operand> operands;
+   for(size_t i=0; i<tests.size(); i++)
+   {
+      if(tests[i].lhs.kind != OPERAND_NUMBER)
+         operands.push_back(tests[i].lhs);
+      if(tests[i].rhs.kind != OPERAND_NUMBER)
+         operands.push_back(tests[i].rhs);
+   }
+   return describe(mach, operands);
+}
+
+bool InputScript::looping() const
+{
+   for(size_t i=0; i<next; i++)
+   {
+      if((ops[i].kind == SCRIPT_REPEAT) && (ops[i].count == 0) && (next <= (size_t)ops[i].match))
+         return true;
+   }
+   return false;
+}
+
+InputScript::Outcome InputScript::advance(Machine& mach)
+{
+   // commands up to the first that waits for a frame
+   uint32_t frame = mach.getFrame();
+   for(int steps=0; steps<SCRIPT_STEPS_PER_FRAME; steps++)
+   {
+      if(next >= ops.size())
+         return OUTCOME_DONE;
+
+      const Op& op = ops[next];
+      switch(op.kind)
+      {
+         case SCRIPT_AT:
+            if(frame < op.count)
+               return OUTCOME_RUNNING;
+            break;
+         case SCRIPT_WAIT:
+            if(!waiting)
+            {
+               deadline = frame + op.count;
+               waiting = true;
+            }
+            if(frame < deadline)
+               return OUTCOME_RUNNING;
+            waiting = false;
+            break;
+         case SCRIPT_UNTIL:
+            if(holds(mach, op.tests))
+            {
+               waiting = false;
+               break;
+            }
+            if(op.count == 0)
+               return OUTCOME_RUNNING;
+            if(!waiting)
+            {
+               deadline = frame + op.count;
+               waiting = true;
+            }
+            if(frame < deadline)
+               return OUTCOME_RUNNING;
+            error(op.line, "wait until timed out at frame %u:%s", frame, describe(mach, op.tests).c_str());
+            return OUTCOME_FAILED;
+         case SCRIPT_HOLD:
+            keys |= op.keys;
+            mach.setKeys(keys);
+            break;
+         case SCRIPT_RELEASE:
+            keys &= ~op.keys;
+            mach.setKeys(keys);
+            break;
+         case SCRIPT_ASSERT:
+            if(!holds(mach, op.tests))
+            {
+               error(op.line, "assert failed at frame %u:%s", frame, describe(mach, op.tests).c_str());
+               return OUTCOME_FAILED;
+            }
+            break;
+         case SCRIPT_PRINT:
+            printf("frame %u:%s\n", frame, describe(mach, op.operands).c_str());
+            break;
+         case SCRIPT_REPEAT:
+            passes[next] = op.count;
+            break;
+         case SCRIPT_END:
+            // back to the first command of the loop while passes are left
+            if((ops[op.match].count == 0) || (--passes[op.match] > 0))
+            {
+               next = op.match+1;
+               continue;
+            }
+            break;
+         case SCRIPT_STOP:
+            return OUTCOME_DONE;
+      }
+      ++next;
+   }
+
+   error(ops[next].line, "%i commands without waiting for a frame", SCRIPT_STEPS_PER_FRAME);
+   return OUTCOME_FAILED;
+}
+
+bool InputScript::run(Machine&  mach,
+                      uint8_t*  program,
+                      int       length,
+                      uint32_t  frameLimit)
+{
+   mach.load(program, length);
+   next = 0;
+   waiting = false;
+   keys = 0;
+   mach.setKeys(0);
+   passes.assign(ops.size(), 0);
+
+   struct timespec t0, t1;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+
+   // the script sees the machine between frames, before each one
+   Outcome outcome = OUTCOME_RUNNING;
+   while(outcome == OUTCOME_RUNNING)
+   {
+      outcome = advance(mach);
+      if(outcome != OUTCOME_RUNNING)
+         break;
+      if((frameLimit != 0) && (mach.getFrame() >= frameLimit))
+      {
+         // a script that loops for ever ends at the limit, any other is
+         // still waiting for something that did not happen
+         if(looping())
+            outcome = OUTCOME_DONE;
+         else
+         {
+            const Op& op = ops[next];
+            std::string seen = (op.kind == SCRIPT_UNTIL) ? describe(mach, op.tests) : std::string();
+            error(op.line, "frame limit %u reached before the script ended:%s", frameLimit,
+                  seen.empty() ? " still waiting" : seen.c_str());
+            outcome = OUTCOME_FAILED;
+         }
+         break;
+      }
+      if(!mach.runFrame())
+      {
+         error(ops[next].line, "program stopped at frame %u", mach.getFrame());
+         outcome = OUTCOME_FAILED;
+      }
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   double seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+   printf("script: %s at frame %u, %" PRIu64 " instructions in %.3f s, %.0f frames/s\n",
+          (outcome == OUTCOME_FAILED) ? "failed" : "passed", mach.getFrame(), mach.getInstructions(),
+          seconds, (seconds > 0) ? mach.getFrame()/seconds : 0);
+   return outcome != OUTCOME_FAILED;
+}
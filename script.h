@@ -0,0 +1,150 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+
+// most script commands run between two frames before the script is
+// taken to loop without waiting
+#define SCRIPT_STEPS_PER_FRAME 100000
+
+/**
+ * Scripted keypad input for unattended headless runs, e.g. soak and speed
+ * tests that play through a game in seconds.
+ *
+ * A script is a text file of commands, one per line or several separated
+ * by ;, # starts a comment:
+ *
+ *    frame 120: press 5 for 3 frames; wait until RAM[0x2F0]==3
+ *    wait until RAM[0x2F0] == 4 within 600
+ *    repeat 50
+ *       press 4 6 for 10
+ *       wait 20
+ *    end
+ *    assert V3 >= 2 and DT == 0
+ *    print RAM[0x2F0] V3 frame
+ *
+ * Commands run in order between frames, each one waits for the previous
+ * to finish: "frame N:" waits for frame N first, press holds keys (hex
+ * 0-f) for some frames (default 1) and releases them, hold and release
+ * [all] change keys without waiting, wait N waits N frames, wait until
+ * waits for a condition (failing after within N frames when given),
+ * assert fails unless a condition holds, repeat [N] ... end loops N times
+ * or for ever, stop ends the script. Conditions compare RAM[ADDR], V0-VF,
+ * I, PC, SP, DT, ST, frame, keys and numbers with == != < <= > >=, joined
+ * by and.
+ */
+class InputScript
+{
+public:
+   InputScript();
+
+   /**
+    * Parses a script, errors go to stderr as path:line: message.
+    *
+    * @param[in] path: The script file
+    */
+   bool load(const char* path);
+
+   /**
+    * Loads a program and runs it headless under the script at full speed
+    * until the script ends or fails, the program stops, or the frame
+    * limit. Prints a summary line.
+    *
+    * @param[in] frameLimit: Frames at most, 0 no limit
+    * @return false when a wait timed out, an assert failed, the program
+    *         stopped or the frame limit came before the script ended.
+    *         Reaching the limit inside a repeat without a count passes.
+    */
+   bool run(Machine&  mach,
+            uint8_t*  program,
+            int       length,
+            uint32_t  frameLimit);
+
+private:
+   enum ScriptOpKind
+   {
+      SCRIPT_AT,        // wait for an absolute frame
+      SCRIPT_WAIT,      // wait some frames
+      SCRIPT_UNTIL,     // wait for a condition, at most some frames
+      SCRIPT_HOLD,
+      SCRIPT_RELEASE,
+      SCRIPT_ASSERT,
+      SCRIPT_PRINT,
+      SCRIPT_REPEAT,
+      SCRIPT_END,
+      SCRIPT_STOP
+   };
+
+   enum OperandKind
+   {
+      OPERAND_NUMBER,
+      OPERAND_RAM,
+      OPERAND_V,
+      OPERAND_I,
+      OPERAND_PC,
+      OPERAND_SP,
+      OPERAND_DT,
+      OPERAND_ST,
+      OPERAND_FRAME,
+      OPERAND_KEYS
+   };
+
+   enum Compare { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+   struct Operand
+   {
+      OperandKind kind;
+      uint32_t value;      // the number, address or register
+   };
+
+   struct Test
+   {
+      Operand lhs;
+      Compare cmp;
+      Operand rhs;
+   };
+
+   struct Op
+   {
+      ScriptOpKind kind;
+      int line;
+      uint32_t count;      // frames, loop count (0 for ever) or frame
+      uint16_t keys;
+      int match;           // the matching repeat / end
+      std::vector<Test> tests;      // and-ed
+      std::vector<Operand> operands; // print
+   };
+
+   enum Outcome { OUTCOME_RUNNING, OUTCOME_DONE, OUTCOME_FAILED };
+
+   bool parseLine(const std::vector<std::string>& words);
+   bool parseKeys(const std::vector<std::string>& words, size_t* pos, uint16_t* keys);
+   bool parseCondition(const std::vector<std::string>& words, size_t* pos, std::vector<Test>* tests);
+   bool parseOperand(const std::string& word, Operand* operand);
+   void error(int line, const char* format, ...) const;
+
+   Outcome advance(Machine& mach);
+   bool looping() const;
+   uint32_t read(const Machine& mach, const Operand& operand) const;
+   bool holds(const Machine& mach, const std::vector<Test>& tests) const;
+   std::string describe(const Machine& mach, const std::vector<Operand>& operands) const;
+   std::string describe(const Machine& mach, const std::vector<Test>& tests) const;
+
+   std::string path;
+   std::vector<Op> ops;
+   int lineNo;          // being parsed
+
+   // where the script is, the frame the current wait ends, the keys held
+   // and each repeat's remaining passes
+   size_t next;
+   bool waiting;
+   uint32_t deadline;
+   uint16_t keys;
+   std::vector<uint32_t> passes;
+};
+
+#endif //SCRIPT_H
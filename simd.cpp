@@ -0,0 +1,50 @@
+#include "simd.h"
+#include <string.h> //strcmp()
+
+static const char* names[SIMD_LEVELS] = { "scalar", "sse2", "avx2", "avx512" };
+
+static SimdLevel cap = SIMD_AVX512;
+
+SimdLevel simdDetect()
+{
+#ifdef SIMD_X86
+   // libgcc also checks that the OS saves the wider registers
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+      return SIMD_AVX512;
+   if(__builtin_cpu_supports("avx2"))
+      return SIMD_AVX2;
+   if(__builtin_cpu_supports("sse2"))
+      return SIMD_SSE2;
+#endif
+   return SIMD_SCALAR;
+}
+
+SimdLevel simdLevel()
+{
+   static SimdLevel detected = simdDetect();
+   return (detected < cap) ? detected : cap;
+}
+
+void simdCap(SimdLevel level)
+{
+   cap = level;
+}
+
+const char* simdName(SimdLevel level)
+{
+   return ((level >= 0) && (level < SIMD_LEVELS)) ? names[level] : "unknown";
+}
+
+bool simdParse(const char* name, SimdLevel* level)
+{
+   for(int i=0; i<SIMD_LEVELS; i++)
+   {
+      if(strcmp(name, names[i]) == 0)
+      {
+         *level = (SimdLevel)i;
+         return true;
+      }
+   }
+   return false;
+}
@@ -0,0 +1,39 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// x86 builds compile every kernel variant with per function target
+// attributes and pick one at startup, other targets only get scalar code
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+enum SimdLevel
+{
+   SIMD_SCALAR,
+   SIMD_SSE2,
+   SIMD_AVX2,
+   SIMD_AVX512, // F + BW
+   SIMD_LEVELS
+};
+
+/**
+ * The best level this cpu (and OS) supports, from cpuid.
+ */
+SimdLevel simdDetect();
+
+/**
+ * The level kernels should use: the detected one unless capped lower.
+ */
+SimdLevel simdLevel();
+
+/**
+ * Caps the level, e.g. to compare against an older host. Levels above what
+ * the cpu supports are ignored.
+ */
+void simdCap(SimdLevel level);
+
+const char* simdName(SimdLevel level);
+bool simdParse(const char* name, SimdLevel* level);
+
+#endif //SIMD_H
@@ -0,0 +1,168 @@
+#include "threadpool.h"
+#include <unistd.h> //sysconf()
+
+ThreadPool::ThreadPool(int threads) :
+   batch(0),
+   busy(0),
+   quit(false),
+   task(NULL),
+   context(NULL)
+{
+   if(threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if(threads < 1)
+      threads = 1;
+
+   pthread_mutex_init(&lock, NULL);
+   pthread_cond_init(&start, NULL);
+   pthread_cond_init(&done, NULL);
+
+   ranges.resize(threads);
+   for(int i=0; i<threads; i++)
+   {
+      pthread_mutex_init(&ranges[i].lock, NULL);
+      ranges[i].begin = 0;
+      ranges[i].end = 0;
+   }
+
+   workers.resize(threads);
+   for(int i=0; i<threads; i++)
+   {
+      workers[i].pool = this;
+      workers[i].id = i;
+      pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]);
+   }
+}
+
+ThreadPool::~ThreadPool()
+{
+   pthread_mutex_lock(&lock);
+   quit = true;
+   pthread_cond_broadcast(&start);
+   pthread_mutex_unlock(&lock);
+   for(size_t i=0; i<workers.size(); i++)
+      pthread_join(workers[i].thread, NULL);
+
+   for(size_t i=0; i<ranges.size(); i++)
+      pthread_mutex_destroy(&ranges[i].lock);
+   pthread_cond_destroy(&done);
+   pthread_cond_destroy(&start);
+   pthread_mutex_destroy(&lock);
+}
+
+void ThreadPool::parallelFor(size_t count, Task task, void* context)
+{
+   if(count == 0)
+      return;
+
+   // even shares, the first count%workers get one more
+   size_t threads = workers.size();
+   size_t begin = 0;
+   for(size_t i=0; i<threads; i++)
+   {
+      size_t share = count/threads + ((i < count%threads) ? 1 : 0);
+      ranges[i].begin = begin;
+      ranges[i].end = begin + share;
+      begin += share;
+   }
+
+   pthread_mutex_lock(&lock);
+   this->task = task;
+   this->context = context;
+   busy = threads;
+   ++batch;
+   pthread_cond_broadcast(&start);
+   while(busy > 0)
+      pthread_cond_wait(&done, &lock);
+   pthread_mutex_unlock(&lock);
+}
+
+void* ThreadPool::workerMain(void* arg)
+{
+   Worker* worker = (Worker*) arg;
+   worker->pool->work(worker->id);
+   return NULL;
+}
+
+void ThreadPool::work(int id)
+{
+   unsigned seen = 0;
+   for(;;)
+   {
+      pthread_mutex_lock(&lock);
+      while((batch == seen) && !quit)
+         pthread_cond_wait(&start, &lock);
+      if(quit)
+      {
+         pthread_mutex_unlock(&lock);
+         return;
+      }
+      seen = batch;
+      pthread_mutex_unlock(&lock);
+
+      size_t index;
+      while(next(id, &index))
+         task(context, id, index);
+
+      pthread_mutex_lock(&lock);
+      if(--busy == 0)
+         pthread_cond_signal(&done);
+      pthread_mutex_unlock(&lock);
+   }
+}
+
+bool ThreadPool::next(int id, size_t* index)
+{
+   Range& own = ranges[id];
+   pthread_mutex_lock(&own.lock);
+   if(own.begin < own.end)
+   {
+      *index = own.begin++;
+      pthread_mutex_unlock(&own.lock);
+      return true;
+   }
+   pthread_mutex_unlock(&own.lock);
+
+   // steal the back half of the fullest range
+   for(;;)
+   {
+      int victim = -1;
+      size_t most = 0;
+      for(size_t i=0; i<ranges.size(); i++)
+      {
+         if((int)i == id)
+            continue;
+         pthread_mutex_lock(&ranges[i].lock);
+         size_t left = ranges[i].end - ranges[i].begin;
+         pthread_mutex_unlock(&ranges[i].lock);
+         if(left > most)
+         {
+            victim = i;
+            most = left;
+         }
+      }
+      if(victim < 0)
+         return false;
+
+      Range& other = ranges[victim];
+      pthread_mutex_lock(&other.lock);
+      size_t left = other.end - other.begin;
+      if(left == 0) // emptied since the look
+      {
+         pthread_mutex_unlock(&other.lock);
+         continue;
+      }
+      size_t mid = other.end - (left+1)/2;
+      size_t stolenEnd = other.end;
+      other.end = mid;
+      pthread_mutex_unlock(&other.lock);
+
+      // run the first stolen index now, keep the rest as the own range
+      pthread_mutex_lock(&own.lock);
+      own.begin = mid+1;
+      own.end = stolenEnd;
+      pthread_mutex_unlock(&own.lock);
+      *index = mid;
+      return true;
+   }
+}
@@ -0,0 +1,74 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * Persistent worker threads for batches of equal independent tasks.
+ *
+ * parallelFor() splits the index range evenly over the workers. Each
+ * worker takes indices from the front of its own range and, once that is
+ * empty, steals the back half of the fullest other range, so a worker
+ * that drew slow tasks (long rollouts) does not hold the batch up. Every
+ * range has its own lock, taken for one pop or one steal, and the
+ * threads stay alive between batches so a batch costs two wake ups and
+ * no thread creation.
+ */
+class ThreadPool
+{
+public:
+   /**
+    * @param[in] threads: Worker count, 0 for one per online cpu
+    */
+   ThreadPool(int threads);
+   ~ThreadPool();
+
+   typedef void (*Task)(void* context, int worker, size_t index);
+
+   /**
+    * Runs task(context, worker, index) for every index below count and
+    * returns when all are done. worker is below size(), tasks of one
+    * worker never run concurrently.
+    */
+   void parallelFor(size_t count, Task task, void* context);
+
+   int size() const { return (int)workers.size(); }
+
+private:
+   // one worker's share of the batch, padded so the locks of different
+   // workers do not share a cache line
+   struct alignas(64) Range
+   {
+      pthread_mutex_t lock;
+      size_t begin;
+      size_t end;
+   };
+
+   struct Worker
+   {
+      ThreadPool* pool;
+      int id;
+      pthread_t thread;
+   };
+
+   static void* workerMain(void* arg);
+   void work(int id);
+   bool next(int id, size_t* index);
+
+   std::vector<Worker> workers;
+   std::vector<Range> ranges;
+
+   // batch hand over, guarded by lock
+   pthread_mutex_t lock;
+   pthread_cond_t start;
+   pthread_cond_t done;
+   unsigned batch;
+   int busy;
+   bool quit;
+   Task task;
+   void* context;
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,135 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include "opcodes.h"
+
+enum TimingModel
+{
+   TIMING_FAST,   // every instruction costs the same, CYCLES_PER_FRAME a frame
+   TIMING_VIP     // cosmac vip machine cycles, DXYN waits for the display
+};
+
+// instructions executed per timer tick, one tick is one frame
+#define CYCLES_PER_FRAME 25
+
+// cosmac vip: 1.76064 MHz, 8 clocks per machine cycle, a 60 Hz display
+// interrupt. Of the 3668 cycles of a frame the 1861's DMA takes 1024 (8
+// bytes for each of 128 lines) and the interrupt routine about 46, the
+// interpreter gets the rest.
+#define VIP_CYCLES_PER_FRAME  3668
+#define VIP_DMA_CYCLES        1024
+#define VIP_INTERRUPT_CYCLES  46
+#define VIP_FRAME_CYCLES      (VIP_CYCLES_PER_FRAME - VIP_DMA_CYCLES - VIP_INTERRUPT_CYCLES)
+
+/**
+ * Timing policies for Machine::stepTimed(). A policy says how many cycles
+ * an executed instruction costs, how many cycles a frame (one timer tick)
+ * lasts, whether DXYN waits for the next display interrupt, and how long a
+ * cycle is in real time. Each one gets its own specialization of the step,
+ * so the fast one compiles to a plain instruction counter.
+ */
+struct FastTiming
+{
+   static const int frameCycles = CYCLES_PER_FRAME;
+   static const bool displayWait = false;
+
+   // usleep() per instruction when running in real time
+   static constexpr double cycleMicros = 500.0;
+
+   static int cost(const OpInfo&, const uint8_t*, uint16_t, uint16_t) { return 1; }
+};
+
+/**
+ * Machine cycles of the original VIP interpreter, fetch and decode
+ * included, rounded from the published per-instruction timings. Costs
+ * that depend on operands are charged when the instruction is done: taken
+ * skips, sprite rows (sprites off a byte boundary take a shift per row)
+ * and the registers FX55/FX65 copy.
+ */
+struct VipTiming
+{
+   static const int frameCycles = VIP_FRAME_CYCLES;
+   static const bool displayWait = true;
+
+   // only the interpreter's cycles are slept, so they stretch over the
+   // DMA and interrupt time too and a frame lasts 1/60 s
+   static constexpr double cycleMicros = 1000000.0 / (60.0*VIP_FRAME_CYCLES);
+
+   /**
+    * @param[in] op:   The executed instruction
+    * @param[in] v:    The registers after it
+    * @param[in] from: Its address
+    * @param[in] to:   The pc after it
+    */
+   static int cost(const OpInfo& op, const uint8_t* v, uint16_t from, uint16_t to)
+   {
+      static const uint16_t base[OP_KINDS] =
+      {
+         12,   // OP_UNKNOWN, skipped
+         3078, // OP_CLS, clears the 256 display bytes a byte at a time
+         23,   // OP_RTN
+         23,   // OP_JMP
+         23,   // OP_JSR
+         12,   // OP_SKIP_EQ_IMM
+         12,   // OP_SKIP_NE_IMM
+         16,   // OP_SKIP_EQ
+         6,    // OP_MOV_IMM
+         10,   // OP_ADD_IMM
+         44,   // OP_MOV
+         44,   // OP_OR
+         44,   // OP_AND
+         44,   // OP_XOR
+         44,   // OP_ADD_C
+         44,   // OP_SUB_B
+         44,   // OP_SHR
+         44,   // OP_RSB
+         44,   // OP_SHL
+         16,   // OP_SKIP_NE
+         12,   // OP_MOV_I
+         23,   // OP_JMP_V0
+         36,   // OP_RAND
+         26,   // OP_SPRITE, plus the rows
+         16,   // OP_SKIP_PRESS
+         16,   // OP_SKIP_NPRESS
+         10,   // OP_AUDIO, no vip has it
+         10,   // OP_GDELAY
+         10,   // OP_KEY, waiting is idle time
+         10,   // OP_SDELAY
+         10,   // OP_SSOUND
+         19,   // OP_ADD_I
+         20,   // OP_FONT
+         204,  // OP_BCD
+         10,   // OP_PITCH, no vip has it
+         22,   // OP_STORE, plus the registers
+         22    // OP_LOAD, plus the registers
+      };
+      static_assert(sizeof(base)/sizeof(base[0]) == OP_KINDS, "one cost per opcode kind");
+
+      int cycles = base[op.kind];
+      switch(op.kind)
+      {
+         case OP_SKIP_EQ_IMM:
+         case OP_SKIP_NE_IMM:
+         case OP_SKIP_EQ:
+         case OP_SKIP_NE:
+         case OP_SKIP_PRESS:
+         case OP_SKIP_NPRESS:
+            if((uint16_t)(to - from) == 4)
+               cycles += 4;
+            break;
+         case OP_SPRITE:
+            cycles += op.n * (((v[op.x] & 7) == 0) ? 10 : 20);
+            break;
+         case OP_STORE:
+         case OP_LOAD:
+            cycles += 14 * (op.x + 1);
+            break;
+         default:
+            break;
+      }
+      return cycles;
+   }
+};
+
+#endif //TIMING_H
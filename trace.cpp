@@ -0,0 +1,603 @@
+#include "trace.h"
+#include <string.h> //memset() memcpy() memcmp()
+#include <unistd.h> //usleep() close()
+#include <fcntl.h> //open()
+#include <sys/mman.h> //mmap()
+#include <sys/stat.h> //fstat()
+
+static const char fileMagic[4] = { 'C', '8', 'T', 'R' };
+static const char chunkMagic[4] = { 'C', '8', 'C', 'K' };
+static const char indexMagic[4] = { 'C', '8', 'I', 'X' };
+
+// magic, payload size, first instruction, first frame, instructions,
+// previous pc, registers
+#define CHUNK_HEADER_BYTES (4+4+8+4+4+2+TRACE_REGS*2)
+#define INDEX_ENTRY_BYTES  (8+8+4+4+2+TRACE_PAGES/8*2)
+#define FOOTER_BYTES       (8+4+4)
+
+// registers stored as a single byte, the rest are varints
+static bool byteRegister(int reg)
+{
+   return (reg != TRACE_I) && (reg != TRACE_KEYS);
+}
+
+static void putLE(std::vector<uint8_t>& buf, uint64_t value, int bytes)
+{
+   for(int i=0; i<bytes; i++)
+      buf.push_back((value >> (i*8)) & 0xFF);
+}
+
+static uint64_t getLE(const uint8_t* p, int bytes)
+{
+   uint64_t value = 0;
+   for(int i=0; i<bytes; i++)
+      value |= (uint64_t)p[i] << (i*8);
+   return value;
+}
+
+static void putVarint(std::vector<uint8_t>& buf, uint32_t value)
+{
+   while(value >= 0x80)
+   {
+      buf.push_back((value&0x7F) | 0x80);
+      value >>= 7;
+   }
+   buf.push_back(value);
+}
+
+static void putZigzag(std::vector<uint8_t>& buf, int32_t value)
+{
+   putVarint(buf, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+// bounds checked reads for the decoder, set ok to false past the end
+struct ByteReader
+{
+   const uint8_t* p;
+   const uint8_t* end;
+   bool ok;
+
+   uint8_t byte()
+   {
+      if(p >= end)
+      {
+         ok = false;
+         return 0;
+      }
+      return *p++;
+   }
+
+   uint32_t varint()
+   {
+      uint32_t value = 0;
+      for(int shift=0; shift<35; shift+=7)
+      {
+         uint8_t b = byte();
+         value |= (uint32_t)(b&0x7F) << shift;
+         if(!(b & 0x80))
+            break;
+      }
+      return value;
+   }
+
+   int32_t zigzag()
+   {
+      uint32_t v = varint();
+      return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+   }
+};
+
+static void markPage(uint8_t* pages, uint16_t addr)
+{
+   int page = (addr & (MEMORY_SIZE-1)) >> TRACE_PAGE_SHIFT;
+   pages[page>>3] |= 1 << (page&7);
+}
+
+TraceRecorder::TraceRecorder(Machine& machine) :
+   mach(machine),
+   batched(0),
+   stalls(0),
+   ring(NULL),
+   closing(false),
+   running(false),
+   out(NULL),
+   bytes(0),
+   instructions(0),
+   frame(0),
+   inRecord(false),
+   recordPc(0),
+   recordOpcode(0),
+   prevPc(START_ADDRESS-2),
+   changed(0),
+   recordFrameEnd(false),
+   memWrites(0),
+   prevWrite(0),
+   chunkPrevPc(0)
+{
+   memset(&last, 0, sizeof(last));
+   memset(&regs, 0, sizeof(regs));
+   memset(&info, 0, sizeof(info));
+}
+
+TraceRecorder::~TraceRecorder()
+{
+   close();
+}
+
+bool TraceRecorder::open(const char* path)
+{
+   if(running)
+      return false;
+
+   out = fopen(path, "wb");
+   if(out == NULL)
+   {
+      fprintf(stderr, "Cannot open trace output %s\n", path);
+      return false;
+   }
+
+   std::vector<uint8_t> header(fileMagic, fileMagic+4);
+   putLE(header, TRACE_VERSION, 4);
+   fwrite(&header[0], 1, header.size(), out);
+   bytes = header.size();
+
+   ring = new SpscRing<Event, TRACE_RING_SIZE>();
+   closing = false;
+   running = true;
+   pthread_create(&thread, NULL, writerMain, this);
+   return true;
+}
+
+void TraceRecorder::close()
+{
+   if(!running)
+      return;
+
+   flushBatch();
+   closing.store(true, std::memory_order_release);
+   pthread_join(thread, NULL);
+   running = false;
+
+   if(inRecord)
+      finishRecord();
+   if(info.instructions > 0)
+      finishChunk();
+   writeIndex();
+   fclose(out);
+   out = NULL;
+
+   delete ring;
+   ring = NULL;
+}
+
+void TraceRecorder::end(bool frameEnd)
+{
+   TraceRegs now;
+   for(int i=0; i<GENERAL_REGS; i++)
+      now.r[TRACE_V0+i] = mach.v[i];
+   now.r[TRACE_I] = mach.I;
+   now.r[TRACE_SP] = mach.sp;
+   now.r[TRACE_DT] = mach.delayTimer;
+   now.r[TRACE_ST] = mach.soundTimer;
+   now.r[TRACE_KEYS] = mach.getKeys();
+
+   // diffing against the state after the previous instruction also picks up
+   // changes made from the debugger in between
+   for(int i=0; i<TRACE_REGS; i++)
+   {
+      if(now.r[i] != last.r[i])
+      {
+         Event e = { EVENT_REG, (uint8_t)i, 0, now.r[i] };
+         add(e);
+      }
+   }
+   last = now;
+
+   if(frameEnd)
+   {
+      Event e = { EVENT_FRAME, 0, 0, 0 };
+      add(e);
+      // keep the writer at most a frame behind
+      flushBatch();
+   }
+}
+
+void TraceRecorder::flushBatch()
+{
+   uint32_t done = 0;
+   while((int)done < batched)
+   {
+      done += ring->push(batch+done, batched-done);
+      if((int)done < batched)
+      {
+         ++stalls;
+         usleep(100);
+      }
+   }
+   batched = 0;
+}
+
+void* TraceRecorder::writerMain(void* arg)
+{
+   TraceRecorder* rec = (TraceRecorder*) arg;
+   Event events[4096];
+
+   for(;;)
+   {
+      // read the flag first so nothing pushed before close() is missed
+      bool done = rec->closing.load(std::memory_order_acquire);
+      uint32_t n = rec->ring->pop(events, 4096);
+      for(uint32_t i=0; i<n; i++)
+         rec->encode(events[i]);
+      if(n == 0)
+      {
+         if(done)
+            break;
+         usleep(1000);
+      }
+   }
+   return NULL;
+}
+
+void TraceRecorder::encode(const Event& e)
+{
+   switch(e.type)
+   {
+      case EVENT_EXEC:
+         if(inRecord)
+            finishRecord();
+         if(info.instructions == 0)
+         {
+            // a new chunk starts from the current state
+            info.firstInstruction = instructions;
+            info.firstFrame = frame;
+            info.opcodeNibbles = 0;
+            memset(info.pcPages, 0, sizeof(info.pcPages));
+            memset(info.writePages, 0, sizeof(info.writePages));
+            chunkRegs = regs;
+            chunkPrevPc = prevPc;
+            prevWrite = 0;
+            memset(chunkOpcodes, 0xFF, sizeof(chunkOpcodes));
+         }
+         inRecord = true;
+         recordPc = e.addr;
+         recordOpcode = e.value;
+         changed = 0;
+         recordFrameEnd = false;
+         memBytes.clear();
+         memWrites = 0;
+         break;
+
+      case EVENT_MEM:
+         putZigzag(memBytes, (int32_t)e.addr - prevWrite);
+         memBytes.push_back(e.value);
+         prevWrite = e.addr;
+         ++memWrites;
+         markPage(info.writePages, e.addr);
+         break;
+
+      case EVENT_REG:
+         regs.r[e.reg] = e.value;
+         changed |= 1 << e.reg;
+         break;
+
+      case EVENT_FRAME:
+         recordFrameEnd = true;
+         break;
+   }
+}
+
+void TraceRecorder::finishRecord()
+{
+   uint8_t flags = 0;
+   if(recordPc != (uint16_t)(prevPc+2))
+      flags |= TRACE_REC_PC;
+   if(chunkOpcodes[recordPc&(MEMORY_SIZE-1)] != recordOpcode)
+      flags |= TRACE_REC_OPCODE;
+   if(changed != 0)
+      flags |= TRACE_REC_REGS;
+   if(memWrites > 0)
+      flags |= TRACE_REC_MEM;
+   if(recordFrameEnd)
+      flags |= TRACE_REC_FRAME;
+
+   chunk.push_back(flags);
+   if(flags & TRACE_REC_PC)
+      putZigzag(chunk, (int32_t)recordPc - (prevPc+2));
+   if(flags & TRACE_REC_OPCODE)
+   {
+      chunk.push_back(recordOpcode >> 8);
+      chunk.push_back(recordOpcode & 0xFF);
+      chunkOpcodes[recordPc&(MEMORY_SIZE-1)] = recordOpcode;
+   }
+   if(flags & TRACE_REC_REGS)
+   {
+      putVarint(chunk, changed);
+      for(int i=0; i<TRACE_REGS; i++)
+      {
+         if(!(changed & (1<<i)))
+            continue;
+         if(byteRegister(i))
+            chunk.push_back(regs.r[i]);
+         else
+            putVarint(chunk, regs.r[i]);
+      }
+   }
+   if(flags & TRACE_REC_MEM)
+   {
+      putVarint(chunk, memWrites);
+      chunk.insert(chunk.end(), memBytes.begin(), memBytes.end());
+   }
+
+   info.opcodeNibbles |= 1 << (recordOpcode >> 12);
+   markPage(info.pcPages, recordPc);
+   prevPc = recordPc;
+   ++instructions;
+   if(recordFrameEnd)
+      ++frame;
+   inRecord = false;
+
+   if(++info.instructions == TRACE_CHUNK_INSTRUCTIONS)
+      finishChunk();
+}
+
+void TraceRecorder::finishChunk()
+{
+   std::vector<uint8_t> header(chunkMagic, chunkMagic+4);
+   putLE(header, chunk.size(), 4);
+   putLE(header, info.firstInstruction, 8);
+   putLE(header, info.firstFrame, 4);
+   putLE(header, info.instructions, 4);
+   putLE(header, chunkPrevPc, 2);
+   for(int i=0; i<TRACE_REGS; i++)
+      putLE(header, chunkRegs.r[i], 2);
+
+   info.offset = bytes;
+   fwrite(&header[0], 1, header.size(), out);
+   fwrite(&chunk[0], 1, chunk.size(), out);
+   bytes += header.size() + chunk.size();
+
+   index.push_back(info);
+   chunk.clear();
+   info.instructions = 0;
+}
+
+void TraceRecorder::writeIndex()
+{
+   std::vector<uint8_t> buf;
+   for(size_t i=0; i<index.size(); i++)
+   {
+      const TraceChunkInfo& c = index[i];
+      putLE(buf, c.offset, 8);
+      putLE(buf, c.firstInstruction, 8);
+      putLE(buf, c.firstFrame, 4);
+      putLE(buf, c.instructions, 4);
+      putLE(buf, c.opcodeNibbles, 2);
+      buf.insert(buf.end(), c.pcPages, c.pcPages+sizeof(c.pcPages));
+      buf.insert(buf.end(), c.writePages, c.writePages+sizeof(c.writePages));
+   }
+   putLE(buf, bytes, 8);
+   putLE(buf, index.size(), 4);
+   buf.insert(buf.end(), indexMagic, indexMagic+4);
+
+   fwrite(&buf[0], 1, buf.size(), out);
+   bytes += buf.size();
+}
+
+TraceReader::TraceReader() :
+   data(NULL),
+   size(0)
+{
+}
+
+TraceReader::~TraceReader()
+{
+   if(data != NULL)
+      munmap((void*)data, size);
+}
+
+bool TraceReader::open(const char* path)
+{
+   int fd = ::open(path, O_RDONLY);
+   struct stat st;
+   if((fd < 0) || (fstat(fd, &st) < 0))
+   {
+      fprintf(stderr, "Cannot open trace %s\n", path);
+      if(fd >= 0)
+         ::close(fd);
+      return false;
+   }
+
+   size = st.st_size;
+   if(size >= 8)
+      data = (const uint8_t*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   ::close(fd);
+   if((data == NULL) || (data == MAP_FAILED))
+   {
+      data = NULL;
+      fprintf(stderr, "%s: not a trace file\n", path);
+      return false;
+   }
+
+   if((memcmp(data, fileMagic, 4) != 0) || (getLE(data+4, 4) != TRACE_VERSION))
+   {
+      fprintf(stderr, "%s: not a version %i trace file\n", path, TRACE_VERSION);
+      return false;
+   }
+
+   if(readIndex())
+      return true;
+
+   fprintf(stderr, "%s: no index, the recorder did not finish, rebuilding\n", path);
+   return rebuildIndex();
+}
+
+bool TraceReader::readIndex()
+{
+   if((size < 8+FOOTER_BYTES) || (memcmp(data+size-4, indexMagic, 4) != 0))
+      return false;
+
+   uint64_t offset = getLE(data+size-FOOTER_BYTES, 8);
+   uint32_t chunks = getLE(data+size-FOOTER_BYTES+8, 4);
+   if((offset + (uint64_t)chunks*INDEX_ENTRY_BYTES + FOOTER_BYTES) != size)
+      return false;
+
+   const uint8_t* p = data+offset;
+   index.resize(chunks);
+   for(uint32_t i=0; i<chunks; i++)
+   {
+      TraceChunkInfo& c = index[i];
+      c.offset = getLE(p, 8);
+      c.firstInstruction = getLE(p+8, 8);
+      c.firstFrame = getLE(p+16, 4);
+      c.instructions = getLE(p+20, 4);
+      c.opcodeNibbles = getLE(p+24, 2);
+      memcpy(c.pcPages, p+26, sizeof(c.pcPages));
+      memcpy(c.writePages, p+26+sizeof(c.pcPages), sizeof(c.writePages));
+      p += INDEX_ENTRY_BYTES;
+   }
+   return true;
+}
+
+bool TraceReader::rebuildIndex()
+{
+   index.clear();
+   std::vector<TraceStep> steps;
+   uint64_t offset = 8;
+   while((offset + CHUNK_HEADER_BYTES) <= size)
+   {
+      const uint8_t* p = data+offset;
+      uint32_t payload = getLE(p+4, 4);
+      if((memcmp(p, chunkMagic, 4) != 0) || ((offset + CHUNK_HEADER_BYTES + payload) > size))
+         break; // torn write at the end
+
+      TraceChunkInfo c;
+      memset(&c, 0, sizeof(c));
+      c.offset = offset;
+      c.firstInstruction = getLE(p+8, 8);
+      c.firstFrame = getLE(p+16, 4);
+      c.instructions = getLE(p+20, 4);
+      index.push_back(c);
+
+      if(!decodeChunk(index.size()-1, steps))
+      {
+         index.pop_back();
+         break;
+      }
+
+      TraceChunkInfo& info = index.back();
+      for(size_t i=0; i<steps.size(); i++)
+      {
+         info.opcodeNibbles |= 1 << (steps[i].opcode >> 12);
+         markPage(info.pcPages, steps[i].pc);
+         for(int w=0; w<steps[i].writes; w++)
+            markPage(info.writePages, steps[i].writeAddr[w]);
+      }
+      offset += CHUNK_HEADER_BYTES + payload;
+   }
+   return true;
+}
+
+uint64_t TraceReader::instructionCount() const
+{
+   if(index.empty())
+      return 0;
+   return index.back().firstInstruction + index.back().instructions;
+}
+
+long TraceReader::findChunk(uint64_t instruction) const
+{
+   size_t lo = 0;
+   size_t hi = index.size();
+   while(lo < hi)
+   {
+      size_t mid = (lo+hi)/2;
+      if(instruction < index[mid].firstInstruction)
+         hi = mid;
+      else if(instruction >= index[mid].firstInstruction + index[mid].instructions)
+         lo = mid+1;
+      else
+         return mid;
+   }
+   return -1;
+}
+
+bool TraceReader::decodeChunk(size_t n, std::vector<TraceStep>& steps) const
+{
+   steps.clear();
+   const TraceChunkInfo& c = index[n];
+   const uint8_t* p = data+c.offset;
+   uint32_t payload = getLE(p+4, 4);
+
+   TraceStep step;
+   memset(&step, 0, sizeof(step));
+   step.instruction = c.firstInstruction;
+   step.frame = c.firstFrame;
+   uint16_t prevPc = getLE(p+24, 2);
+   for(int i=0; i<TRACE_REGS; i++)
+      step.regs.r[i] = getLE(p+26+i*2, 2);
+
+   int32_t opcodes[MEMORY_SIZE];
+   memset(opcodes, 0xFF, sizeof(opcodes));
+   uint16_t prevWrite = 0;
+
+   ByteReader in = { p+CHUNK_HEADER_BYTES, p+CHUNK_HEADER_BYTES+payload, true };
+   for(uint32_t k=0; (k<c.instructions) && in.ok; k++)
+   {
+      uint8_t flags = in.byte();
+
+      step.pc = prevPc+2;
+      if(flags & TRACE_REC_PC)
+         step.pc += in.zigzag();
+
+      if(flags & TRACE_REC_OPCODE)
+      {
+         step.opcode = in.byte() << 8;
+         step.opcode |= in.byte();
+         opcodes[step.pc&(MEMORY_SIZE-1)] = step.opcode;
+      }
+      else if(opcodes[step.pc&(MEMORY_SIZE-1)] >= 0)
+         step.opcode = opcodes[step.pc&(MEMORY_SIZE-1)];
+      else
+         in.ok = false;
+
+      step.changed = 0;
+      if(flags & TRACE_REC_REGS)
+      {
+         step.changed = in.varint();
+         for(int i=0; i<TRACE_REGS; i++)
+         {
+            if(!(step.changed & (1<<i)))
+               continue;
+            step.regs.r[i] = byteRegister(i) ? in.byte() : in.varint();
+         }
+      }
+
+      step.writes = 0;
+      if(flags & TRACE_REC_MEM)
+      {
+         uint32_t count = in.varint();
+         for(uint32_t w=0; w<count; w++)
+         {
+            prevWrite += in.zigzag();
+            uint8_t value = in.byte();
+            if(step.writes < TRACE_MAX_WRITES)
+            {
+               step.writeAddr[step.writes] = prevWrite;
+               step.writeValue[step.writes] = value;
+               ++step.writes;
+            }
+         }
+      }
+
+      step.frameEnd = flags & TRACE_REC_FRAME;
+      steps.push_back(step);
+
+      prevPc = step.pc;
+      ++step.instruction;
+      if(step.frameEnd)
+         ++step.frame;
+   }
+
+   return in.ok && (steps.size() == c.instructions);
+}
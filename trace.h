@@ -0,0 +1,245 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include "machine.h"
+#include "ringbuffer.h"
+
+/**
+ * Execution trace file, little endian throughout:
+ *
+ *   "C8TR" u32 version
+ *   chunk*                   TRACE_CHUNK_INSTRUCTIONS instructions each
+ *   index                    one TraceChunkInfo per chunk
+ *   u64 index offset, u32 chunks, "C8IX"
+ *
+ * A chunk starts with the register state before its first instruction, so
+ * it decodes on its own. Each instruction is a flags byte followed by the
+ * fields the flags announce (see TRACE_REC_*), all varints zigzag or plain.
+ * The pc is only stored when it is not the previous pc+2 and the opcode
+ * only when it differs from the last one seen at that pc in the chunk.
+ *
+ * Without the trailing index (the recorder was killed) the reader rebuilds
+ * it with one pass over the chunks.
+ */
+
+#define TRACE_VERSION 1
+
+// instructions per chunk, the granularity of the index
+#define TRACE_CHUNK_INSTRUCTIONS 4096
+
+// index summaries track addresses in 16 byte pages
+#define TRACE_PAGE_SHIFT 4
+#define TRACE_PAGES      (MEMORY_SIZE>>TRACE_PAGE_SHIFT)
+
+// events between the cpu and the writer thread
+#define TRACE_RING_SIZE  (1<<16)
+#define TRACE_BATCH_SIZE 256
+
+// record flags
+#define TRACE_REC_PC     0x01 // zigzag pc delta from pc+2 follows
+#define TRACE_REC_OPCODE 0x02 // big endian opcode follows
+#define TRACE_REC_REGS   0x04 // changed register mask and values follow
+#define TRACE_REC_MEM    0x08 // write count, (zigzag address delta, value)*
+#define TRACE_REC_FRAME  0x10 // a frame ended with this instruction
+
+// traced registers, the pc is implied by the records
+enum TraceReg
+{
+   TRACE_V0,
+   TRACE_I = GENERAL_REGS,
+   TRACE_SP,
+   TRACE_DT,
+   TRACE_ST,
+   TRACE_KEYS,
+   TRACE_REGS
+};
+
+// most writes a single instruction makes (FX55 with X=F)
+#define TRACE_MAX_WRITES GENERAL_REGS
+
+struct TraceRegs
+{
+   uint16_t r[TRACE_REGS];
+};
+
+/**
+ * One decoded instruction of a trace.
+ */
+struct TraceStep
+{
+   uint64_t instruction;        // 0 based instruction number
+   uint32_t frame;              // frames completed before it ran
+   uint16_t pc;
+   uint16_t opcode;
+   uint32_t changed;            // bit n set when register n changed
+   TraceRegs regs;              // registers after the instruction
+   bool frameEnd;
+   int writes;
+   uint16_t writeAddr[TRACE_MAX_WRITES];
+   uint8_t writeValue[TRACE_MAX_WRITES];
+};
+
+struct TraceChunkInfo
+{
+   uint64_t offset;
+   uint64_t firstInstruction;
+   uint32_t firstFrame;
+   uint32_t instructions;
+   uint16_t opcodeNibbles;                 // bit n: an opcode nNNN ran
+   uint8_t pcPages[TRACE_PAGES/8];         // pages instructions ran from
+   uint8_t writePages[TRACE_PAGES/8];      // pages that were written
+};
+
+/**
+ * Records every executed instruction to a trace file.
+ *
+ * The cpu thread only appends fixed size events to a local batch and hands
+ * full batches to a lock free ring. A writer thread owns all encoding and
+ * file output. The ring waits (never drops) when the writer falls behind,
+ * so a trace is always complete.
+ */
+class TraceRecorder
+{
+public:
+   TraceRecorder(Machine& machine);
+   ~TraceRecorder();
+
+   bool open(const char* path);
+
+   /**
+    * Flushes the pending events, writes the index and stops the writer.
+    */
+   void close();
+
+   /**
+    * Called on the cpu thread before an instruction executes.
+    */
+   void begin(uint16_t pc, uint16_t opcode)
+   {
+      Event e = { EVENT_EXEC, 0, pc, opcode };
+      add(e);
+   }
+
+   /**
+    * Called on the cpu thread for every emulated memory write.
+    */
+   void onWrite(uint16_t addr, uint8_t value)
+   {
+      Event e = { EVENT_MEM, 0, addr, value };
+      add(e);
+   }
+
+   /**
+    * Called on the cpu thread after the instruction and the timers ran.
+    */
+   void end(bool frameEnd);
+
+   uint64_t bytesWritten() const { return bytes; }
+   uint64_t instructionsWritten() const { return instructions; }
+   uint32_t writerStalls() const { return stalls; }
+
+private:
+   enum EventType { EVENT_EXEC, EVENT_MEM, EVENT_REG, EVENT_FRAME };
+
+   struct Event
+   {
+      uint8_t type;
+      uint8_t reg;
+      uint16_t addr;
+      uint16_t value;
+   };
+
+   void add(const Event& e)
+   {
+      batch[batched++] = e;
+      if(batched == TRACE_BATCH_SIZE)
+         flushBatch();
+   }
+
+   void flushBatch();
+
+   static void* writerMain(void* arg);
+   void encode(const Event& e);
+   void finishRecord();
+   void finishChunk();
+   void writeIndex();
+
+   Machine& mach;
+
+   // cpu thread side
+   Event batch[TRACE_BATCH_SIZE];
+   int batched;
+   TraceRegs last;
+   uint32_t stalls;
+
+   SpscRing<Event, TRACE_RING_SIZE>* ring;
+   std::atomic<bool> closing;
+   pthread_t thread;
+   bool running;
+
+   // writer thread side
+   FILE* out;
+   uint64_t bytes;
+   uint64_t instructions;
+   uint32_t frame;
+   TraceRegs regs;
+   bool inRecord;
+   uint16_t recordPc;
+   uint16_t recordOpcode;
+   uint16_t prevPc;
+   uint32_t changed;
+   bool recordFrameEnd;
+   std::vector<uint8_t> memBytes;
+   int memWrites;
+   uint16_t prevWrite;
+
+   std::vector<uint8_t> chunk;
+   TraceChunkInfo info;
+   TraceRegs chunkRegs;
+   uint16_t chunkPrevPc;
+   int32_t chunkOpcodes[MEMORY_SIZE]; // last opcode per pc, -1 unknown
+   std::vector<TraceChunkInfo> index;
+};
+
+/**
+ * Reads a trace file through a read only mapping.
+ */
+class TraceReader
+{
+public:
+   TraceReader();
+   ~TraceReader();
+
+   bool open(const char* path);
+
+   size_t chunkCount() const { return index.size(); }
+   const TraceChunkInfo& chunk(size_t n) const { return index[n]; }
+   uint64_t instructionCount() const;
+   uint64_t fileSize() const { return size; }
+
+   /**
+    * Decodes all instructions of one chunk.
+    */
+   bool decodeChunk(size_t n, std::vector<TraceStep>& steps) const;
+
+   /**
+    * Finds the chunk holding an instruction number, -1 past the end.
+    */
+   long findChunk(uint64_t instruction) const;
+
+private:
+   bool readIndex();
+   bool rebuildIndex();
+
+   const uint8_t* data;
+   size_t size;
+   std::vector<TraceChunkInfo> index;
+};
+
+#endif //TRACE_H
@@ -0,0 +1,64 @@
+#include "transposition.h"
+#include <stdio.h>
+
+// compile every member, not only the ones a caller uses
+template class TranspositionTable<uint32_t>;
+
+int transpositionSelfTest()
+{
+   // two buckets, even hashes share bucket 0 and odd ones bucket 1
+   TranspositionTable<uint32_t> table(2*TRANSPOSITION_WAYS);
+   const char* failed = NULL;
+
+   if(table.capacity() != 2*TRANSPOSITION_WAYS)
+      failed = "capacity";
+
+   for(uint32_t i=0; (failed == NULL) && (i<TRANSPOSITION_WAYS); i++)
+      table.store(2*i, 100+i);
+   table.store(1, 1);
+   for(uint32_t i=0; (failed == NULL) && (i<TRANSPOSITION_WAYS); i++)
+   {
+      const uint32_t* v = table.find(2*i);
+      if((v == NULL) || (*v != 100+i))
+         failed = "find";
+   }
+   if((failed == NULL) && (table.find(2*TRANSPOSITION_WAYS) != NULL))
+      failed = "find of a hash never stored";
+
+   // a full bucket replaces its oldest entry, a store of a hash already
+   // there replaces that entry and makes it the newest
+   if(failed == NULL)
+   {
+      table.store(2*TRANSPOSITION_WAYS, 200);
+      table.store(2, 201);
+      table.store(2*TRANSPOSITION_WAYS+2, 202);
+      const uint32_t* v1 = table.find(2);
+      const uint32_t* v2 = table.find(2*TRANSPOSITION_WAYS);
+      const uint32_t* v3 = table.find(2*TRANSPOSITION_WAYS+2);
+      if((table.find(0) != NULL) || (table.find(4) != NULL))
+         failed = "replacement of the oldest entry";
+      else if((v1 == NULL) || (*v1 != 201) || (v2 == NULL) || (*v2 != 200) ||
+              (v3 == NULL) || (*v3 != 202))
+         failed = "replacement of the same hash";
+      else if((table.find(1) == NULL) || (*table.find(1) != 1))
+         failed = "other bucket";
+   }
+
+   if((failed == NULL) && (table.getStores() != TRANSPOSITION_WAYS+4))
+      failed = "store count";
+
+   if(failed == NULL)
+   {
+      table.clear();
+      if((table.find(1) != NULL) || (table.find(2) != NULL))
+         failed = "clear";
+   }
+
+   if(failed != NULL)
+   {
+      printf("transposition: %s failed\n", failed);
+      return 1;
+   }
+   printf("transposition: ok\n");
+   return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef TRANSPOSITION_H
+#define TRANSPOSITION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// entries per bucket, a lookup probes one bucket
+#define TRANSPOSITION_WAYS 4
+
+/**
+ * Fixed size hash table from state hashes (Machine::stateHash()) to search
+ * results, so a tree search can skip states it has already expanded.
+ *
+ * Buckets of TRANSPOSITION_WAYS entries, a store replaces the same hash,
+ * else a free entry, else the oldest entry of the bucket. The full 64 bit
+ * hash is kept, so a find() only returns the value stored for that exact
+ * hash. Not thread safe, use one table per search thread.
+ */
+template<typename T>
+class TranspositionTable
+{
+public:
+   /**
+    * @param[in] entries: Capacity, rounded up to a power of two
+    */
+   TranspositionTable(size_t entries) :
+      hits(0),
+      misses(0),
+      stores(0),
+      clock(0)
+   {
+      size_t buckets = 1;
+      while(buckets*TRANSPOSITION_WAYS < entries)
+         buckets <<= 1;
+      table.resize(buckets*TRANSPOSITION_WAYS);
+      mask = buckets-1;
+      clear();
+   }
+
+   /**
+    * @return the value stored for a hash, NULL if it is not (or no longer)
+    *         in the table
+    */
+   const T* find(uint64_t hash)
+   {
+      Entry* bucket = &table[(hash & mask)*TRANSPOSITION_WAYS];
+      for(int i=0; i<TRANSPOSITION_WAYS; i++)
+      {
+         if((bucket[i].age != 0) && (bucket[i].hash == hash))
+         {
+            ++hits;
+            return &bucket[i].value;
+         }
+      }
+      ++misses;
+      return NULL;
+   }
+
+   void store(uint64_t hash, const T& value)
+   {
+      Entry* bucket = &table[(hash & mask)*TRANSPOSITION_WAYS];
+      Entry* victim = &bucket[0];
+      for(int i=0; i<TRANSPOSITION_WAYS; i++)
+      {
+         if((bucket[i].age != 0) && (bucket[i].hash == hash))
+         {
+            victim = &bucket[i];
+            break;
+         }
+         if(bucket[i].age < victim->age)
+            victim = &bucket[i];
+      }
+      victim->hash = hash;
+      victim->age = ++clock;
+      victim->value = value;
+      ++stores;
+   }
+
+   void clear()
+   {
+      for(size_t i=0; i<table.size(); i++)
+         table[i].age = 0;
+      clock = 0;
+   }
+
+   size_t capacity() const { return table.size(); }
+   uint64_t getHits() const { return hits; }
+   uint64_t getMisses() const { return misses; }
+   uint64_t getStores() const { return stores; }
+
+private:
+   struct Entry
+   {
+      uint64_t hash;
+      uint64_t age;   // store order, 0 is a free entry
+      T value;
+   };
+
+   std::vector<Entry> table;
+   size_t mask;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t stores;
+   uint64_t clock;
+};
+
+/**
+ * Checks store, find and bucket replacement on a small table and prints a
+ * line.
+ *
+ * @return 0 when the table behaves
+ */
+int transpositionSelfTest();
+
+#endif //TRANSPOSITION_H